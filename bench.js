@@ -0,0 +1,376 @@
+const fs = require('fs');
+const childProcess = require('child_process');
+const Nimiq = require('@nimiq/core');
+const NativeMiner = require('bindings')('nimiq_miner_opencl.node');
+
+const HEADER_SIZE = 146;
+const NONCE_OFFSET = 142;
+const HASH_SIZE = 32;
+const UNREACHABLE_SHARE_COMPACT = 0x03000001; // target of 1
+const WARMUP_TIME = 3; // seconds
+const KERNEL_TIME_RUNS = 5; // computeHashes batches averaged for the per-kernel times
+const MEMORY_BOUND_SHARE = 70; // % of the copy bandwidth from which the argon2 kernel counts as memory-bound
+
+const DEFAULTS = {
+    device: undefined, // all
+    allDevices: false,
+    memory: 256,
+    threads: 1,
+    cache: [2],
+    jobs: [2],
+    tmto: [0],
+    threadsPerLane: [32],
+    blake2b: ['scalar'],
+    argon2: undefined, // Nimiq
+    duration: 20,
+    verify: true,
+    fullVerify: false,
+    roofline: false,
+    baseline: 'bench-baseline.json',
+    updateBaseline: false,
+    tolerance: 3
+};
+
+const USAGE = `Usage: node bench.js [options]
+
+Checks the OpenCL kernels against the reference Argon2d and measures their throughput.
+
+  --device <n>          Device to test (default: all)
+  --all-devices         Include non-GPU OpenCL devices, e.g. POCL on a CPU
+  --memory <mb>         Memory per thread (default: ${DEFAULTS.memory})
+  --threads <n>         Threads per device (default: ${DEFAULTS.threads})
+  --cache <list>        CACHE_SIZE values to sweep, e.g. 2,4,8
+  --jobs <list>         JOBS_PER_BLOCK values to sweep, e.g. 1,2,4,8
+  --tmto <list>         Time-memory tradeoff factors to sweep, 0 is the normal kernel, e.g. 0,2,4
+  --threads-per-lane <list>
+                        Work-items per hash to sweep, out of 8, 16 and 32 (default: 32)
+  --blake2b <list>      BLAKE2b implementations to sweep, scalar and/or vector (default: scalar)
+  --memory-cost <n>     Argon2d memory cost in blocks (default: 512)
+  --passes <n>          Argon2d passes (default: 1)
+  --salt <string>       Argon2d salt (default: nimiqrocks!)
+  --header-length <n>   Header length in bytes, including the nonce (default: ${HEADER_SIZE})
+  --duration <s>        Throughput measurement per configuration, 0 to skip (default: ${DEFAULTS.duration})
+  --no-verify           Skip the golden vectors
+  --full-verify         Check every nonce of a batch, not only a sample
+  --roofline            Report the bandwidth of each kernel against a streaming copy on the device
+  --baseline <file>     Throughput baselines (default: ${DEFAULTS.baseline})
+  --update-baseline     Store the measured throughput as the new baseline
+  --tolerance <pct>     Allowed slowdown against the baseline (default: ${DEFAULTS.tolerance})`;
+
+function parseArgs(argv) {
+    const options = Object.assign({}, DEFAULTS);
+    const list = value => value.split(',').map(v => parseInt(v, 10));
+    const argon2 = (name, value) => options.argon2 = Object.assign({}, options.argon2, { [name]: value });
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        switch (arg) {
+            case '--device': options.device = parseInt(argv[++i], 10); break;
+            case '--all-devices': options.allDevices = true; break;
+            case '--memory': options.memory = parseInt(argv[++i], 10); break;
+            case '--threads': options.threads = parseInt(argv[++i], 10); break;
+            case '--cache': options.cache = list(argv[++i]); break;
+            case '--jobs': options.jobs = list(argv[++i]); break;
+            case '--tmto': options.tmto = list(argv[++i]); break;
+            case '--threads-per-lane': options.threadsPerLane = list(argv[++i]); break;
+            case '--blake2b': options.blake2b = argv[++i].split(','); break;
+            case '--memory-cost': argon2('memoryCost', parseInt(argv[++i], 10)); break;
+            case '--passes': argon2('passes', parseInt(argv[++i], 10)); break;
+            case '--salt': argon2('salt', argv[++i]); break;
+            case '--header-length': argon2('headerLength', parseInt(argv[++i], 10)); break;
+            case '--duration': options.duration = parseFloat(argv[++i]); break;
+            case '--no-verify': options.verify = false; break;
+            case '--full-verify': options.fullVerify = true; break;
+            case '--roofline': options.roofline = true; break;
+            case '--baseline': options.baseline = argv[++i]; break;
+            case '--update-baseline': options.updateBaseline = true; break;
+            case '--tolerance': options.tolerance = parseFloat(argv[++i]); break;
+            default:
+                console.log(USAGE);
+                process.exit(arg === '--help' ? 0 : 1);
+        }
+    }
+    return options;
+}
+
+// Fixed headers, the nonce is overwritten per hash
+function makeHeader(fill, nbits, height, timestamp) {
+    const header = new Uint8Array(HEADER_SIZE);
+    const view = new DataView(header.buffer);
+    for (let i = 0; i < NONCE_OFFSET; i++) {
+        header[i] = fill(i);
+    }
+    view.setUint16(0, 1);
+    view.setUint32(130, nbits);
+    view.setUint32(134, height);
+    view.setUint32(138, timestamp);
+    return header;
+}
+
+const VECTORS = [
+    { name: 'zero', header: makeHeader(() => 0, 0x1f010000, 1, 0), startNonce: 0 },
+    { name: 'pattern', header: makeHeader(i => (i * 7 + 3) & 0xff, 0x1d00ffff, 1234567, 1546300800), startNonce: 12345678 },
+    { name: 'high-nonce', header: makeHeader(i => (0xff - i) & 0xff, 0x1a0fffff, 0xfffffffe, 0xffffffff), startNonce: 0xf0000000 }
+];
+
+function sampleIndices(noncesPerRun, full) {
+    if (full) {
+        return [...Array(noncesPerRun).keys()];
+    }
+    const indices = new Set();
+    for (let i = 0; i < 8; i++) {
+        indices.add(i);
+        indices.add(noncesPerRun - 1 - i);
+    }
+    for (let i = 0; i < 16; i++) {
+        indices.add(Math.floor(i * noncesPerRun / 16));
+    }
+    return [...indices].sort((a, b) => a - b);
+}
+
+async function referenceHash(cryptoWorker, header, nonce) {
+    const input = new Uint8Array(header);
+    new DataView(input.buffer).setUint32(NONCE_OFFSET, nonce);
+    return Buffer.from(await cryptoWorker.computeArgon2d(input));
+}
+
+function computeHashes(miner, deviceIndex, header, startNonce) {
+    return new Promise((resolve, reject) => {
+        miner.computeHashes(deviceIndex, header, startNonce, (error, obj) => error ? reject(error) : resolve(obj));
+    });
+}
+
+// Zero hashes are nonces the time-memory tradeoff gave up on, without tmto they are failures
+async function verify(miner, deviceIndex, fullVerify, tmto) {
+    const cryptoWorker = await Nimiq.CryptoWorker.getInstanceAsync();
+    const failures = [];
+    let checked = 0;
+    let skipped = 0;
+    for (const vector of VECTORS) {
+        const result = await computeHashes(miner, deviceIndex, vector.header, vector.startNonce);
+        for (const idx of sampleIndices(result.noncesPerRun, fullVerify)) {
+            const nonce = vector.startNonce + idx;
+            const expected = await referenceHash(cryptoWorker, vector.header, nonce);
+            const actual = result.hashes.slice(idx * HASH_SIZE, (idx + 1) * HASH_SIZE);
+            if (tmto > 0 && actual.every(byte => byte === 0)) {
+                skipped++; // too deep to recompute in tmto mode
+                continue;
+            }
+            if (!expected.equals(actual)) {
+                failures.push(`${vector.name}, nonce ${nonce}: expected ${expected.toString('hex')}, got ${actual.toString('hex')}`);
+            }
+            checked++;
+        }
+    }
+    return { checked, failures, skipped };
+}
+
+function measureBandwidth(miner, deviceIndex) {
+    return new Promise((resolve, reject) => {
+        miner.measureBandwidth(deviceIndex, (error, obj) => error ? reject(error) : resolve(obj));
+    });
+}
+
+// Achieved bandwidth of each kernel as a share of the copy bandwidth, and the hashrate that bandwidth would allow
+function printRoofline(report) {
+    const peak = report.copy.bandwidth;
+    const line = (name, kernel) => `    ${name.padEnd(12)}${kernel.bandwidth.toFixed(1).padStart(8)} GB/s ${(kernel.bandwidth / peak * 100).toFixed(0).padStart(4)}%  ${(kernel.bytes / report.noncesPerRun / 1024).toFixed(1)} KiB/hash in ${kernel.time.toFixed(2)} ms`;
+    const kernels = [report.initMemory, report.argon2, report.getHashes];
+    const bytesPerHash = kernels.reduce((sum, kernel) => sum + kernel.bytes, 0) / report.noncesPerRun;
+    const time = kernels.reduce((sum, kernel) => sum + kernel.time, 0);
+    const share = report.argon2.bandwidth / peak * 100;
+    console.log(`    copy        ${peak.toFixed(1).padStart(8)} GB/s  peak`);
+    console.log(line('init_memory', report.initMemory));
+    console.log(line('argon2', report.argon2) + `, ${report.argon2.refMisses.toFixed(0)} ref misses/hash${report.argon2.refMissesMeasured ? '' : ' (estimated)'}`);
+    console.log(line('get_hashes', report.getHashes));
+    console.log(`    ${(report.noncesPerRun / time).toFixed(2)} kH/s of ${(peak * 1e6 / bytesPerHash).toFixed(2)} kH/s at peak bandwidth, ` +
+        (share >= MEMORY_BOUND_SHARE ? 'memory-bound' : 'compute- or latency-bound, kernel tuning can still pay off'));
+}
+
+// Average time of the init_memory and get_hashes kernels, the BLAKE2b phases, next to the Argon2 loop
+async function measureKernelTimes(miner, deviceIndex, header) {
+    const totals = { initMemory: 0, argon2: 0, getHashes: 0 };
+    await computeHashes(miner, deviceIndex, header, 0); // warm-up
+    for (let i = 0; i < KERNEL_TIME_RUNS; i++) {
+        const result = await computeHashes(miner, deviceIndex, header, 0);
+        Object.keys(totals).forEach(kernel => totals[kernel] += result.kernelTimes[kernel] / KERNEL_TIME_RUNS);
+    }
+    return totals;
+}
+
+function measureHashrate(miner, header, duration) {
+    return new Promise((resolve, reject) => {
+        let hashes = 0;
+        let start;
+        miner.setShareCompact(UNREACHABLE_SHARE_COMPACT);
+        miner.startMiningOnBlock(header, (error, obj) => {
+            if (error) {
+                reject(error);
+                return;
+            }
+            if (!obj.done && start) {
+                hashes += obj.hashes;
+            }
+        });
+        setTimeout(() => {
+            start = Date.now();
+            setTimeout(() => {
+                const elapsed = (Date.now() - start) / 1000;
+                miner.stop();
+                resolve(hashes / elapsed);
+            }, duration * 1000);
+        }, WARMUP_TIME * 1000);
+    });
+}
+
+// Each configuration needs its own program and buffers, so it runs in a fresh process
+async function runConfiguration(config) {
+    const miner = new NativeMiner.Miner({ allDevices: config.allDevices, argon2: config.argon2 });
+    miner.getDevices().forEach((device, idx) => {
+        device.enabled = (idx === config.device);
+        if (device.enabled) {
+            device.memory = config.memory;
+            device.threads = config.threads;
+            device.cache = config.cache;
+            device.jobs = config.jobs;
+            device.tmto = config.tmto;
+            device.threadsPerLane = config.threadsPerLane;
+            device.vectorBlake2b = (config.blake2b === 'vector');
+        }
+    });
+
+    const ready = await new Promise((resolve, reject) => {
+        miner.initializeDevices((error, obj) => error ? reject(error) : resolve(obj));
+    });
+
+    // The reference Argon2d only knows the Nimiq parameters
+    const result = { buildTime: ready.buildTime };
+    if (config.verify && !config.argon2) {
+        result.verify = await verify(miner, config.device, config.fullVerify, config.tmto);
+    }
+    if (config.roofline) {
+        result.roofline = await measureBandwidth(miner, config.device);
+    }
+    if (config.duration > 0) {
+        const headerLength = (config.argon2 && config.argon2.headerLength) || HEADER_SIZE;
+        const header = (headerLength === HEADER_SIZE) ? VECTORS[1].header : new Uint8Array(headerLength).map((v, i) => (i * 7 + 3) & 0xff);
+        result.kernelTimes = await measureKernelTimes(miner, config.device, header);
+        result.hashrate = await measureHashrate(miner, header, config.duration);
+    }
+    return result;
+}
+
+function forkConfiguration(config) {
+    return new Promise((resolve) => {
+        const child = childProcess.fork(__filename, ['--child', JSON.stringify(config)]);
+        let result;
+        child.on('message', msg => result = msg);
+        child.on('exit', code => resolve(result || { error: `exited with code ${code}` }));
+    });
+}
+
+function readBaselines(fileName) {
+    try {
+        return JSON.parse(fs.readFileSync(fileName));
+    } catch (e) {
+        return {};
+    }
+}
+
+async function main(options) {
+    const devices = new NativeMiner.Miner({ allDevices: options.allDevices }).getDevices();
+    const deviceIndices = (options.device !== undefined) ? [options.device] : devices.map((device, idx) => idx);
+    const baselines = readBaselines(options.baseline);
+    let failed = false;
+
+    for (const deviceIndex of deviceIndices) {
+        const device = devices[deviceIndex];
+        if (!device) {
+            console.error(`No device #${deviceIndex}`);
+            process.exit(1);
+        }
+        console.log(`#${deviceIndex}: ${device.name} (${device.vendor}, driver ${device.driverVersion})`);
+
+        const configs = [];
+        for (const blake2b of options.blake2b) {
+            for (const threadsPerLane of options.threadsPerLane) {
+                for (const tmto of options.tmto) {
+                    for (const cache of options.cache) {
+                        for (const jobs of options.jobs) {
+                            configs.push({ cache, jobs, tmto, threadsPerLane, blake2b });
+                        }
+                    }
+                }
+            }
+        }
+
+        for (const { cache, jobs, tmto, threadsPerLane, blake2b } of configs) {
+            const config = Object.assign({}, options, { device: deviceIndex, cache, jobs, tmto, threadsPerLane, blake2b });
+            const tmtoKey = tmto > 0 ? `,tmto=${tmto}` : '';
+            // Keys of the default kernels stay compatible with older baselines
+            const lanesKey = threadsPerLane !== 32 ? `,threadsPerLane=${threadsPerLane}` : '';
+            const blake2bKey = blake2b !== 'scalar' ? `,blake2b=${blake2b}` : '';
+            const argon2Key = options.argon2 ? `|argon2=${JSON.stringify(options.argon2)}` : '';
+            const key = `${device.name}|${device.driverVersion}|memory=${options.memory},threads=${options.threads},cache=${cache},jobs=${jobs}${tmtoKey}${lanesKey}${blake2bKey}${argon2Key}`;
+            const result = await forkConfiguration(config);
+            const label = `  cache=${cache} jobs=${jobs}${tmto > 0 ? ` tmto=${tmto}` : ''}${threadsPerLane !== 32 ? ` threadsPerLane=${threadsPerLane}` : ''}${blake2b !== 'scalar' ? ` blake2b=${blake2b}` : ''}:`;
+
+            if (result.error) {
+                console.log(`${label} ERROR ${result.error}`);
+                failed = true;
+                continue;
+            }
+
+            const status = [`build ${result.buildTime.toFixed(0)} ms`];
+            if (result.verify) {
+                const ok = (result.verify.failures.length === 0);
+                status.push(`${result.verify.checked - result.verify.failures.length}/${result.verify.checked + result.verify.skipped} hashes ok`);
+                if (result.verify.skipped > 0) {
+                    status.push(`${result.verify.skipped} skipped`);
+                }
+                result.verify.failures.forEach(failure => console.log(`    MISMATCH ${failure}`));
+                failed = failed || !ok;
+            }
+            if (result.kernelTimes) {
+                const times = result.kernelTimes;
+                status.push(`init ${times.initMemory.toFixed(2)} ms, argon2 ${times.argon2.toFixed(2)} ms, final ${times.getHashes.toFixed(2)} ms per batch`);
+            }
+            if (result.hashrate !== undefined) {
+                const baseline = baselines[key];
+                let hashrate = `${(result.hashrate / 1000).toFixed(2)} kH/s`;
+                if (baseline) {
+                    const change = (result.hashrate / baseline - 1) * 100;
+                    hashrate += ` (${change >= 0 ? '+' : ''}${change.toFixed(1)}% vs baseline)`;
+                    if (change < -options.tolerance) {
+                        hashrate += ' REGRESSION';
+                        failed = true;
+                    }
+                }
+                status.push(hashrate);
+                if (options.updateBaseline) {
+                    baselines[key] = result.hashrate;
+                }
+            }
+            console.log(`${label} ${status.join(', ')}`);
+            if (result.roofline) {
+                printRoofline(result.roofline);
+            }
+        }
+    }
+
+    if (options.updateBaseline) {
+        fs.writeFileSync(options.baseline, JSON.stringify(baselines, null, 2) + '\n');
+        console.log(`Baselines written to ${options.baseline}`);
+    }
+    process.exit(failed ? 1 : 0);
+}
+
+if (process.argv[2] === '--child') {
+    runConfiguration(JSON.parse(process.argv[3]))
+        .then(result => process.send(result, () => process.exit(0)))
+        .catch(e => process.send({ error: e.message }, () => process.exit(1)));
+} else {
+    main(parseArgs(process.argv.slice(2))).catch(e => {
+        console.error(e);
+        process.exit(1);
+    });
+}
@@ -2,7 +2,8 @@
   'targets': [{
     'target_name': 'nimiq_miner_opencl',
     'sources': [
-      'src/native/opencl/miner.cc'
+      'src/native/opencl/miner.cc',
+      'src/native/opencl/cpu_argon2.cc'
     ],
     'include_dirs': [
       '<!(node -e "require(\'nan\')")',
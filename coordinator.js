@@ -0,0 +1,48 @@
+const Nimiq = require('@nimiq/core');
+const NonceCoordinator = require('./src/NonceCoordinator');
+
+const TAG = 'NonceCoordinator';
+
+const DEFAULTS = {
+    host: '127.0.0.1',
+    port: 4444,
+    path: undefined
+};
+
+const USAGE = `Usage: node coordinator.js [options]
+
+Leases disjoint nonce ranges to the miner processes that have "coordinator" set in miner.conf.
+
+  --host <address>      Address to listen on (default: ${DEFAULTS.host}), 0.0.0.0 for the LAN
+  --port <n>            TCP port (default: ${DEFAULTS.port})
+  --socket <path>       Listen on a Unix socket instead`;
+
+function parseArgs(argv) {
+    const options = Object.assign({}, DEFAULTS);
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        switch (arg) {
+            case '--host': options.host = argv[++i]; break;
+            case '--port': options.port = parseInt(argv[++i], 10); break;
+            case '--socket': options.path = argv[++i]; break;
+            default:
+                console.log(USAGE);
+                process.exit(arg === '--help' ? 0 : 1);
+        }
+    }
+    return options;
+}
+
+Nimiq.Log.instance.level = 'info';
+
+(async () => {
+    const options = parseArgs(process.argv.slice(2));
+    const coordinator = new NonceCoordinator();
+    await coordinator.listen(options.path ? { path: options.path } : { host: options.host, port: options.port });
+    Nimiq.Log.i(TAG, `Listening on ${options.path || `${options.host}:${options.port}`}`);
+
+    process.on('SIGINT', () => coordinator.close().then(() => process.exit(0)));
+})().catch(e => {
+    console.error(e);
+    process.exit(1);
+});
@@ -0,0 +1,290 @@
+const net = require('net');
+const crypto = require('crypto');
+const Nimiq = require('@nimiq/core');
+const NonceCoordinator = require('./src/NonceCoordinator');
+const NonceLeaseClient = require('./src/NonceLeaseClient');
+
+const TAG = 'CoordSim';
+
+const DEFAULTS = {
+    host: '127.0.0.1',
+    port: 0,
+    leaseSize: 10000,
+    batch: 1000
+};
+
+const HEADER_SIZE = 146;
+const WAIT_TIMEOUT = 5000; // ms until a step counts as failed
+const WAIT_INTERVAL = 50; // ms
+
+const USAGE = `Usage: node coordsim.js [options]
+
+Runs a NonceCoordinator and two NonceLeaseClients on localhost, with stand-ins for the native lease
+queue instead of GPUs, and checks leasing, returned leases, recovery from a dead instance, merging of
+returned ranges and the fallback when the coordinator goes away. Exits with 1 if a check fails.
+
+  --host <address>      Address to listen on (default: ${DEFAULTS.host})
+  --port <n>            TCP port, 0 picks a free one (default: ${DEFAULTS.port})
+  --lease-size <n>      Nonces per lease of the clients (default: ${DEFAULTS.leaseSize})
+  --batch <n>           Nonces per batch of the stand-in miners (default: ${DEFAULTS.batch})`;
+
+function parseArgs(argv) {
+    const options = Object.assign({}, DEFAULTS);
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        switch (arg) {
+            case '--host': options.host = argv[++i]; break;
+            case '--port': options.port = parseInt(argv[++i], 10); break;
+            case '--lease-size': options.leaseSize = parseInt(argv[++i], 10); break;
+            case '--batch': options.batch = parseInt(argv[++i], 10); break;
+            default:
+                console.log(USAGE);
+                process.exit(arg === '--help' ? 0 : 1);
+        }
+    }
+    return options;
+}
+
+// Stands in for the lease queue of the native miner, see Miner::AddNonceLease and Miner::GetNonceLeases
+class LeaseQueue {
+    constructor(batch) {
+        this.batch = batch;
+        this.workId = 0;
+        this.leased = false;
+        this.leases = [];
+        this.closed = [];
+        this.received = []; // every lease ever added
+        this.stopped = []; // work ids passed to stopLeasing
+    }
+
+    startJob(workId) {
+        this._closeAll();
+        this.workId = workId;
+        this.leased = true;
+    }
+
+    addNonceLease(workId, start, end) {
+        const lease = { workId, start, end, next: start };
+        this.received.push(lease);
+        if (workId === this.workId && this.leased) {
+            this.leases.push(lease);
+        } else {
+            this.closed.push(lease);
+        }
+    }
+
+    getNonceLeases() {
+        const closed = this.closed.map(lease => ({ workId: lease.workId, start: lease.start, end: lease.end, covered: lease.next }));
+        this.closed = [];
+        const remaining = this.leases.reduce((sum, lease) => sum + lease.end - lease.next, 0);
+        return { remaining, batch: this.batch, closed };
+    }
+
+    stopLeasing(workId) {
+        this.stopped.push(workId);
+        if (workId === this.workId && this.leased) {
+            this._closeAll();
+            this.leased = false;
+        }
+    }
+
+    // Whole batches like GetNextStartNonce, a lease tail shorter than a batch is returned. Returns the nonces mined.
+    mine(batches) {
+        let mined = 0;
+        while (batches > 0 && this.leases.length > 0) {
+            const lease = this.leases[0];
+            if (lease.next + this.batch <= lease.end) {
+                lease.next += this.batch;
+                mined += this.batch;
+                batches--;
+            } else {
+                this.closed.push(this.leases.shift());
+            }
+        }
+        return mined;
+    }
+
+    _closeAll() {
+        this.closed.push(...this.leases);
+        this.leases = [];
+    }
+}
+
+// Speaks the coordinator protocol directly, e.g. for an instance that dies without returning its leases
+class RawInstance {
+    constructor(target) {
+        this._messages = [];
+        this._waiting = [];
+        this._socket = net.connect(target);
+        let buffer = '';
+        this._socket.setEncoding('utf8');
+        this._socket.on('data', data => {
+            buffer += data;
+            let newline;
+            while ((newline = buffer.indexOf('\n')) !== -1) {
+                const msg = JSON.parse(buffer.slice(0, newline));
+                buffer = buffer.slice(newline + 1);
+                const waiting = this._waiting.shift();
+                if (waiting) {
+                    waiting(msg);
+                } else {
+                    this._messages.push(msg);
+                }
+            }
+        });
+    }
+
+    send(msg) {
+        this._socket.write(JSON.stringify(msg) + '\n');
+    }
+
+    // Resolves with the next message, requests are answered in order
+    request(msg) {
+        this.send(msg);
+        return new Promise(resolve => {
+            if (this._messages.length > 0) {
+                resolve(this._messages.shift());
+            } else {
+                this._waiting.push(resolve);
+            }
+        });
+    }
+
+    destroy() {
+        this._socket.destroy();
+    }
+}
+
+function makeHeader() {
+    return crypto.randomBytes(HEADER_SIZE);
+}
+
+async function waitFor(condition) {
+    const deadline = Date.now() + WAIT_TIMEOUT;
+    while (!condition()) {
+        if (Date.now() > deadline) {
+            return false;
+        }
+        await new Promise(resolve => setTimeout(resolve, WAIT_INTERVAL));
+    }
+    return true;
+}
+
+function overlaps(leases) {
+    const sorted = leases.slice().sort((a, b) => a.start - b.start);
+    return sorted.some((lease, i) => i > 0 && lease.start < sorted[i - 1].end);
+}
+
+class CoordinatorSimulator {
+    constructor(options) {
+        this._options = options;
+        this._checks = [];
+    }
+
+    _check(name, passed, detail) {
+        this._checks.push({ name, passed, detail });
+        if (passed) {
+            Nimiq.Log.i(TAG, `PASS ${name}`);
+        } else {
+            Nimiq.Log.e(TAG, `FAIL ${name}${detail ? ` - ${detail}` : ''}`);
+        }
+    }
+
+    _job(header) {
+        const key = NonceLeaseClient.getJobKey(header);
+        return this._coordinator.getStatus().jobs.find(job => job.job === key);
+    }
+
+    async start() {
+        const options = this._options;
+        this._coordinator = new NonceCoordinator();
+        const address = await this._coordinator.listen({ host: options.host, port: options.port });
+        const target = { host: options.host, port: address.port };
+        Nimiq.Log.i(TAG, `Coordinator on ${options.host}:${address.port}`);
+
+        // Two miner processes mining the same header
+        const queues = [new LeaseQueue(options.batch), new LeaseQueue(options.batch)];
+        const clients = queues.map((queue, i) => {
+            const client = new NonceLeaseClient(queue, Object.assign({ name: `sim-${i}`, leaseSize: options.leaseSize }, target));
+            client.on('lost', workId => {
+                queue.stopLeasing(workId);
+                client.stopJob();
+            });
+            return client;
+        });
+        await waitFor(() => clients.every(client => client.connected));
+
+        const header1 = makeHeader();
+        queues.forEach(queue => queue.startJob(1));
+        clients.forEach(client => client.startJob(1, header1));
+        const leased = await waitFor(() => queues.every(queue => queue.leases.length > 0));
+        const received = queues.reduce((all, queue) => all.concat(queue.received), []);
+        this._check('lease: every instance gets nonces', leased);
+        this._check('lease: leases are disjoint', !overlaps(received), JSON.stringify(received));
+
+        // The first instance mines a few batches and moves on, the rest of its lease is returned
+        const mined = queues[0].mine(3);
+        const leaseTotal = queues[0].received.reduce((sum, lease) => sum + lease.end - lease.start, 0);
+        const header2 = makeHeader();
+        queues[0].startJob(2);
+        clients[0].startJob(2, header2);
+        const closed = await waitFor(() => this._job(header1).covered === mined);
+        const job1 = this._job(header1);
+        this._check('close: mined nonces are covered', closed, JSON.stringify(job1));
+        this._check('close: the rest is returned', job1.free === leaseTotal - mined, JSON.stringify(job1));
+
+        // The second instance moves on without mining, its lease follows the first one's returned tail
+        queues[1].startJob(2);
+        clients[1].startJob(2, header2);
+        await waitFor(() => this._job(header1).leased === 0);
+        const raw = new RawInstance(target);
+        const job1Key = NonceLeaseClient.getJobKey(header1);
+        const free = this._job(header1).free;
+        const merged = await raw.request({ message: 'lease', job: job1Key, count: free });
+        this._check('merge: adjacent returned ranges are leased as one', merged.message === 'lease' && merged.end - merged.start === free,
+            JSON.stringify(merged));
+
+        // An instance that dies keeps nothing, its lease is the next one handed out
+        const header3 = makeHeader();
+        const job3Key = NonceLeaseClient.getJobKey(header3);
+        const lost = await raw.request({ message: 'lease', job: job3Key, count: options.leaseSize });
+        raw.destroy();
+        const recovered = await waitFor(() => this._job(header3).leased === 0);
+        this._check('recovery: leases of a dead instance are returned', recovered, JSON.stringify(this._job(header3)));
+        const raw2 = new RawInstance(target);
+        const again = await raw2.request({ message: 'lease', job: job3Key, count: options.leaseSize });
+        this._check('recovery: the returned range is leased again', again.start === lost.start && again.end === lost.end,
+            `${JSON.stringify(lost)} then ${JSON.stringify(again)}`);
+        raw2.destroy();
+
+        // Requests the coordinator can't make sense of are dropped unanswered without harming the job
+        const raw3 = new RawInstance(target);
+        raw3.send({ message: 'lease', job: job3Key, count: 'many' });
+        const valid = await raw3.request({ message: 'lease', job: job3Key, count: options.leaseSize });
+        this._check('validation: a bad count leaves the job usable', valid.message === 'lease' && Number.isInteger(valid.end), JSON.stringify(valid));
+        raw3.destroy();
+
+        // Without the coordinator the current job goes on with the local nonce range
+        await this._coordinator.close();
+        const fellBack = await waitFor(() => queues.every(queue => queue.stopped.includes(2)));
+        this._check('fallback: clients stop leasing when the coordinator is gone', fellBack,
+            JSON.stringify(queues.map(queue => queue.stopped)));
+        clients.forEach(client => client.close());
+
+        return {
+            checks: this._checks.length,
+            failed: this._checks.filter(check => !check.passed).map(check => check.name)
+        };
+    }
+}
+
+Nimiq.Log.instance.level = 'info';
+
+(async () => {
+    const report = await new CoordinatorSimulator(parseArgs(process.argv.slice(2))).start();
+    console.log(JSON.stringify(report, null, 2));
+    process.exit(report.failed.length > 0 ? 1 : 0);
+})().catch(e => {
+    console.error(e);
+    process.exit(1);
+});
@@ -1,3 +1,4 @@
+const fs = require('fs');
 const os = require('os');
 const pjson = require('./package.json');
 const Nimiq = require('@nimiq/core');
@@ -9,6 +10,11 @@ const Log = Nimiq.Log;
 const TAG = 'SushiMiner';
 const $ = {};
 
+const DESIRED_SPS = 5;
+const DEFAULT_HASHRATE = 100; // kH/s
+const CALIBRATION_FILE = './calibration.json';
+const CALIBRATION_TIME = 10; // seconds
+
 Log.instance.level = 'info';
 
 const config = Utils.readConfigFile('./miner.conf');
@@ -19,15 +25,15 @@ if (!config) {
 (async () => {
     const address = config.address;
     const deviceName = config.name || os.hostname();
-    const hashrate = (config.hashrate > 0) ? config.hashrate : 100; // 100 kH/s by default
-    const desiredSps = 5;
-    const startDifficulty = (1e3 * hashrate * desiredSps) / (1 << 16);
+    // Without an expected hashrate, startDifficulty is set from a calibration run before connecting
+    const startDifficulty = (config.hashrate > 0) ? getStartDifficulty(1e3 * config.hashrate) : undefined;
     const minerVersion = 'Sushi Miner ' + pjson.version + ' OpenCL';
     const deviceData = { deviceName, startDifficulty, minerVersion };
     const deviceOptions = Utils.getDeviceOptions(config);
+    const poolOptions = Utils.getPoolOptions(config);
 
     // if not specified in the config file, defaults to dumb to make LTD happy :)
-    const consensusType = config.consensus || (config.host.toLowerCase().includes('sushipool') ? 'dumb' : 'nano');
+    const consensusType = config.consensus || (poolOptions.hosts[0].host.toLowerCase().includes('sushipool') ? 'dumb' : 'nano');
 
     const setup = { // can add other miner types here
         'dumb': setupDumbPoolMiner,
@@ -39,24 +45,71 @@ if (!config) {
     }
 
     Log.i(TAG, `Nimiq ${minerVersion} starting`);
-    Log.i(TAG, `- pool server      = ${config.host}:${config.port}`);
+    Log.i(TAG, `- pool server      = ${poolOptions.hosts.map(entry => `${entry.host}:${entry.port}`).join(', ')}`);
     Log.i(TAG, `- address          = ${address}`);
     Log.i(TAG, `- consensus        = ${consensusType}`);
     Log.i(TAG, `- device name      = ${deviceName}`);
 
-    await createMiner(address, config, deviceData, deviceOptions);
+    // Signals would end the process without 'exit', which flushes the work recording. The exit code stays
+    // the one of a kill by that signal.
+    if (deviceOptions.record) {
+        ['SIGINT', 'SIGTERM'].forEach(signal => process.once(signal, () => process.exit(128 + os.constants.signals[signal])));
+    }
+
+    await createMiner(address, config, deviceData, deviceOptions, poolOptions);
 
 })().catch(e => {
     console.error(e);
     process.exit(1);
 });
 
+function getStartDifficulty(hashrate) {
+    return (hashrate * DESIRED_SPS) / (1 << 16);
+}
+
+// Measures the hashrate of the enabled devices once per device set, later starts use the stored result
+async function calibrate(miner, deviceData) {
+    if (deviceData.startDifficulty !== undefined) {
+        return;
+    }
+
+    const key = miner.getDeviceSetKey();
+    let calibrations = {};
+    try {
+        calibrations = JSON.parse(fs.readFileSync(CALIBRATION_FILE));
+    } catch (e) {
+        // First run
+    }
+
+    let hashrate = calibrations[key];
+    if (hashrate > 0) {
+        Log.i(TAG, `Calibrated hashrate: ${Utils.humanHashrate(hashrate)} (cached)`);
+    } else {
+        Log.i(TAG, `Calibrating hashrate for ${CALIBRATION_TIME} seconds`);
+        try {
+            hashrate = await miner.calibrate(CALIBRATION_TIME);
+        } catch (e) {
+            Log.w(TAG, `Calibration failed - ${e.message}`);
+            hashrate = 0;
+        }
+        if (hashrate > 0) {
+            Log.i(TAG, `Calibrated hashrate: ${Utils.humanHashrate(hashrate)}`);
+            calibrations[key] = hashrate;
+            fs.writeFileSync(CALIBRATION_FILE, JSON.stringify(calibrations, null, 2) + '\n');
+        } else {
+            hashrate = 1e3 * DEFAULT_HASHRATE;
+        }
+    }
+    deviceData.startDifficulty = getStartDifficulty(hashrate);
+}
+
 function reportHashrates(hashrates) {
     const totalHashRate = hashrates.reduce((a, b) => a + b, 0);
     Log.i(TAG, `Hashrate: ${Utils.humanHashrate(totalHashRate)} | ${hashrates.map((hr, idx) => `GPU${idx}: ${Utils.humanHashrate(hr)}`).filter(hr => hr).join(' | ')}`);
 }
 
-async function setupNanoPoolMiner(addr, config, deviceData, deviceOptions) {
+// Reconnects are left to Nimiq.BasePoolMiner, only the preferred host is used
+async function setupNanoPoolMiner(addr, config, deviceData, deviceOptions, poolOptions) {
     Log.i(TAG, `Setting up NanoPoolMiner`);
 
     Nimiq.GenesisConfig.main();
@@ -74,10 +127,13 @@ async function setupNanoPoolMiner(addr, config, deviceData, deviceOptions) {
         Log.i(TAG, `Found share. Nonce: ${block.header.nonce}`);
     });
     $.miner.on('hashrate-changed', reportHashrates);
+    const calibration = calibrate($.miner, deviceData);
 
-    $.consensus.on('established', () => {
-        Log.i(TAG, `Connecting to ${config.host}`);
-        $.miner.connect(config.host, config.port);
+    $.consensus.on('established', async () => {
+        await calibration;
+        const { host, port } = poolOptions.hosts[0];
+        Log.i(TAG, `Connecting to ${host}`);
+        $.miner.connect(host, port);
     });
     $.consensus.on('lost', () => {
         $.miner.disconnect();
@@ -100,13 +156,14 @@ async function setupNanoPoolMiner(addr, config, deviceData, deviceOptions) {
     $.network.connect();
 }
 
-async function setupDumbPoolMiner(address, config, deviceData, deviceOptions) {
+async function setupDumbPoolMiner(address, config, deviceData, deviceOptions, poolOptions) {
     Log.i(TAG, `Setting up DumbPoolMiner`);
 
-    $.miner = new DumbPoolMiner(address, deviceData, deviceOptions);
+    $.miner = new DumbPoolMiner(address, deviceData, deviceOptions, poolOptions);
     $.miner.on('share', nonce => {
         Log.i(TAG, `Found share. Nonce: ${nonce}`);
     });
     $.miner.on('hashrate-changed', reportHashrates);
-    $.miner.connect(config.host, config.port);
+    await calibrate($.miner, deviceData);
+    $.miner.connect();
 }
\ No newline at end of file
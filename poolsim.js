@@ -0,0 +1,281 @@
+const crypto = require('crypto');
+const WebSocket = require('ws');
+const Nimiq = require('@nimiq/core');
+
+const TAG = 'PoolSim';
+
+const HEADER_SIZE = 146;
+const NBITS_OFFSET = 130;
+const HEIGHT_OFFSET = 134;
+const TIMESTAMP_OFFSET = 138;
+const NONCE_OFFSET = 142;
+const BLOCK_NBITS = 0x1a0fffff; // out of reach, shares only
+const PREVIOUS_TARGET_GRACE = 2; // seconds the previous share target is still accepted after a difficulty change
+
+const DEFAULTS = {
+    host: '127.0.0.1',
+    port: 8444,
+    duration: 120,
+    blockInterval: 30,
+    difficulty: [1],
+    difficultyInterval: 0
+};
+
+const USAGE = `Usage: node poolsim.js [options]
+
+Local stand-in for a pool speaking the dumb protocol (register, settings, new-block, share, error).
+Point the miner at it with "hosts": ["ws://127.0.0.1:${DEFAULTS.port}"], "consensus": "dumb"
+and "allDevices": true to mine on a CPU OpenCL device, e.g. POCL.
+
+  --host <address>            Address to listen on (default: ${DEFAULTS.host})
+  --port <n>                  Port (default: ${DEFAULTS.port})
+  --duration <s>              Run time, then print the report and exit (default: ${DEFAULTS.duration})
+  --block-interval <s>        Seconds between block changes (default: ${DEFAULTS.blockInterval})
+  --difficulty <list>         Share difficulties, cycled through, e.g. 0.5,1,2 (default: 1)
+  --difficulty-interval <s>   Seconds between difficulty changes, 0 keeps the first (default: 0)`;
+
+function parseArgs(argv) {
+    const options = Object.assign({}, DEFAULTS);
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        switch (arg) {
+            case '--host': options.host = argv[++i]; break;
+            case '--port': options.port = parseInt(argv[++i], 10); break;
+            case '--duration': options.duration = parseFloat(argv[++i]); break;
+            case '--block-interval': options.blockInterval = parseFloat(argv[++i]); break;
+            case '--difficulty': options.difficulty = argv[++i].split(',').map(parseFloat); break;
+            case '--difficulty-interval': options.difficultyInterval = parseFloat(argv[++i]); break;
+            default:
+                console.log(USAGE);
+                process.exit(arg === '--help' ? 0 : 1);
+        }
+    }
+    return options;
+}
+
+// Random hashes, valid version, nBits, height and timestamp, the nonce is set by the miner
+function makeHeader(height) {
+    const header = crypto.randomBytes(HEADER_SIZE);
+    header.writeUInt16BE(1, 0);
+    header.writeUInt32BE(BLOCK_NBITS, NBITS_OFFSET);
+    header.writeUInt32BE(height, HEIGHT_OFFSET);
+    header.writeUInt32BE(Math.floor(Date.now() / 1000), TIMESTAMP_OFFSET);
+    header.writeUInt32BE(0, NONCE_OFFSET);
+    return header;
+}
+
+function compactToTarget(compact) {
+    return BigInt(compact & 0xffffff) * (1n << BigInt(8 * ((compact >>> 24) - 3)));
+}
+
+function percentile(values, p) {
+    if (values.length === 0) {
+        return 0;
+    }
+    const sorted = values.slice().sort((a, b) => a - b);
+    return sorted[Math.min(Math.ceil(sorted.length * p / 100), sorted.length) - 1];
+}
+
+// A single miner connection: its current and previous block, and the share targets it was sent
+class Session {
+    constructor(pool, ws) {
+        this._pool = pool;
+        this._ws = ws;
+        this._nonces = new Set(); // of the current block, for duplicates
+        ws.on('message', msg => this._onMessage(JSON.parse(msg)));
+        ws.on('close', () => pool.sessions.delete(this));
+    }
+
+    _onMessage(msg) {
+        switch (msg.message) {
+            case 'register':
+                Nimiq.Log.i(TAG, `Miner registered: ${msg.deviceName} (${msg.minerVersion}), start difficulty ${msg.startDifficulty}`);
+                this._send({ message: 'registered' });
+                this.sendSettings(this._pool.shareCompact);
+                this.sendBlock(this._pool.block);
+                break;
+            case 'share':
+                this._pool.checkShare(this, msg.nonce).catch(e => Nimiq.Log.e(TAG, `Share check failed - ${e.message}`));
+                break;
+        }
+    }
+
+    sendSettings(shareCompact) {
+        this.previousCompact = this.shareCompact;
+        this.shareCompact = shareCompact;
+        this.compactChanged = Date.now();
+        this._send({
+            message: 'settings',
+            address: 'NQ07 0000 0000 0000 0000 0000 0000 0000 0000',
+            extraData: '',
+            targetCompact: shareCompact,
+            nonce: 0
+        });
+    }
+
+    sendBlock(block) {
+        this.previousBlock = this.block;
+        this.block = block;
+        this._nonces.clear();
+        this._send({ message: 'new-block', blockHeader: block.header.toString('base64') });
+    }
+
+    isDuplicate(nonce) {
+        if (this._nonces.has(nonce)) {
+            return true;
+        }
+        this._nonces.add(nonce);
+        return false;
+    }
+
+    sendError(reason) {
+        this._send({ message: 'error', reason });
+    }
+
+    _send(msg) {
+        if (this._ws.readyState === WebSocket.OPEN) {
+            this._ws.send(JSON.stringify(msg));
+        }
+    }
+}
+
+class PoolSimulator {
+    constructor(options) {
+        this._options = options;
+        this.sessions = new Set();
+        this._height = 1;
+        this._difficultyIndex = 0;
+        this.shareCompact = Nimiq.BlockUtils.difficultyToCompact(options.difficulty[0]);
+        this.block = this._nextBlock();
+        this._stats = { valid: 0, stale: 0, invalid: 0, duplicate: 0, work: 0, blocks: 1, difficultyChanges: 0 };
+        this._switchLatencies = []; // per block, ms from new-block until the last share for the previous block
+        this._firstShareDelays = []; // ms from new-block until the first share of it
+    }
+
+    async start() {
+        this._cryptoWorker = await Nimiq.CryptoWorker.getInstanceAsync();
+        this._server = new WebSocket.Server({ host: this._options.host, port: this._options.port });
+        this._server.on('connection', ws => this.sessions.add(new Session(this, ws)));
+        this._start = Date.now();
+        this._timers = [setInterval(() => this._changeBlock(), 1000 * this._options.blockInterval)];
+        if (this._options.difficultyInterval > 0) {
+            this._timers.push(setInterval(() => this._changeDifficulty(), 1000 * this._options.difficultyInterval));
+        }
+        Nimiq.Log.i(TAG, `Listening on ws://${this._options.host}:${this._options.port} for ${this._options.duration} seconds`);
+        return new Promise(resolve => setTimeout(() => {
+            this._timers.forEach(timer => clearInterval(timer));
+            this._server.close();
+            resolve(this.report());
+        }, 1000 * this._options.duration));
+    }
+
+    _nextBlock() {
+        return { header: makeHeader(this._height++), sent: Date.now(), lastStaleShare: undefined, firstShare: undefined };
+    }
+
+    _changeBlock() {
+        this._recordSwitch(this.block);
+        this.block = this._nextBlock();
+        this._stats.blocks++;
+        this.sessions.forEach(session => session.sendBlock(this.block));
+    }
+
+    _recordSwitch(block) {
+        if (block.firstShare !== undefined) {
+            this._firstShareDelays.push(block.firstShare - block.sent);
+        }
+        if (block.lastStaleShare !== undefined) {
+            this._switchLatencies.push(block.lastStaleShare - block.sent);
+        }
+    }
+
+    _changeDifficulty() {
+        this._difficultyIndex = (this._difficultyIndex + 1) % this._options.difficulty.length;
+        this.shareCompact = Nimiq.BlockUtils.difficultyToCompact(this._options.difficulty[this._difficultyIndex]);
+        this._stats.difficultyChanges++;
+        this.sessions.forEach(session => session.sendSettings(this.shareCompact));
+    }
+
+    async _hash(header, nonce) {
+        const input = Buffer.from(header);
+        input.writeUInt32BE(nonce, NONCE_OFFSET);
+        const hash = Buffer.from(await this._cryptoWorker.computeArgon2d(input));
+        return BigInt('0x' + hash.toString('hex'));
+    }
+
+    // Valid for the current block, stale if only valid for the previous one, invalid otherwise
+    async checkShare(session, nonce) {
+        const received = Date.now();
+        const block = session.block;
+        const previousBlock = session.previousBlock;
+        let target = compactToTarget(session.shareCompact);
+        if (session.previousCompact !== undefined && received - session.compactChanged < PREVIOUS_TARGET_GRACE * 1000) {
+            const previousTarget = compactToTarget(session.previousCompact);
+            target = (previousTarget > target) ? previousTarget : target;
+        }
+
+        if (session.isDuplicate(nonce)) {
+            this._stats.duplicate++;
+            session.sendError('Duplicate share');
+            return;
+        }
+        if (await this._hash(block.header, nonce) <= target) {
+            this._stats.valid++;
+            this._stats.work += Nimiq.BlockUtils.compactToDifficulty(session.shareCompact);
+            if (block.firstShare === undefined) {
+                block.firstShare = received;
+            }
+            return;
+        }
+        if (previousBlock && await this._hash(previousBlock.header, nonce) <= target) {
+            this._stats.stale++;
+            block.lastStaleShare = received;
+            session.sendError('Stale share');
+            return;
+        }
+        this._stats.invalid++;
+        session.sendError('Invalid share');
+    }
+
+    report() {
+        this._recordSwitch(this.block);
+        const elapsed = (Date.now() - this._start) / 1000;
+        const shares = this._stats.valid + this._stats.stale + this._stats.invalid + this._stats.duplicate;
+        const ratio = count => (shares > 0) ? count / shares : 0;
+        return {
+            duration: elapsed,
+            blocks: this._stats.blocks,
+            difficultyChanges: this._stats.difficultyChanges,
+            shares,
+            shareRate: shares / elapsed,
+            validRatio: ratio(this._stats.valid),
+            staleRatio: ratio(this._stats.stale),
+            invalidRatio: ratio(this._stats.invalid),
+            duplicateRatio: ratio(this._stats.duplicate),
+            // Difficulty 1 is 2^16 hashes on average
+            estimatedHashrate: this._stats.work * 65536 / elapsed,
+            blockSwitchLatency: {
+                count: this._switchLatencies.length,
+                p50: percentile(this._switchLatencies, 50),
+                p99: percentile(this._switchLatencies, 99),
+                max: percentile(this._switchLatencies, 100)
+            },
+            firstShareDelay: {
+                count: this._firstShareDelays.length,
+                p50: percentile(this._firstShareDelays, 50),
+                max: percentile(this._firstShareDelays, 100)
+            }
+        };
+    }
+}
+
+Nimiq.Log.instance.level = 'info';
+
+(async () => {
+    const report = await new PoolSimulator(parseArgs(process.argv.slice(2))).start();
+    console.log(JSON.stringify(report, null, 2));
+    process.exit(0);
+})().catch(e => {
+    console.error(e);
+    process.exit(1);
+});
@@ -0,0 +1,167 @@
+const Nimiq = require('@nimiq/core');
+const Utils = require('./src/Utils');
+const Miner = require('./src/Miner');
+const { readWorkTrace } = require('./src/WorkTrace');
+
+const DEFAULTS = {
+    config: './miner.conf',
+    speed: 1
+};
+
+const USAGE = `Usage: node replay.js <trace> [options]
+
+Feeds a work trace recorded with "record" in miner.conf into the miner, with the devices and options of
+the config file, and reports how the run compares to the recording.
+
+  --config <file>       Device options (default: ${DEFAULTS.config}), pool settings are ignored
+  --speed <n>           Replay n times faster than recorded (default: ${DEFAULTS.speed})`;
+
+function parseArgs(argv) {
+    const options = Object.assign({}, DEFAULTS);
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        switch (arg) {
+            case '--config': options.config = argv[++i]; break;
+            case '--speed': options.speed = parseFloat(argv[++i]); break;
+            default:
+                if (arg.startsWith('--') || options.trace) {
+                    console.log(USAGE);
+                    process.exit(arg === '--help' ? 0 : 1);
+                }
+                options.trace = arg;
+        }
+    }
+    if (!options.trace) {
+        console.log(USAGE);
+        process.exit(1);
+    }
+    return options;
+}
+
+function percentile(values, p) {
+    if (values.length === 0) {
+        return 0;
+    }
+    const sorted = values.slice().sort((a, b) => a - b);
+    return sorted[Math.min(Math.ceil(sorted.length * p / 100), sorted.length) - 1];
+}
+
+// Totals of the recorded results, what the replay is compared against
+function summarizeRecording(records) {
+    const results = records.filter(record => record.type === 'result');
+    const duration = records.length > 0 ? records[records.length - 1].time / 1000 : 0;
+    const hashes = results.reduce((sum, record) => sum + record.hashes, 0);
+    return {
+        duration,
+        blocks: records.filter(record => record.type === 'start').length,
+        shareCompactChanges: records.filter(record => record.type === 'shareCompact').length,
+        hashes,
+        hashrate: (duration > 0) ? hashes / duration : 0,
+        results: results.filter(record => record.nonce > 0).length
+    };
+}
+
+async function replay(miner, records, speed) {
+    const devices = new Map(); // device -> { hashes, staleHashes, switchLatencies }
+    const device = idx => {
+        if (!devices.has(idx)) {
+            devices.set(idx, { hashes: 0, staleHashes: 0, switchLatencies: [] });
+        }
+        return devices.get(idx);
+    };
+    let job; // { workId, started, devices: Set of devices that delivered on it }
+    let delivered = 0;
+
+    miner.on('result', obj => {
+        const stats = device(obj.device);
+        stats.hashes += obj.hashes;
+        if (!job || obj.workId !== job.workId) {
+            // Batches of superseded work that were still running at the switch
+            stats.staleHashes += obj.hashes;
+            return;
+        }
+        if (!job.devices.has(obj.device)) {
+            job.devices.add(obj.device);
+            stats.switchLatencies.push(Date.now() - job.started);
+        }
+        if (obj.nonce > 0) {
+            delivered++;
+        }
+    });
+
+    const start = Date.now();
+    for (const record of records.filter(record => record.type !== 'result')) {
+        const delay = start + record.time / speed - Date.now();
+        if (delay > 0) {
+            await new Promise(resolve => setTimeout(resolve, delay));
+        }
+        switch (record.type) {
+            case 'start':
+                job = { workId: miner.startMiningOnBlock(record.header), started: Date.now(), devices: new Set() };
+                break;
+            case 'shareCompact':
+                miner.setShareCompact(record.shareCompact);
+                break;
+            case 'stop':
+                miner.stop();
+                job = undefined;
+                break;
+        }
+    }
+    const lastRecord = records[records.length - 1];
+    const remaining = start + (lastRecord ? lastRecord.time : 0) / speed - Date.now();
+    if (remaining > 0) {
+        await new Promise(resolve => setTimeout(resolve, remaining));
+    }
+    const elapsed = (Date.now() - start) / 1000;
+    miner.stop();
+
+    const stats = miner.getStats();
+    let hashes = 0;
+    let lostTime = 0;
+    const perDevice = {};
+    devices.forEach((stats, idx) => {
+        hashes += stats.hashes;
+        // Stale batches expressed as time at the device's average hashrate
+        const deviceLostTime = (stats.hashes > 0) ? stats.staleHashes / (stats.hashes / elapsed) : 0;
+        lostTime += deviceLostTime;
+        perDevice[idx] = {
+            hashes: stats.hashes,
+            hashrate: stats.hashes / elapsed,
+            staleHashes: stats.staleHashes,
+            lostTime: deviceLostTime,
+            switchLatency: { p50: percentile(stats.switchLatencies, 50), max: percentile(stats.switchLatencies, 100) }
+        };
+    });
+    return {
+        duration: elapsed,
+        hashes,
+        hashrate: hashes / elapsed,
+        lostTime,
+        resultsDelivered: delivered,
+        resultsDropped: stats.staleResults,
+        devices: perDevice
+    };
+}
+
+Nimiq.Log.instance.level = 'info';
+
+(async () => {
+    const options = parseArgs(process.argv.slice(2));
+    const records = readWorkTrace(options.trace);
+    const config = Utils.readConfigFile(options.config);
+    if (!config) {
+        process.exit(1);
+    }
+
+    const miner = new Miner(Object.assign(Utils.getDeviceOptions(config), { record: undefined, coordinator: undefined }));
+    await miner.waitForDevices();
+    const recording = summarizeRecording(records);
+    Nimiq.Log.i('Replay', `Replaying ${recording.blocks} blocks over ${recording.duration.toFixed(0)} s at ${options.speed}x`);
+    const result = await replay(miner, records, options.speed);
+    console.log(JSON.stringify({ recording, replay: result }, null, 2));
+    process.exit(0);
+})().catch(e => {
+    console.error(e);
+    process.exit(1);
+});
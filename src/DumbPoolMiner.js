@@ -4,21 +4,39 @@ const Nimiq = require('@nimiq/core');
 const Miner = require('./Miner');
 const WebSocket = require('ws');
 const Utils = require('./Utils');
+const PoolHosts = require('./PoolHosts');
 
 const GENESIS_HASH_MAINNET = 'Jkqvik+YKKdsVQY12geOtGYwahifzANxC+6fZJyGnRI=';
+const RECONNECT_MIN_DELAY = 2; // seconds, randomized so that a pool restart isn't hit by all miners at once
+const RECONNECT_MAX_DELAY = 10; // seconds
+const MAX_PENDING_SHARES = 100;
 
 class DumbPoolMiner extends Nimiq.Observable {
 
-    constructor(address, deviceData, deviceOptions) {
+    constructor(address, deviceData, deviceOptions, poolOptions) {
         super();
 
         this._address = address;
         this._deviceId = this._getDeviceId();
         this._deviceData = deviceData;
+        this._blocksFound = 0;
+
+        // Connection outages: the last block is mined on for reconnectGrace seconds, shares found meanwhile are queued
+        this._hosts = new PoolHosts(poolOptions.hosts);
+        this._reconnectGrace = poolOptions.reconnectGrace;
+        this._pendingShares = [];
+        this._pendingSharesHeader = undefined; // block the queued shares were found on, kept after the grace stop
+        this._outages = 0;
+        this._resubmittedShares = 0;
+        this._droppedShares = 0;
+        this._idleTime = 0; // ms without hashing because of outages
 
         this._miner = new Miner(deviceOptions);
-        this._miner.on('share', nonce => {
-            this._submitShare(nonce);
+        this._miner.on('share', (nonce, obj) => {
+            this._submitShare(nonce, obj.latency);
+        });
+        this._miner.on('block', (nonce, obj) => {
+            this._submitBlock(nonce, obj);
         });
         this._miner.on('hashrate-changed', hashrates => {
             this.fire('hashrate-changed', hashrates);
@@ -32,26 +50,27 @@ class DumbPoolMiner extends Nimiq.Observable {
         return hash.digest().readUInt32LE(0);
     }
 
-    connect(host, port) {
-        Nimiq.Log.i(DumbPoolMiner, `Connecting to ${host}:${port}`);
-        this._host = host;
+    connect() {
         this._closed = false;
-        this._ws = new WebSocket(`wss://${host}:${port}`);
+        this._connect(this._hosts.select());
+    }
+
+    _connect(entry) {
+        Nimiq.Log.i(DumbPoolMiner, `Connecting to ${entry.host}:${entry.port}`);
+        this._hostEntry = entry;
+        this._host = entry.host;
+        this._ws = new WebSocket(`${entry.secure ? 'wss' : 'ws'}://${entry.host}:${entry.port}`);
 
         this._ws.on('open', () => {
             this._register();
         });
 
         this._ws.on('close', (code, reason) => {
-            let timeout = Math.floor(Math.random() * 25) + 5;
-            //this._host = Utils.getNewHost(this._host);
-            Nimiq.Log.w(DumbPoolMiner, `Connection lost. Reconnecting in ${timeout} seconds to ${this._host}`);
-            this._stopMining();
-            if (!this._closed) {
-                setTimeout(() => {
-                    this.connect(this._host, port);
-                }, timeout * 1000);
+            if (this._closed) {
+                this._stopMining();
+                return;
             }
+            this._onConnectionLost();
         });
 
         this._ws.on('message', (msg) => this._onMessage(JSON.parse(msg)));
@@ -59,11 +78,63 @@ class DumbPoolMiner extends Nimiq.Observable {
         this._ws.on('error', (e) => Nimiq.Log.e(DumbPoolMiner, `WS error - ${e.message}`, e));
     }
 
+    _onConnectionLost() {
+        this._hosts.reportFailure(this._hostEntry);
+        if (this._outageStart === undefined) {
+            this._outageStart = Date.now();
+            this._outages++;
+            if (this._currentBlockHeader) {
+                this._graceTimer = setTimeout(() => {
+                    Nimiq.Log.w(DumbPoolMiner, `No pool connection for ${this._reconnectGrace} seconds, stopping work on block #${this._currentBlockHeader.height}`);
+                    this._stopMining();
+                }, this._reconnectGrace * 1000);
+            }
+        }
+
+        const timeout = Math.floor(Math.random() * (RECONNECT_MAX_DELAY - RECONNECT_MIN_DELAY)) + RECONNECT_MIN_DELAY;
+        const entry = this._hosts.select();
+        Nimiq.Log.w(DumbPoolMiner, `Connection lost. Reconnecting in ${timeout} seconds to ${entry.host}${this._currentBlockHeader ? ', still mining on the last block' : ''}`);
+        setTimeout(() => {
+            if (!this._closed) {
+                this._connect(entry);
+            }
+        }, timeout * 1000);
+    }
+
+    _onRegistered() {
+        this._hosts.reportConnected(this._hostEntry);
+        if (this._outageStart !== undefined) {
+            Nimiq.Log.i(DumbPoolMiner, `Reconnected after ${((Date.now() - this._outageStart) / 1000).toFixed(0)} seconds, idle for ${(this._getIdleTime() / 1000).toFixed(0)} seconds in total`);
+            clearTimeout(this._graceTimer);
+            delete this._outageStart;
+        }
+    }
+
     disconnect() {
         this._closed = true;
+        clearTimeout(this._graceTimer);
         this._ws.close();
     }
 
+    // Outages so far and the hashing time they cost, besides the native miner stats
+    getStats() {
+        return Object.assign(this._miner.getStats(), {
+            pool: {
+                host: this._host,
+                outages: this._outages,
+                idleTime: this._getIdleTime() / 1000,
+                pendingShares: this._pendingShares.length,
+                resubmittedShares: this._resubmittedShares,
+                droppedShares: this._droppedShares,
+                hosts: this._hosts.getStats()
+            }
+        });
+    }
+
+    _getIdleTime() {
+        return this._idleTime + ((this._idleSince !== undefined) ? Date.now() - this._idleSince : 0);
+    }
+
     _register() {
         Nimiq.Log.i(DumbPoolMiner, `Registering to pool (${this._host}) using device id ${this._deviceId} (${this._deviceData.deviceName}) as a dumb client.`);
         this._send({
@@ -84,6 +155,7 @@ class DumbPoolMiner extends Nimiq.Observable {
         switch (msg.message) {
             case 'registered':
                 Nimiq.Log.i(DumbPoolMiner, 'Connected to pool');
+                this._onRegistered();
                 break;
             case 'settings':
                 this._onNewPoolSettings(msg.address, Buffer.from(msg.extraData, 'base64'), msg.targetCompact, msg.nonce);
@@ -100,13 +172,29 @@ class DumbPoolMiner extends Nimiq.Observable {
         }
     }
 
+    // Aggregate H/s of the enabled devices, see Miner.calibrate()
+    calibrate(duration) {
+        return this._miner.calibrate(duration);
+    }
+
+    getDeviceSetKey() {
+        return this._miner.getDeviceSetKey();
+    }
+
     _startMining() {
         Nimiq.Log.i(DumbPoolMiner, `Starting work on block #${this._currentBlockHeader.height}`);
         this._miner.startMiningOnBlock(this._currentBlockHeader.serialize());
+        if (this._idleSince !== undefined) {
+            this._idleTime += Date.now() - this._idleSince;
+            delete this._idleSince;
+        }
     }
 
     _stopMining() {
         this._miner.stop();
+        if (!this._closed && this._currentBlockHeader && this._idleSince === undefined) {
+            this._idleSince = Date.now();
+        }
         delete this._currentBlockHeader;
     }
 
@@ -114,6 +202,7 @@ class DumbPoolMiner extends Nimiq.Observable {
         const difficulty = Nimiq.BlockUtils.compactToDifficulty(shareCompact);
         Nimiq.Log.i(DumbPoolMiner, `Set share difficulty: ${difficulty.toFixed(2)} (${shareCompact.toString(16)})`);
         this._miner.setShareCompact(shareCompact);
+        this._miner.setNonceStart(nonce);
     }
 
     _onBalance(balance, confirmedBalance) {
@@ -121,24 +210,79 @@ class DumbPoolMiner extends Nimiq.Observable {
     }
 
     _onNewBlock(blockHeader) {
-        // Workaround duplicated blocks
+        // Workaround duplicated blocks, also the usual case after a reconnect within the grace period
         if (this._currentBlockHeader != undefined && this._currentBlockHeader.equals(blockHeader)) {
-            Nimiq.Log.w(DumbPoolMiner, 'The same block appears once again!');
+            if (this._pendingShares.length > 0) {
+                this._resubmitShares();
+            } else {
+                Nimiq.Log.w(DumbPoolMiner, 'The same block appears once again!');
+            }
             return;
         }
 
+        // Mining stopped once the grace period ran out, but the pool may come back with the same block
+        if (this._pendingSharesHeader !== undefined && this._pendingSharesHeader.equals(blockHeader)) {
+            this._resubmitShares();
+        } else {
+            this._dropPendingShares();
+        }
         this._currentBlockHeader = blockHeader;
         this._startMining();
     }
 
-    _submitShare(nonce) {
+    // Shares found while disconnected, sent once the pool is back with the same block
+    _resubmitShares() {
+        const shares = this._pendingShares;
+        this._pendingShares = [];
+        this._pendingSharesHeader = undefined;
+        const expired = Date.now() - this._reconnectGrace * 1000;
+        const valid = shares.filter(share => share.time >= expired);
+        valid.forEach(share => this._submitShare(share.nonce));
+        this._resubmittedShares += valid.length;
+        this._droppedShares += shares.length - valid.length;
+        Nimiq.Log.i(DumbPoolMiner, `Resubmitted ${valid.length} of ${shares.length} shares found while disconnected`);
+    }
+
+    _dropPendingShares() {
+        if (this._pendingShares.length > 0) {
+            Nimiq.Log.w(DumbPoolMiner, `Dropped ${this._pendingShares.length} shares found while disconnected, the block changed`);
+            this._droppedShares += this._pendingShares.length;
+            this._pendingShares = [];
+        }
+        this._pendingSharesHeader = undefined;
+    }
+
+    _submitShare(nonce, latency) {
+        if (latency) {
+            latency.mark('dispatch');
+        }
+        if (this._ws.readyState !== WebSocket.OPEN) {
+            if (this._pendingShares.length < MAX_PENDING_SHARES) {
+                this._pendingShares.push({ nonce, time: Date.now() });
+                // Results still in flight after the grace stop belong to the block mined last
+                this._pendingSharesHeader = this._currentBlockHeader || this._pendingSharesHeader;
+            } else {
+                this._droppedShares++;
+            }
+            return;
+        }
         this._send({
             message: 'share',
             nonce
         });
+        if (latency) {
+            latency.finish('send');
+        }
         this.fire('share', nonce);
     }
 
+    // The pool checks shares against the block target itself, block solutions are sent as shares
+    _submitBlock(nonce, obj) {
+        this._submitShare(nonce, obj.latency);
+        this._blocksFound++;
+        Nimiq.Log.i(DumbPoolMiner, `GPU #${obj.device}: found a block solution, nonce ${nonce} (${this._blocksFound} so far).`);
+    }
+
     _send(msg) {
         try {
             this._ws.send(JSON.stringify(msg));
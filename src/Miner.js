@@ -1,42 +1,242 @@
+const fs = require('fs');
 const Nimiq = require('@nimiq/core');
 const NativeMiner = require('bindings')('nimiq_miner_opencl.node');
+const ShareLatency = require('./ShareLatency');
+const NonceLeaseClient = require('./NonceLeaseClient');
+const { WorkTraceWriter } = require('./WorkTrace');
 
 // TODO: configurable interval
 const HASHRATE_MOVING_AVERAGE = 6; // measurements
 const HASHRATE_REPORT_INTERVAL = 10; // seconds
+const SHARE_LATENCY_REPORT_INTERVAL = 6; // hashrate reports
+const CALIBRATION_WARMUP = 2; // seconds
+const UNREACHABLE_SHARE_COMPACT = 0x03000001; // target of 1
+const BLOCK_HEADER_SIZE = 146;
+const VERIFY_MIN_SAMPLES = 100; // before the error rate of a device is acted on
+const POOL_NONCE_SPACE = 0x80000000; // pool assigned start nonces are wrapped into it, so that enough nonces remain above
 
 class Miner extends Nimiq.Observable {
 
     constructor(deviceOptions) {
         super();
 
-        this._miner = new NativeMiner.Miner();
+        this._miner = new NativeMiner.Miner({ allDevices: deviceOptions.allDevices, trace: deviceOptions.trace !== undefined, argon2: deviceOptions.argon2 });
+        this._argon2 = deviceOptions.argon2 || {};
+        this._nonceRange = deviceOptions.nonceRange || {};
+        if (deviceOptions.coordinator) {
+            this._leases = new NonceLeaseClient(this._miner, deviceOptions.coordinator);
+            this._leases.on('lost', workId => {
+                // Like a job started while the coordinator is unreachable, but without restarting the devices
+                Nimiq.Log.w('Nonce coordinator lost, mining the rest of the job without leases');
+                this._miner.stopLeasing(workId, this._jobNonceRange);
+                this._leases.stopJob();
+            });
+        }
+        if (deviceOptions.record) {
+            // Work stream for replay.js
+            this._recorder = new WorkTraceWriter(deviceOptions.record);
+            this.on('result', obj => this._recorder.result(obj));
+            // Signals skip 'exit' unless the application handles them, see index.js
+            process.on('exit', () => this._recorder.close());
+        }
         this._devices = this._miner.getDevices();
-        this._devices.forEach((device, idx) => {
-            const options = deviceOptions.forDevice(idx);
-            if (!options.enabled) {
-                device.enabled = false;
-                Nimiq.Log.i(`GPU #${idx}: ${device.name}. Disabled by user.`);
-                return;
-            }
-            if (options.memory !== undefined) {
-                device.memory = options.memory;
-            }
-            if (options.threads !== undefined) {
-                device.threads = options.threads;
-            }
-            if (options.cache !== undefined) {
-                device.cache = options.cache;
+        this._verifyThresholds = [];
+        this._verifyActions = new Set();
+        this._devices.forEach((device, idx) => this._configureDevice(idx, deviceOptions.forDevice(idx)));
+        this.initializeDevices();
+
+        if (deviceOptions.trace) {
+            const { file, delay, duration } = deviceOptions.trace;
+            setTimeout(() => {
+                Nimiq.Log.i(`Tracing for ${duration} s.`);
+                this.trace(file, duration).then(() => Nimiq.Log.i(`Trace written to ${file}.`));
+            }, delay * 1000);
+        }
+
+        this._hashes = [];
+        this._lastHashRates = [];
+        this._shareLatency = new ShareLatency();
+        this._hashRateReports = 0;
+        this._avoidedNonces = 0;
+        this._settledDevices = new Set();
+    }
+
+    _configureDevice(idx, options) {
+        const device = this._devices[idx];
+        if (!options.enabled) {
+            device.enabled = false;
+            Nimiq.Log.i(`GPU #${idx}: ${device.name}. Disabled by user.`);
+            return;
+        }
+        device.enabled = true;
+        if (options.memory !== undefined) {
+            device.memory = options.memory;
+        }
+        if (options.threads !== undefined) {
+            device.threads = options.threads;
+        }
+        if (options.cache !== undefined) {
+            device.cache = options.cache;
+        }
+        if (options.jobs !== undefined) {
+            device.jobs = options.jobs;
+        }
+        if (options.persistent !== undefined) {
+            device.persistent = options.persistent;
+        }
+        if (options.vectorBlake2b !== undefined) {
+            device.vectorBlake2b = options.vectorBlake2b;
+        }
+        if (options.tune !== undefined) {
+            device.tune = options.tune;
+        }
+        if (options.profile !== undefined) {
+            device.profile = options.profile;
+        }
+        if (options.tmto !== undefined) {
+            device.tmto = options.tmto;
+        }
+        if (options.threadsPerLane !== undefined) {
+            device.threadsPerLane = options.threadsPerLane;
+        }
+        if (options.verify !== undefined) {
+            device.verify = options.verify;
+        }
+        if (options.verifyThreshold !== undefined) {
+            this._verifyThresholds[idx] = options.verifyThreshold;
+        }
+        Nimiq.Log.i(`GPU #${idx}: ${device.name}, ${device.maxComputeUnits} CU @ ${device.maxClockFrequency} MHz. (memory: ${device.memory == 0 ? 'auto' : device.memory}, threads: ${device.threads}, cache: ${device.cache}, jobs: ${device.jobs}${device.persistent ? ', persistent' : ''}${device.vectorBlake2b ? ', vector blake2b' : ''}${device.tune ? ', tuning' : ''}${device.profile ? ', profiling' : ''}${device.tmto ? `, tmto: ${device.tmto}` : ''}${device.threadsPerLane !== 32 ? `, threads per lane: ${device.threadsPerLane}` : ''}${device.verify ? `, verify: ${device.verify}` : ''})`);
+    }
+
+    _onDeviceReady(error, obj) {
+        this._settledDevices.add(obj.device);
+        if (error) {
+            if (obj.recovered === false) {
+                Nimiq.Log.e(`GPU #${obj.device}: failed to recover, device disabled - ${error.message}`);
+            } else {
+                Nimiq.Log.e(`GPU #${obj.device}: failed to initialize - ${error.message}`);
             }
-            if (options.jobs !== undefined) {
-                device.jobs = options.jobs;
+            this.fire('device-error', obj.device, error);
+            return;
+        }
+        if (obj.recovered) {
+            Nimiq.Log.i(`GPU #${obj.device}: recovered in ${obj.time.toFixed(0)} ms.`);
+            this.fire('device-recovered', obj.device);
+        }
+        if (!obj.ready) {
+            Nimiq.Log.i(`GPU #${obj.device}: freed in ${obj.time.toFixed(0)} ms.`);
+            return;
+        }
+        Nimiq.Log.i(`GPU #${obj.device}: ready in ${obj.time.toFixed(0)} ms, kernels ${obj.buildCacheHit ? 'loaded from cache' : 'compiled'} in ${obj.buildTime.toFixed(0)} ms.`);
+        this.fire('device-ready', obj.device);
+    }
+
+    // Devices initialize in the background and start hashing on the current block once ready
+    initializeDevices() {
+        this._miner.initializeDevices((error, obj) => this._onDeviceReady(error, obj));
+    }
+
+    // Rebuilds a single device with new options, e.g. { threads: 1 } or { enabled: false }.
+    // The other devices keep mining, Argon2 buffers and the compiled program are reused where possible.
+    reconfigureDevice(idx, options) {
+        this._configureDevice(idx, Object.assign({ enabled: true }, options));
+        return new Promise((resolve, reject) => {
+            this._miner.reconfigureDevice(idx, (error, obj) => {
+                this._onDeviceReady(error, obj);
+                return error ? reject(error) : resolve(obj);
+            });
+        });
+    }
+
+    // Releases all GPU resources, devices can be brought back with initializeDevices()
+    freeDevices() {
+        const count = this._devices.length;
+        return new Promise(resolve => {
+            let freed = 0;
+            this._miner.freeDevices((error, obj) => {
+                this._onDeviceReady(error, obj);
+                if (++freed === count) {
+                    resolve();
+                }
+            });
+        });
+    }
+
+    // Records kernels, transfers, lock waits and result delivery of the next `duration` seconds
+    // as Trace Event Format JSON, open it in Perfetto or chrome://tracing
+    trace(fileName, duration) {
+        this._miner.startTrace();
+        return new Promise(resolve => {
+            setTimeout(() => {
+                fs.writeFileSync(fileName, this._miner.stopTrace());
+                resolve();
+            }, duration * 1000);
+        });
+    }
+
+    // Resolves once every enabled device is either ready or failed
+    waitForDevices() {
+        const pending = () => this._devices.filter((device, idx) => device.enabled && !this._settledDevices.has(idx)).length;
+        return new Promise(resolve => {
+            if (pending() === 0) {
+                resolve();
+                return;
             }
-            Nimiq.Log.i(`GPU #${idx}: ${device.name}, ${device.maxComputeUnits} CU @ ${device.maxClockFrequency} MHz. (memory: ${device.memory == 0 ? 'auto' : device.memory}, threads: ${device.threads}, cache: ${device.cache}, jobs: ${device.jobs})`);
+            const check = () => {
+                if (pending() === 0) {
+                    this.off('device-ready', readyId);
+                    this.off('device-error', errorId);
+                    resolve();
+                }
+            };
+            const readyId = this.on('device-ready', check);
+            const errorId = this.on('device-error', check);
         });
-        this._miner.initializeDevices();
+    }
 
-        this._hashes = [];
-        this._lastHashRates = [];
+    // Identifies the enabled devices and their options, calibration results are only valid for the same set
+    getDeviceSetKey() {
+        return JSON.stringify([this._argon2].concat(this._devices.filter(device => device.enabled).map(device => ({
+            name: device.name,
+            driver: device.driverVersion,
+            memory: device.memory,
+            threads: device.threads,
+            cache: device.cache,
+            jobs: device.jobs,
+            persistent: device.persistent,
+            vectorBlake2b: device.vectorBlake2b,
+            tmto: device.tmto,
+            threadsPerLane: device.threadsPerLane
+        }))));
+    }
+
+    // Mines an empty header with an unreachable share target and returns the aggregate H/s of all devices.
+    // Must not run while mining on real work.
+    async calibrate(duration) {
+        await this.waitForDevices();
+        return new Promise((resolve, reject) => {
+            let hashes = 0;
+            let start;
+            this._miner.setShareCompact(UNREACHABLE_SHARE_COMPACT);
+            try {
+                this._miner.startMiningOnBlock(new Uint8Array(this._argon2.headerLength || BLOCK_HEADER_SIZE), (error, obj) => {
+                    if (!error && !obj.done && start) {
+                        hashes += obj.hashes;
+                    }
+                });
+            } catch (e) {
+                reject(e);
+                return;
+            }
+            setTimeout(() => {
+                start = Date.now();
+                setTimeout(() => {
+                    const elapsed = (Date.now() - start) / 1000;
+                    this._miner.stop();
+                    resolve(hashes / elapsed);
+                }, duration * 1000);
+            }, CALIBRATION_WARMUP * 1000);
+        });
     }
 
     _reportHashRate() {
@@ -56,32 +256,125 @@ class Miner extends Nimiq.Observable {
         if (averageHashRates.length > 0) {
             this.fire('hashrate-changed', averageHashRates);
         }
+        this._checkVerification();
+        if (++this._hashRateReports % SHARE_LATENCY_REPORT_INTERVAL === 0) {
+            const summary = this._shareLatency.summary();
+            if (summary) {
+                Nimiq.Log.i(`Share latency p50/p99 (ms): ${summary}`);
+            }
+            this._reportCoverage();
+        }
+    }
+
+    // Headers that come back, e.g. re-sent by the pool, skip the nonces their earlier jobs searched
+    _reportCoverage() {
+        const coverage = this._miner.getStats().coverage;
+        if (coverage.avoidedNonces > this._avoidedNonces) {
+            Nimiq.Log.i(`Skipped ${coverage.avoidedNonces - this._avoidedNonces} already searched nonces (${coverage.resumedJobs} resumed jobs so far)`);
+            this._avoidedNonces = coverage.avoidedNonces;
+        }
+    }
+
+    // Devices whose sampled hashes disagree with the CPU too often get one thread less, down to being disabled.
+    // Reconfiguring resets the native counters, so every step is judged on fresh samples.
+    _checkVerification() {
+        this._miner.getStats().devices.forEach(stats => {
+            const idx = stats.device;
+            const threshold = this._verifyThresholds[idx];
+            const verification = stats.verification;
+            if (threshold === undefined || !verification || verification.samples < VERIFY_MIN_SAMPLES
+                || verification.errorRate * 100 <= threshold || this._verifyActions.has(idx)) {
+                return;
+            }
+            const device = this._devices[idx];
+            const errors = `${verification.errors} of ${verification.samples} sampled hashes wrong`;
+            let options;
+            if (device.threads > 1) {
+                Nimiq.Log.w(`GPU #${idx}: ${errors}, lowering threads to ${device.threads - 1}.`);
+                options = { threads: device.threads - 1 };
+            } else {
+                Nimiq.Log.e(`GPU #${idx}: ${errors}, device disabled.`);
+                options = { enabled: false };
+            }
+            this._verifyActions.add(idx);
+            this.reconfigureDevice(idx, options)
+                .catch(() => {}) // already logged by _onDeviceReady
+                .then(() => this._verifyActions.delete(idx));
+        });
     }
 
     setShareCompact(shareCompact) {
+        if (this._recorder) {
+            this._recorder.setShareCompact(shareCompact);
+        }
         this._miner.setShareCompact(shareCompact);
     }
 
-    startMiningOnBlock(blockHeader) {
+    // Start nonce sent by the pool, applies from the next block on unless "nonces" sets the range
+    setNonceStart(nonce) {
+        if (Number.isInteger(nonce) && nonce >= 0 && this._nonceRange.end === undefined) {
+            this._nonceRange.start = nonce % POOL_NONCE_SPACE;
+        }
+    }
+
+    // nonceRange { start, end, stride, offset } overrides the configured one, see NonceRange in miner.cc.
+    // With a coordinator the nonces are leased from it instead, unless it is unreachable. Returns the work id.
+    startMiningOnBlock(blockHeader, nonceRange) {
+        if (this._recorder) {
+            this._recorder.startMiningOnBlock(blockHeader);
+        }
         if (!this._hashRateTimer) {
             this._hashRateTimer = setInterval(() => this._reportHashRate(), 1000 * HASHRATE_REPORT_INTERVAL);
         }
-        this._miner.startMiningOnBlock(blockHeader, (error, obj) => {
+        const leased = this._leases !== undefined && this._leases.connected;
+        if (this._leases && !leased) {
+            Nimiq.Log.w('Nonce coordinator unreachable, mining without leases');
+        }
+        this._jobNonceRange = Object.assign({}, this._nonceRange, nonceRange);
+        const workId = this._miner.startMiningOnBlock(blockHeader, (error, obj) => {
             if (error) {
-                throw error;
+                // The native watchdog isolates and recovers the device, the others keep mining
+                Nimiq.Log.w(`GPU #${obj.device}: thread ${obj.thread} failed - ${error.message}`);
+                this.fire('device-error', obj.device, error);
+                return;
             }
             if (obj.done === true) {
                 return;
             }
+            this.fire('result', obj);
             if (obj.nonce > 0) {
-                this.fire('share', obj.nonce);
+                // Pool miners mark the remaining stages on obj.latency
+                obj.latency = this._shareLatency.track(obj);
+                obj.latency.mark('callback');
+                if (obj.block) {
+                    // Meets the network target of the header, goes out before anything else is done with it
+                    this.fire('block', obj.nonce, obj);
+                } else {
+                    this.fire('share', obj.nonce, obj);
+                }
             }
-            this._hashes[obj.device] = (this._hashes[obj.device] || 0) + obj.noncesPerRun;
-        });
+            this._hashes[obj.device] = (this._hashes[obj.device] || 0) + obj.hashes;
+        }, leased ? { leased: true } : this._jobNonceRange);
+        if (leased) {
+            this._leases.startJob(workId, blockHeader);
+        } else if (this._leases) {
+            this._leases.stopJob();
+        }
+        return workId;
+    }
+
+    getStats() {
+        return Object.assign(this._miner.getStats(), { shareLatency: this._shareLatency.getStats() });
     }
 
     stop() {
+        if (this._recorder) {
+            this._recorder.stop();
+        }
         this._miner.stop();
+        if (this._leases) {
+            this._leases.stopJob();
+        }
         if (this._hashRateTimer) {
             this._hashes = [];
             this._lastHashRates = [];
@@ -11,16 +11,30 @@ class NanoPoolMiner extends Nimiq.NanoPoolMiner {
 
         this._sharesFound = 0;
         this._rejectedShares = 0;
+        this._blocksFound = 0;
+        this._shareLatencies = new Map(); // nonce -> latency record of a share on its way to _onBlockMined
 
         this._miner = new Miner(deviceOptions);
-        this._miner.on('share', nonce => {
-            this._submitShare(nonce);
+        this._miner.on('share', (nonce, obj) => {
+            this._submitShare(nonce, obj.latency);
+        });
+        this._miner.on('block', (nonce, obj) => {
+            this._submitBlock(nonce, obj);
         });
         this._miner.on('hashrate-changed', hashrates => {
             this.fire('hashrate-changed', hashrates);
         });
     }
 
+    // Aggregate H/s of the enabled devices, see Miner.calibrate()
+    calibrate(duration) {
+        return this._miner.calibrate(duration);
+    }
+
+    getDeviceSetKey() {
+        return this._miner.getDeviceSetKey();
+    }
+
     _startMining() {
         const block = this.getNextBlock();
         if (!block) {
@@ -60,6 +74,7 @@ class NanoPoolMiner extends Nimiq.NanoPoolMiner {
 
     _onNewPoolSettings(address, extraData, shareCompact, nonce) {
         super._onNewPoolSettings(address, extraData, shareCompact, nonce);
+        this._miner.setNonceStart(nonce);
         if (Nimiq.BlockUtils.isValidCompact(shareCompact)) {
             const difficulty = Nimiq.BlockUtils.compactToDifficulty(shareCompact);
             Nimiq.Log.i(NanoPoolMiner, `Set share difficulty: ${difficulty.toFixed(2)} (${shareCompact.toString(16)})`);
@@ -74,16 +89,38 @@ class NanoPoolMiner extends Nimiq.NanoPoolMiner {
         this._startMining();
     }
 
-    async _submitShare(nonce) {
+    async _submitShare(nonce, latency) {
+        if (latency) {
+            latency.mark('dispatch');
+        }
         const blockHeader = this._block.header.serialize();
         blockHeader.writePos -= 4;
         blockHeader.writeUint32(nonce);
         const hash = await (await Nimiq.CryptoWorker.getInstanceAsync()).computeArgon2d(blockHeader);
-        this.onWorkerShare({
-            block: this._block,
-            nonce,
-            hash: new Nimiq.Hash(hash)
-        });
+        if (latency) {
+            latency.mark('rehash');
+        }
+        // Shares are sent from _onBlockMined, called by onWorkerShare if the hash meets the share target.
+        // It only gets the block, which carries the nonce the record is looked up by.
+        if (latency) {
+            this._shareLatencies.set(nonce, latency);
+        }
+        try {
+            await this.onWorkerShare({
+                block: this._block,
+                nonce,
+                hash: new Nimiq.Hash(hash)
+            });
+        } finally {
+            this._shareLatencies.delete(nonce);
+        }
+    }
+
+    // Submitted the same way as a share, only counted and logged after it went out
+    _submitBlock(nonce, obj) {
+        this._submitShare(nonce, obj.latency);
+        this._blocksFound++;
+        Nimiq.Log.i(NanoPoolMiner, `GPU #${obj.device}: found a block solution, nonce ${nonce} (${this._blocksFound} so far).`);
     }
 
     _onMessage(ws, msgJson) {
@@ -98,8 +135,19 @@ class NanoPoolMiner extends Nimiq.NanoPoolMiner {
     }
 
     _onBlockMined(block) {
-        super._onBlockMined(block);
+        const nonce = block.header.nonce;
+        const latency = this._shareLatencies.get(nonce);
+        this._shareLatencies.delete(nonce);
+        const sent = super._onBlockMined(block);
         this._sharesFound++;
+        if (latency) {
+            // Stamped right away unless the share goes out asynchronously
+            if (sent && typeof sent.then === 'function') {
+                sent.then(() => latency.finish('send'));
+            } else {
+                latency.finish('send');
+            }
+        }
     }
 
     _checkShares() {
@@ -0,0 +1,231 @@
+const net = require('net');
+const Nimiq = require('@nimiq/core');
+
+const NONCE_END = 0xFFFFFFFF; // exclusive, like the native miner
+const INSTANCE_TIMEOUT = 15; // seconds without a message until an instance is dead and its leases are recovered
+const MAX_JOBS = 16; // older jobs are forgotten
+const STATUS_INTERVAL = 60; // seconds between coverage logs
+
+// Nonces of a single header, leased out in order, returned ranges first
+class CoordinatorJob {
+    constructor(key) {
+        this.key = key;
+        this.next = 0;
+        this.free = []; // [start, end) of recovered and partly mined leases, sorted and merged
+        this.leases = new Map(); // start -> { instance, start, end }
+        this.covered = 0;
+    }
+
+    // min: the shortest lease the instance can mine, shorter returned ranges are left to others
+    lease(instance, count, min = 1) {
+        count = Math.max(count, min);
+        let start;
+        let end;
+        const index = this.free.findIndex(([freeStart, freeEnd]) => freeEnd - freeStart >= min);
+        if (index !== -1) {
+            [start, end] = this.free[index];
+            if (end - start > count) {
+                this.free[index] = [start + count, end];
+                end = start + count;
+            } else {
+                this.free.splice(index, 1);
+            }
+        } else if (NONCE_END - this.next >= min) {
+            start = this.next;
+            end = Math.min(start + count, NONCE_END);
+            this.next = end;
+        } else {
+            return undefined;
+        }
+        const lease = { instance, start, end };
+        this.leases.set(start, lease);
+        instance.leases.add(lease);
+        lease.job = this;
+        return lease;
+    }
+
+    // covered: first nonce that was not mined
+    close(lease, covered) {
+        this.leases.delete(lease.start);
+        lease.instance.leases.delete(lease);
+        covered = Math.min(Math.max(covered, lease.start), lease.end);
+        this.covered += covered - lease.start;
+        if (covered < lease.end) {
+            this._free(covered, lease.end);
+        }
+    }
+
+    // Adjacent ranges are merged, so that returned tails of leases add up to ranges long enough to mine
+    _free(start, end) {
+        let index = this.free.findIndex(([freeStart]) => freeStart > start);
+        if (index === -1) {
+            index = this.free.length;
+        }
+        const previous = this.free[index - 1];
+        const following = this.free[index];
+        if (following && following[0] === end) {
+            end = following[1];
+            this.free.splice(index, 1);
+        }
+        if (previous && previous[1] === start) {
+            previous[1] = end;
+        } else {
+            this.free.splice(index, 0, [start, end]);
+        }
+    }
+
+    toJSON() {
+        return {
+            job: this.key,
+            covered: this.covered,
+            leased: Array.from(this.leases.values()).reduce((sum, lease) => sum + lease.end - lease.start, 0),
+            free: this.free.reduce((sum, [start, end]) => sum + end - start, 0),
+            remaining: NONCE_END - this.next
+        };
+    }
+}
+
+// Leases disjoint nonce ranges of each job to the miner processes of a host or LAN, so that processes
+// mining the same header don't hash the same nonces. Newline delimited JSON over TCP or a Unix socket.
+class NonceCoordinator {
+    constructor() {
+        this._jobs = new Map(); // insertion order is age
+        this._instances = new Set();
+        this._nextInstanceId = 1;
+        this._server = net.createServer(socket => this._onConnection(socket));
+    }
+
+    // listen({ port, host }) or listen({ path })
+    listen(options) {
+        return new Promise((resolve, reject) => {
+            this._server.once('error', reject);
+            this._server.listen(options, () => {
+                this._server.off('error', reject);
+                this._timeoutTimer = setInterval(() => this._checkInstances(), 1000 * INSTANCE_TIMEOUT / 3);
+                this._statusTimer = setInterval(() => this._logStatus(), 1000 * STATUS_INTERVAL);
+                resolve(this._server.address());
+            });
+        });
+    }
+
+    close() {
+        clearInterval(this._timeoutTimer);
+        clearInterval(this._statusTimer);
+        this._instances.forEach(instance => instance.socket.destroy());
+        return new Promise(resolve => this._server.close(resolve));
+    }
+
+    getStatus() {
+        return {
+            instances: Array.from(this._instances).map(instance => ({ id: instance.id, name: instance.name, leases: instance.leases.size })),
+            jobs: Array.from(this._jobs.values()).map(job => job.toJSON())
+        };
+    }
+
+    _onConnection(socket) {
+        const instance = { id: this._nextInstanceId++, name: undefined, socket, lastSeen: Date.now(), leases: new Set() };
+        this._instances.add(instance);
+        let buffer = '';
+        socket.setEncoding('utf8');
+        socket.on('data', data => {
+            buffer += data;
+            let newline;
+            while ((newline = buffer.indexOf('\n')) !== -1) {
+                const line = buffer.slice(0, newline);
+                buffer = buffer.slice(newline + 1);
+                try {
+                    this._onMessage(instance, JSON.parse(line));
+                } catch (e) {
+                    Nimiq.Log.w(NonceCoordinator, `Instance ${instance.id}: bad message - ${e.message}`);
+                }
+            }
+        });
+        socket.on('close', () => this._onClose(instance));
+        socket.on('error', e => Nimiq.Log.w(NonceCoordinator, `Instance ${instance.id}: ${e.message}`));
+    }
+
+    _onMessage(instance, msg) {
+        instance.lastSeen = Date.now();
+        switch (msg.message) {
+            case 'register':
+                instance.name = msg.name;
+                Nimiq.Log.i(NonceCoordinator, `Instance ${instance.id} registered (${instance.name})`);
+                this._send(instance, { message: 'registered', instance: instance.id });
+                break;
+            case 'lease': {
+                // A NaN count would end up in job.next and block the job for every instance
+                const isCount = value => Number.isSafeInteger(value) && value > 0;
+                if (typeof msg.job !== 'string' || !isCount(msg.count) || (msg.min !== undefined && !isCount(msg.min))) {
+                    throw new Error(`invalid lease request ${JSON.stringify(msg)}`);
+                }
+                const lease = this._getJob(msg.job).lease(instance, msg.count, msg.min);
+                this._send(instance, lease
+                    ? { message: 'lease', job: msg.job, start: lease.start, end: lease.end }
+                    : { message: 'exhausted', job: msg.job });
+                break;
+            }
+            case 'closed': {
+                const job = this._jobs.get(msg.job);
+                const lease = job && job.leases.get(msg.start);
+                if (lease && lease.instance === instance) {
+                    // Without a usable covered nonce the whole lease is leased out again
+                    job.close(lease, Number.isSafeInteger(msg.covered) ? msg.covered : lease.start);
+                }
+                break;
+            }
+            case 'status':
+                this._send(instance, Object.assign({ message: 'status' }, this.getStatus()));
+                break;
+            case 'heartbeat':
+                break;
+        }
+    }
+
+    _getJob(key) {
+        let job = this._jobs.get(key);
+        if (!job) {
+            job = new CoordinatorJob(key);
+            this._jobs.set(key, job);
+            if (this._jobs.size > MAX_JOBS) {
+                const oldest = this._jobs.values().next().value;
+                oldest.leases.forEach(lease => lease.instance.leases.delete(lease));
+                this._jobs.delete(oldest.key);
+            }
+        }
+        return job;
+    }
+
+    // Leases of a dead instance are leased out again as a whole, what it had mined of them is hashed twice
+    _onClose(instance) {
+        this._instances.delete(instance);
+        if (instance.leases.size > 0) {
+            Nimiq.Log.w(NonceCoordinator, `Instance ${instance.id} (${instance.name}) gone, recovering ${instance.leases.size} leases`);
+        }
+        Array.from(instance.leases).forEach(lease => lease.job.close(lease, lease.start));
+    }
+
+    _checkInstances() {
+        const deadline = Date.now() - INSTANCE_TIMEOUT * 1000;
+        this._instances.forEach(instance => {
+            if (instance.lastSeen < deadline) {
+                instance.socket.destroy();
+            }
+        });
+    }
+
+    _logStatus() {
+        const job = Array.from(this._jobs.values()).pop();
+        if (job) {
+            const status = job.toJSON();
+            Nimiq.Log.i(NonceCoordinator, `${this._instances.size} instances, job ${job.key}: ${status.covered} nonces covered, ${status.leased} leased, ${status.free} returned`);
+        }
+    }
+
+    _send(instance, msg) {
+        if (!instance.socket.destroyed) {
+            instance.socket.write(JSON.stringify(msg) + '\n');
+        }
+    }
+}
+
+module.exports = NonceCoordinator;
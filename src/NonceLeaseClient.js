@@ -0,0 +1,161 @@
+const net = require('net');
+const crypto = require('crypto');
+const Nimiq = require('@nimiq/core');
+
+const POLL_INTERVAL = 500; // ms between checks of the native lease queue
+const HEARTBEAT_INTERVAL = 5; // seconds
+const RECONNECT_DELAY = 5; // seconds
+const DEFAULT_LEASE_SIZE = 1 << 22; // nonces
+const NONCE_LENGTH = 4;
+
+// Keeps the native miner supplied with nonce leases from a NonceCoordinator and returns them once used up.
+// Fires 'lost' with the work id of the current job when the coordinator goes away while it is mined.
+class NonceLeaseClient extends Nimiq.Observable {
+    // options: { host, port } or { path }, and optionally name and leaseSize
+    constructor(nativeMiner, options) {
+        super();
+        this._miner = nativeMiner;
+        this._options = options;
+        this._leaseSize = options.leaseSize || DEFAULT_LEASE_SIZE;
+        this._jobs = new Map(); // workId -> job key, until its leases are returned
+        this._requests = new Map(); // job key -> lease requests without an answer
+        this._exhausted = new Set(); // job keys the coordinator has no nonces left for
+        this._connected = false;
+        this._connect();
+        this._pollTimer = setInterval(() => this._poll(), POLL_INTERVAL);
+    }
+
+    get connected() {
+        return this._connected;
+    }
+
+    // Key of a job: the header without its nonce, the same for every process mining it
+    static getJobKey(blockHeader) {
+        return crypto.createHash('sha256').update(blockHeader.subarray(0, blockHeader.length - NONCE_LENGTH)).digest('hex').slice(0, 16);
+    }
+
+    startJob(workId, blockHeader) {
+        this._workId = workId;
+        this._jobs.set(workId, NonceLeaseClient.getJobKey(blockHeader));
+        this._poll();
+    }
+
+    stopJob() {
+        delete this._workId;
+    }
+
+    close() {
+        this._closed = true;
+        clearInterval(this._pollTimer);
+        clearInterval(this._heartbeatTimer);
+        this._socket.end();
+    }
+
+    _connect() {
+        this._socket = net.connect(this._options.path ? { path: this._options.path } : { host: this._options.host, port: this._options.port });
+        let buffer = '';
+        this._socket.setEncoding('utf8');
+        this._socket.on('connect', () => {
+            this._connected = true;
+            this._send({ message: 'register', name: this._options.name });
+            this._heartbeatTimer = setInterval(() => this._send({ message: 'heartbeat' }), 1000 * HEARTBEAT_INTERVAL);
+        });
+        this._socket.on('data', data => {
+            buffer += data;
+            let newline;
+            while ((newline = buffer.indexOf('\n')) !== -1) {
+                const line = buffer.slice(0, newline);
+                buffer = buffer.slice(newline + 1);
+                // Whatever listens on the port, a bad line must not take the miner down
+                try {
+                    const msg = JSON.parse(line);
+                    if (msg && msg.message) {
+                        this._onMessage(msg);
+                    }
+                } catch (e) {
+                    Nimiq.Log.w(NonceLeaseClient, `Bad message from the coordinator - ${e.message}`);
+                }
+            }
+        });
+        this._socket.on('close', () => {
+            const wasConnected = this._connected;
+            this._connected = false;
+            this._requests.clear();
+            clearInterval(this._heartbeatTimer);
+            if (!this._closed) {
+                Nimiq.Log.w(NonceLeaseClient, `Coordinator connection lost, reconnecting in ${RECONNECT_DELAY} seconds`);
+                setTimeout(() => this._connect(), 1000 * RECONNECT_DELAY);
+                // The job can't get more leases until the next one starts, the miner goes on without them
+                if (wasConnected && this._workId !== undefined) {
+                    this.fire('lost', this._workId);
+                }
+            }
+        });
+        this._socket.on('error', e => Nimiq.Log.w(NonceLeaseClient, `Coordinator error - ${e.message}`));
+    }
+
+    _onMessage(msg) {
+        switch (msg.message) {
+            case 'registered':
+                Nimiq.Log.i(NonceLeaseClient, `Registered with the nonce coordinator as instance ${msg.instance}`);
+                break;
+            case 'lease': {
+                this._answered(msg.job);
+                // Leases of a job that already ended come back through the native queue, see Miner::AddNonceLease
+                const workId = Array.from(this._jobs.keys()).reverse().find(id => this._jobs.get(id) === msg.job);
+                if (workId !== undefined) {
+                    this._miner.addNonceLease(workId, msg.start, msg.end);
+                } else {
+                    this._send({ message: 'closed', job: msg.job, start: msg.start, covered: msg.start });
+                }
+                break;
+            }
+            case 'exhausted':
+                this._answered(msg.job);
+                if (!this._exhausted.has(msg.job)) {
+                    Nimiq.Log.w(NonceLeaseClient, `Nonces of job ${msg.job} are used up`);
+                    this._exhausted.add(msg.job);
+                }
+                break;
+        }
+    }
+
+    _answered(job) {
+        const pending = this._requests.get(job) || 0;
+        if (pending > 1) {
+            this._requests.set(job, pending - 1);
+        } else {
+            this._requests.delete(job);
+        }
+    }
+
+    _poll() {
+        const { remaining, batch, closed } = this._miner.getNonceLeases();
+        closed.forEach(lease => {
+            const job = this._jobs.get(lease.workId);
+            if (job !== undefined) {
+                this._send({ message: 'closed', job, start: lease.start, covered: lease.covered });
+            }
+        });
+        // Jobs are forgotten once they are neither current nor have leases out
+        Array.from(this._jobs.keys()).filter(id => id !== this._workId && !closed.some(lease => lease.workId === id))
+            .forEach(id => this._jobs.delete(id));
+        const jobKeys = new Set(this._jobs.values());
+        Array.from(this._exhausted).filter(job => !jobKeys.has(job)).forEach(job => this._exhausted.delete(job));
+
+        // One request at a time, the next one once it is answered. Leases shorter than a batch are of no use.
+        const job = this._jobs.get(this._workId);
+        if (this._connected && job !== undefined && !this._requests.has(job) && !this._exhausted.has(job) && remaining < this._leaseSize) {
+            this._requests.set(job, 1);
+            this._send({ message: 'lease', job, count: this._leaseSize, min: batch || 1 });
+        }
+    }
+
+    _send(msg) {
+        if (this._connected) {
+            this._socket.write(JSON.stringify(msg) + '\n');
+        }
+    }
+}
+
+module.exports = NonceLeaseClient;
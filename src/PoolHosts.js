@@ -0,0 +1,49 @@
+const FAILURE_WINDOW = 600; // seconds a lost connection counts against a host
+const FAILURE_PENALTY = 1; // priority steps per recent failure
+
+// Pool servers in order of preference. Every recent failure moves a host one step down,
+// so a single blip retries the same host while a broken one is skipped until it has been quiet for a while.
+class PoolHosts {
+    constructor(hosts) {
+        this._hosts = hosts.map((entry, priority) => ({
+            host: entry.host,
+            port: entry.port,
+            secure: entry.secure,
+            priority,
+            failures: [], // timestamps
+            connections: 0
+        }));
+    }
+
+    _score(entry, now) {
+        entry.failures = entry.failures.filter(time => now - time < FAILURE_WINDOW * 1000);
+        return entry.priority + entry.failures.length * FAILURE_PENALTY;
+    }
+
+    // Healthiest host, the preferred one on ties
+    select() {
+        const now = Date.now();
+        return this._hosts.reduce((best, entry) => (this._score(entry, now) < this._score(best, now)) ? entry : best);
+    }
+
+    reportFailure(entry) {
+        entry.failures.push(Date.now());
+    }
+
+    reportConnected(entry) {
+        entry.connections++;
+    }
+
+    getStats() {
+        const now = Date.now();
+        return this._hosts.map(entry => ({
+            host: entry.host,
+            port: entry.port,
+            score: this._score(entry, now),
+            recentFailures: entry.failures.length,
+            connections: entry.connections
+        }));
+    }
+}
+
+module.exports = PoolHosts;
@@ -0,0 +1,125 @@
+// Upper bounds of the histogram buckets in ms, the last bucket takes everything above
+const BUCKETS = [0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000];
+
+// Stages of a share in order, each one measured from the end of the previous one
+const STAGES = [
+    'report',   // nonce read back -> handed to the progress queue (native)
+    'async',    // progress queue -> main thread (libuv)
+    'callback', // native callback -> Miner share handler (V8)
+    'dispatch', // 'share' event -> pool miner _submitShare
+    'rehash',   // CryptoWorker Argon2d of the share (nano only)
+    'send',     // -> ws.send
+    'total'     // nonce read back -> ws.send
+];
+
+// process.hrtime() in ns, the native miner stamps results with the same clock (uv_hrtime)
+function now() {
+    const time = process.hrtime();
+    return time[0] * 1e9 + time[1];
+}
+
+class LatencyHistogram {
+    constructor() {
+        this._counts = new Array(BUCKETS.length + 1).fill(0);
+        this._count = 0;
+        this._sum = 0;
+        this._max = 0;
+    }
+
+    get count() {
+        return this._count;
+    }
+
+    add(ms) {
+        let idx = BUCKETS.findIndex(bound => ms <= bound);
+        if (idx === -1) {
+            idx = BUCKETS.length;
+        }
+        this._counts[idx]++;
+        this._count++;
+        this._sum += ms;
+        this._max = Math.max(this._max, ms);
+    }
+
+    // Upper bound of the bucket that holds the percentile
+    percentile(p) {
+        const rank = Math.ceil(this._count * p / 100);
+        let seen = 0;
+        for (let i = 0; i < BUCKETS.length; i++) {
+            seen += this._counts[i];
+            if (seen >= rank) {
+                return Math.min(BUCKETS[i], this._max);
+            }
+        }
+        return this._max;
+    }
+
+    toJSON() {
+        return {
+            count: this._count,
+            mean: (this._count > 0) ? this._sum / this._count : 0,
+            max: this._max,
+            p50: this.percentile(50),
+            p90: this.percentile(90),
+            p99: this.percentile(99),
+            buckets: this._counts.map((count, idx) => ({ le: (idx < BUCKETS.length) ? BUCKETS[idx] : '+Inf', count }))
+        };
+    }
+}
+
+// Timestamps of a single share, stages are added to the histograms as they complete
+class ShareTimeline {
+    constructor(latency, result) {
+        this._latency = latency;
+        this._start = result.found;
+        this._last = result.found;
+        this._mark('report', result.sent);
+        this._mark('async', result.received);
+    }
+
+    mark(stage) {
+        this._mark(stage, now());
+    }
+
+    finish(stage) {
+        this.mark(stage);
+        this._latency.add('total', (this._last - this._start) / 1e6);
+    }
+
+    _mark(stage, time) {
+        this._latency.add(stage, (time - this._last) / 1e6);
+        this._last = time;
+    }
+}
+
+// Per-stage latency histograms of shares, from the GPU result read back to the pool message
+class ShareLatency {
+    constructor() {
+        this._histograms = {};
+        STAGES.forEach(stage => this._histograms[stage] = new LatencyHistogram());
+    }
+
+    // Starts the timeline of a share from a native result object (found, sent and received timestamps)
+    track(result) {
+        return new ShareTimeline(this, result);
+    }
+
+    add(stage, ms) {
+        this._histograms[stage].add(ms);
+    }
+
+    getStats() {
+        const stats = {};
+        STAGES.forEach(stage => stats[stage] = this._histograms[stage].toJSON());
+        return stats;
+    }
+
+    // p50/p99 of each stage that saw shares, e.g. for the log
+    summary() {
+        return STAGES.filter(stage => this._histograms[stage].count > 0)
+            .map(stage => `${stage} ${this._histograms[stage].percentile(50)}/${this._histograms[stage].percentile(99)}`)
+            .join(', ');
+    }
+}
+
+module.exports = ShareLatency;
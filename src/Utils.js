@@ -24,21 +24,42 @@ exports.readConfigFile = function (fileName) {
     }
 }
 
-exports.getNewHost = function (currentHost) {
+// Pool servers in order of preference: "hosts" if set, otherwise "host" followed by the other SushiPool servers
+exports.getPoolOptions = function (config) {
     const FALLBACK_HOSTS = [
         'eu.sushipool.com',
         'us.sushipool.com',
         'asia.sushipool.com'
     ];
-    let idx = FALLBACK_HOSTS.indexOf(currentHost);
-    if (idx !== -1) {
-        // if current host is found in fallback hosts, then try the next one
-        idx = (idx + 1) % FALLBACK_HOSTS.length;
-    } else { // otherwise just randomly choose one fallback host
-        idx = Math.floor(Math.random() * FALLBACK_HOSTS.length);
+    const DEFAULT_PORT = 443;
+    const DEFAULT_RECONNECT_GRACE = 30; // seconds
+
+    // "host:port", "ws://host:port" without TLS (e.g. poolsim.js) or { host, port, secure }
+    const toHost = (entry) => {
+        if (typeof entry === 'string') {
+            const secure = !entry.startsWith('ws://');
+            const [host, port] = entry.replace(/^wss?:\/\//, '').split(':');
+            return { host, port: Number(port) || DEFAULT_PORT, secure };
+        }
+        return { host: entry.host, port: Number(entry.port) || DEFAULT_PORT, secure: entry.secure !== false };
+    };
+
+    let hosts;
+    if (Array.isArray(config.hosts) && config.hosts.length > 0) {
+        hosts = config.hosts.map(toHost);
+    } else {
+        const port = Number(config.port) || DEFAULT_PORT;
+        hosts = [{ host: config.host, port, secure: true }];
+        if (FALLBACK_HOSTS.includes(config.host)) {
+            FALLBACK_HOSTS.filter(host => host !== config.host).forEach(host => hosts.push({ host, port, secure: true }));
+        }
     }
-    const newHost = FALLBACK_HOSTS[idx];
-    return newHost;
+    const reconnectGrace = Number(config.reconnectGrace);
+
+    return {
+        hosts,
+        reconnectGrace: (reconnectGrace >= 0) ? reconnectGrace : DEFAULT_RECONNECT_GRACE
+    };
 }
 
 exports.getDeviceOptions = function (config) {
@@ -47,18 +68,72 @@ exports.getDeviceOptions = function (config) {
     const threads = Array.isArray(config.threads) ? config.threads : [];
     const cache = Array.isArray(config.cache) ? config.cache : [];
     const jobs = Array.isArray(config.jobs) ? config.jobs : [];
+    const persistent = Array.isArray(config.persistent) ? config.persistent : [];
+    const vectorBlake2b = Array.isArray(config.vectorBlake2b) ? config.vectorBlake2b : [];
+    const tune = Array.isArray(config.tune) ? config.tune : [];
+    const profile = Array.isArray(config.profile) ? config.profile : [];
+    const tmto = Array.isArray(config.tmto) ? config.tmto : [];
+    const threadsPerLane = Array.isArray(config.threadsPerLane) ? config.threadsPerLane : [];
+    const verify = Array.isArray(config.verify) ? config.verify : [];
+    const verifyThreshold = Array.isArray(config.verifyThreshold) ? config.verifyThreshold : [];
 
-    const getOption = (values, deviceIndex) => {
+    const getOption = (values, deviceIndex, isValid = Number.isInteger) => {
         if (values.length > 0) {
             const value = (values.length === 1) ? values[0] : values[(devices.length === 0) ? deviceIndex : devices.indexOf(deviceIndex)];
-            if (Number.isInteger(value)) {
+            if (isValid(value)) {
                 return value;
             }
         }
         return undefined;
     };
+    const isBoolean = value => (typeof value === 'boolean');
+    const isPercent = value => (typeof value === 'number' && value >= 0 && value <= 100);
+    const isThreadsPerLane = value => [8, 16, 32].includes(value);
+
+    // Share of the nonces of rigs mining for the same address, e.g. { "stride": 3, "offset": 1 } is the second of three,
+    // optionally within [start, end). Checked here, the native miner would only reject it when the first block starts.
+    let nonceRange;
+    if (typeof config.nonces === 'object') {
+        const { stride = 1, offset = 0, start = 0, end = 0xFFFFFFFF } = config.nonces;
+        const isNonce = value => Number.isInteger(value) && value >= 0 && value <= 0xFFFFFFFF;
+        if (!Number.isInteger(stride) || stride < 1) {
+            throw new Error(`Invalid "nonces": stride must be an integer >= 1, got ${stride}`);
+        }
+        if (!Number.isInteger(offset) || offset < 0 || offset >= stride) {
+            throw new Error(`Invalid "nonces": offset must be an integer from 0 to stride - 1 (${stride - 1}), got ${offset}`);
+        }
+        if (!isNonce(start) || !isNonce(end) || start >= end) {
+            throw new Error(`Invalid "nonces": start must be below end, got ${start} and ${end}`);
+        }
+        nonceRange = { stride, offset };
+        if (config.nonces.start !== undefined || config.nonces.end !== undefined) {
+            Object.assign(nonceRange, { start, end });
+        }
+    }
+
+    // Timeline of a single window, e.g. { "file": "trace.json", "delay": 60, "duration": 10 }
+    let trace;
+    if (config.trace) {
+        const delay = Number(config.trace.delay);
+        const duration = Number(config.trace.duration);
+        trace = {
+            file: config.trace.file || 'miner-trace.json',
+            delay: (delay >= 0) ? delay : 60,
+            duration: (duration > 0) ? duration : 10
+        };
+    }
 
     return {
+        trace,
+        // Also mine on non-GPU OpenCL devices, e.g. POCL on a CPU against poolsim.js
+        allDevices: config.allDevices === true,
+        // Work trace file for replay.js
+        record: (typeof config.record === 'string') ? config.record : undefined,
+        // Argon2d parameters of a test network, e.g. { "memoryCost": 1024, "passes": 2 }, Nimiq's by default
+        argon2: (typeof config.argon2 === 'object') ? config.argon2 : undefined,
+        nonceRange,
+        // Nonce coordinator shared by the miner processes of a host or LAN, e.g. { "host": "127.0.0.1", "port": 4444 } or { "path": "/tmp/nonces.sock" }
+        coordinator: (typeof config.coordinator === 'object') ? Object.assign({ name: config.name }, config.coordinator) : undefined,
         forDevice: (deviceIndex) => {
             const enabled = (devices.length === 0) || devices.includes(deviceIndex);
             if (!enabled) {
@@ -71,7 +146,15 @@ exports.getDeviceOptions = function (config) {
                 memory: getOption(memory, deviceIndex),
                 threads: getOption(threads, deviceIndex),
                 cache: getOption(cache, deviceIndex),
-                jobs: getOption(jobs, deviceIndex)
+                jobs: getOption(jobs, deviceIndex),
+                persistent: getOption(persistent, deviceIndex, isBoolean),
+                vectorBlake2b: getOption(vectorBlake2b, deviceIndex, isBoolean),
+                tune: getOption(tune, deviceIndex, isBoolean),
+                profile: getOption(profile, deviceIndex, isBoolean),
+                tmto: getOption(tmto, deviceIndex),
+                threadsPerLane: getOption(threadsPerLane, deviceIndex, isThreadsPerLane),
+                verify: getOption(verify, deviceIndex),
+                verifyThreshold: getOption(verifyThreshold, deviceIndex, isPercent)
             };
         }
     }
@@ -0,0 +1,134 @@
+const fs = require('fs');
+const Nimiq = require('@nimiq/core');
+
+// Binary log of the work a Miner was given and the results it delivered:
+// magic, then records of type (u8), ms since the recording started (u32) and a payload, all big endian
+const MAGIC = 'NWT1';
+const FLUSH_INTERVAL = 1000; // ms
+
+const START = 1; // header length (u16), header
+const SHARE_COMPACT = 2; // compact (u32)
+const STOP = 3;
+const RESULT = 4; // device (u8), hashes (u32), nonce (u32), block (u8)
+
+class WorkTraceWriter {
+    constructor(fileName) {
+        this._fd = fs.openSync(fileName, 'w');
+        this._chunks = [Buffer.from(MAGIC)];
+        this._start = Date.now();
+        this._flushTimer = setInterval(() => this.flush(), FLUSH_INTERVAL);
+    }
+
+    _record(type, payload) {
+        const record = Buffer.alloc(5 + payload.length);
+        record.writeUInt8(type, 0);
+        record.writeUInt32BE(Date.now() - this._start, 1);
+        payload.copy(record, 5);
+        this._chunks.push(record);
+    }
+
+    startMiningOnBlock(blockHeader) {
+        const payload = Buffer.alloc(2 + blockHeader.length);
+        payload.writeUInt16BE(blockHeader.length, 0);
+        Buffer.from(blockHeader).copy(payload, 2);
+        this._record(START, payload);
+    }
+
+    setShareCompact(shareCompact) {
+        const payload = Buffer.alloc(4);
+        payload.writeUInt32BE(shareCompact, 0);
+        this._record(SHARE_COMPACT, payload);
+    }
+
+    stop() {
+        this._record(STOP, Buffer.alloc(0));
+    }
+
+    result(obj) {
+        const payload = Buffer.alloc(10);
+        payload.writeUInt8(obj.device, 0);
+        payload.writeUInt32BE(obj.hashes, 1);
+        payload.writeUInt32BE(obj.nonce, 5);
+        payload.writeUInt8(obj.block ? 1 : 0, 9);
+        this._record(RESULT, payload);
+    }
+
+    flush() {
+        if (this._chunks.length > 0) {
+            fs.writeSync(this._fd, Buffer.concat(this._chunks));
+            this._chunks = [];
+        }
+    }
+
+    close() {
+        clearInterval(this._flushTimer);
+        this.flush();
+        fs.closeSync(this._fd);
+    }
+}
+
+// Payload bytes of a record whose payload starts at offset, undefined if the length isn't there yet
+function payloadLength(data, type, offset) {
+    switch (type) {
+        case START:
+            return (offset + 2 <= data.length) ? 2 + data.readUInt16BE(offset) : undefined;
+        case SHARE_COMPACT:
+            return 4;
+        case STOP:
+            return 0;
+        case RESULT:
+            return 10;
+        default:
+            throw new Error(`Unknown record type ${type} at ${offset - 5}`);
+    }
+}
+
+// Records as { type, time, ... } objects, type is 'start', 'shareCompact', 'stop' or 'result'.
+// A recording cut off mid-record, e.g. by a crash, ends with the last complete record.
+function readWorkTrace(fileName) {
+    const data = fs.readFileSync(fileName);
+    if (data.toString('latin1', 0, 4) !== MAGIC) {
+        throw new Error(`${fileName} is not a work trace`);
+    }
+    const records = [];
+    let offset = 4;
+    while (offset < data.length) {
+        const size = (offset + 5 <= data.length) ? payloadLength(data, data.readUInt8(offset), offset + 5) : undefined;
+        if (size === undefined || offset + 5 + size > data.length) {
+            Nimiq.Log.w('WorkTrace', `${fileName}: ignoring a truncated record of ${data.length - offset} bytes at the end`);
+            break;
+        }
+        const type = data.readUInt8(offset);
+        const time = data.readUInt32BE(offset + 1);
+        offset += 5;
+        switch (type) {
+            case START: {
+                const length = data.readUInt16BE(offset);
+                records.push({ type: 'start', time, header: new Uint8Array(data.subarray(offset + 2, offset + 2 + length)) });
+                offset += 2 + length;
+                break;
+            }
+            case SHARE_COMPACT:
+                records.push({ type: 'shareCompact', time, shareCompact: data.readUInt32BE(offset) });
+                offset += 4;
+                break;
+            case STOP:
+                records.push({ type: 'stop', time });
+                break;
+            case RESULT:
+                records.push({
+                    type: 'result',
+                    time,
+                    device: data.readUInt8(offset),
+                    hashes: data.readUInt32BE(offset + 1),
+                    nonce: data.readUInt32BE(offset + 5),
+                    block: data.readUInt8(offset + 9) === 1
+                });
+                offset += 10;
+                break;
+        }
+    }
+    return records;
+}
+
+module.exports = { WorkTraceWriter, readWorkTrace };
@@ -31,9 +31,81 @@ SOFTWARE.
 std::string srcArgon2d{R"====(
 #define ARGON2_BLOCK_SIZE 1024
 #define ARGON2_QWORDS_IN_BLOCK (ARGON2_BLOCK_SIZE / 8)
+
+// Parameter set, the host passes these as build options (Nimiq by default)
+#ifndef MEMORY_COST
 #define MEMORY_COST 512
+#endif
+#ifndef PASSES
+#define PASSES 1
+#endif
+#define SYNC_POINTS 4
+#define SEGMENT_LENGTH (MEMORY_COST / SYNC_POINTS) // single lane
+
+#if defined(TMTO_K) && PASSES > 1
+#error "The time-memory tradeoff needs a single pass"
+#endif
 
+// Distance back from curr to ref, later passes reference blocks of the previous one
+#if PASSES > 1
+#define REF_OFFSET(curr, ref) (((curr) > (ref)) ? (curr) - (ref) : (curr) + MEMORY_COST - (ref))
+#else
+#define REF_OFFSET(curr, ref) ((curr) - (ref))
+#endif
+
+// Work-items per hash, each one computes G_PER_THREAD of the 32 independent G functions of a round.
+// The block layout in memory is the same for all of them.
+#ifndef THREADS_PER_LANE
 #define THREADS_PER_LANE 32
+#endif
+#if THREADS_PER_LANE != 32 && THREADS_PER_LANE != 16 && THREADS_PER_LANE != 8
+#error "THREADS_PER_LANE must be 8, 16 or 32"
+#endif
+#define G_PER_ROUND 32
+#define G_PER_THREAD (G_PER_ROUND / THREADS_PER_LANE)
+#define G_INDEX(i) (thread + (i) * THREADS_PER_LANE) // G function i of this work-item
+
+// Work-items of a lane run in lockstep on GPUs, other devices (e.g. CPUs) need explicit barriers
+#ifdef USE_BARRIERS
+#define LOCAL_BARRIER() barrier(CLK_LOCAL_MEM_FENCE)
+#else
+#define LOCAL_BARRIER()
+#endif
+
+// Reference locality counters, gathered per work-group in local memory (see struct ref_profile in miner.h)
+#define REF_PROFILE_OFFSETS 64
+#define REF_PROFILE_LOCAL_HITS 0
+#define REF_PROFILE_GLOBAL_MISSES 1
+#define REF_PROFILE_HISTOGRAM 2 // ref_offset 1..REF_PROFILE_OFFSETS, larger offsets share the last bucket
+#define REF_PROFILE_SIZE (REF_PROFILE_HISTOGRAM + REF_PROFILE_OFFSETS + 1)
+
+#ifdef PROFILE_REFS
+#define REF_PROFILE_PARAM , __local uint *ref_counts
+#define REF_PROFILE_ARG , ref_counts
+#define COUNT_REF(offset)                                                                                          \
+    if (thread == 0)                                                                                               \
+    {                                                                                                              \
+        atomic_inc(&ref_counts[(offset) <= CACHE_SIZE ? REF_PROFILE_LOCAL_HITS : REF_PROFILE_GLOBAL_MISSES]);     \
+        atomic_inc(&ref_counts[REF_PROFILE_HISTOGRAM + min((uint)(offset), (uint)REF_PROFILE_OFFSETS + 1) - 1]); \
+    }
+#else
+#define REF_PROFILE_PARAM
+#define REF_PROFILE_ARG
+#define COUNT_REF(offset)
+#endif
+
+// Time-memory tradeoff: only blocks 0, 1 and every TMTO_K-th block are kept in global memory,
+// followed by the last block and TMTO_DEPTH chains of scratch blocks for recomputation
+#ifdef TMTO_K
+#define TMTO_LAST_SLOT (2 + (MEMORY_COST - 1) / TMTO_K)
+#define TMTO_SCRATCH_SLOT (TMTO_LAST_SLOT + 1)
+#define TMTO_FLAG_SLOT TMTO_SCRATCH_SLOT // first block of the first chain is never used
+#define LAST_BLOCK_SLOT TMTO_LAST_SLOT
+#define CACHE_STRIDE (CACHE_SIZE + 1)    // recomputation shuffles in an extra local block
+#else
+#define LAST_BLOCK_SLOT (MEMORY_COST - 1)
+#define CACHE_STRIDE CACHE_SIZE
+#endif
 
 struct block_g
 {
@@ -42,19 +114,20 @@ struct block_g
 
 struct block_th
 {
-    ulong a, b, c, d;
+    ulong a[G_PER_THREAD], b[G_PER_THREAD], c[G_PER_THREAD], d[G_PER_THREAD];
 };
 
-#define ROUND1_IDX(x) (((thread & 0x1c) << 2) | (x << 2) | (thread & 0x3))
-#define ROUND2_IDX(x) (((thread & 0x1c) << 2) | (x << 2) | ((thread + x) & 0x3))
-#define ROUND3_IDX(x) ((x << 5) | ((thread & 0x2) << 3) | ((thread & 0x1c) >> 1) | (thread & 0x1))
-#define ROUND4_IDX(x) ((x << 5) | (((thread + x) & 0x2) << 3) | ((thread & 0x1c) >> 1) | ((thread + x) & 0x1))
+// Position in the block of the x-th input of G function t in each step of the permutation
+#define ROUND1_IDX(t, x) ((((t) & 0x1c) << 2) | (x << 2) | ((t) & 0x3))
+#define ROUND2_IDX(t, x) ((((t) & 0x1c) << 2) | (x << 2) | (((t) + x) & 0x3))
+#define ROUND3_IDX(t, x) ((x << 5) | (((t) & 0x2) << 3) | (((t) & 0x1c) >> 1) | ((t) & 0x1))
+#define ROUND4_IDX(t, x) ((x << 5) | ((((t) + x) & 0x2) << 3) | (((t) & 0x1c) >> 1) | (((t) + x) & 0x1))
 
-#define IDX_X(r, x) (r == 1 ? (ROUND1_IDX(x)) : (r == 2 ? (ROUND2_IDX(x)) : (r == 3 ? (ROUND3_IDX(x)) : ROUND4_IDX(x))))
-#define IDX_A(r) (IDX_X(r, 0))
-#define IDX_B(r) (IDX_X(r, 1))
-#define IDX_C(r) (IDX_X(r, 2))
-#define IDX_D(r) (IDX_X(r, 3))
+#define IDX_X(r, t, x) (r == 1 ? (ROUND1_IDX(t, x)) : (r == 2 ? (ROUND2_IDX(t, x)) : (r == 3 ? (ROUND3_IDX(t, x)) : ROUND4_IDX(t, x))))
+#define IDX_A(r, t) (IDX_X(r, t, 0))
+#define IDX_B(r, t) (IDX_X(r, t, 1))
+#define IDX_C(r, t) (IDX_X(r, t, 2))
+#define IDX_D(r, t) (IDX_X(r, t, 3))
 
 void move_block(struct block_th *dst, const struct block_th *src)
 {
@@ -63,67 +136,91 @@ void move_block(struct block_th *dst, const struct block_th *src)
 
 void xor_block(struct block_th *dst, const struct block_th *src)
 {
-    dst->a ^= src->a;
-    dst->b ^= src->b;
-    dst->c ^= src->c;
-    dst->d ^= src->d;
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        dst->a[i] ^= src->a[i];
+        dst->b[i] ^= src->b[i];
+        dst->c[i] ^= src->c[i];
+        dst->d[i] ^= src->d[i];
+    }
 }
 
 void load_block_global(struct block_th *dst, __global const struct block_g *src, uint thread)
 {
-    dst->a = src->data[0 * THREADS_PER_LANE + thread];
-    dst->b = src->data[1 * THREADS_PER_LANE + thread];
-    dst->c = src->data[2 * THREADS_PER_LANE + thread];
-    dst->d = src->data[3 * THREADS_PER_LANE + thread];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        dst->a[i] = src->data[0 * G_PER_ROUND + G_INDEX(i)];
+        dst->b[i] = src->data[1 * G_PER_ROUND + G_INDEX(i)];
+        dst->c[i] = src->data[2 * G_PER_ROUND + G_INDEX(i)];
+        dst->d[i] = src->data[3 * G_PER_ROUND + G_INDEX(i)];
+    }
 }
 
 void load_block_local(struct block_th *dst, __local const struct block_g *src, uint thread)
 {
-    dst->a = src->data[0 * THREADS_PER_LANE + thread];
-    dst->b = src->data[1 * THREADS_PER_LANE + thread];
-    dst->c = src->data[2 * THREADS_PER_LANE + thread];
-    dst->d = src->data[3 * THREADS_PER_LANE + thread];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        dst->a[i] = src->data[0 * G_PER_ROUND + G_INDEX(i)];
+        dst->b[i] = src->data[1 * G_PER_ROUND + G_INDEX(i)];
+        dst->c[i] = src->data[2 * G_PER_ROUND + G_INDEX(i)];
+        dst->d[i] = src->data[3 * G_PER_ROUND + G_INDEX(i)];
+    }
 }
 
 void load_block_xor_global(struct block_th *dst, __global const struct block_g *src, uint thread)
 {
-    dst->a ^= src->data[0 * THREADS_PER_LANE + thread];
-    dst->b ^= src->data[1 * THREADS_PER_LANE + thread];
-    dst->c ^= src->data[2 * THREADS_PER_LANE + thread];
-    dst->d ^= src->data[3 * THREADS_PER_LANE + thread];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        dst->a[i] ^= src->data[0 * G_PER_ROUND + G_INDEX(i)];
+        dst->b[i] ^= src->data[1 * G_PER_ROUND + G_INDEX(i)];
+        dst->c[i] ^= src->data[2 * G_PER_ROUND + G_INDEX(i)];
+        dst->d[i] ^= src->data[3 * G_PER_ROUND + G_INDEX(i)];
+    }
 }
 
 void load_block_xor_local(struct block_th *dst, __local const struct block_g *src, uint thread)
 {
-    dst->a ^= src->data[0 * THREADS_PER_LANE + thread];
-    dst->b ^= src->data[1 * THREADS_PER_LANE + thread];
-    dst->c ^= src->data[2 * THREADS_PER_LANE + thread];
-    dst->d ^= src->data[3 * THREADS_PER_LANE + thread];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        dst->a[i] ^= src->data[0 * G_PER_ROUND + G_INDEX(i)];
+        dst->b[i] ^= src->data[1 * G_PER_ROUND + G_INDEX(i)];
+        dst->c[i] ^= src->data[2 * G_PER_ROUND + G_INDEX(i)];
+        dst->d[i] ^= src->data[3 * G_PER_ROUND + G_INDEX(i)];
+    }
 }
 
 void store_block_global(__global struct block_g *dst, const struct block_th *src, uint thread)
 {
-    dst->data[0 * THREADS_PER_LANE + thread] = src->a;
-    dst->data[1 * THREADS_PER_LANE + thread] = src->b;
-    dst->data[2 * THREADS_PER_LANE + thread] = src->c;
-    dst->data[3 * THREADS_PER_LANE + thread] = src->d;
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        dst->data[0 * G_PER_ROUND + G_INDEX(i)] = src->a[i];
+        dst->data[1 * G_PER_ROUND + G_INDEX(i)] = src->b[i];
+        dst->data[2 * G_PER_ROUND + G_INDEX(i)] = src->c[i];
+        dst->data[3 * G_PER_ROUND + G_INDEX(i)] = src->d[i];
+    }
 }
 
 void store_last_block(__global struct block_g *dst, const struct block_th *src, uint thread)
 {
-    uint idx = (thread & 0x1c) << 2 | (thread & 0x3);
-    dst->data[0 + idx] = src->a;
-    dst->data[4 + idx] = src->b;
-    dst->data[8 + idx] = src->c;
-    dst->data[12 + idx] = src->d;
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        uint idx = (G_INDEX(i) & 0x1c) << 2 | (G_INDEX(i) & 0x3);
+        dst->data[0 + idx] = src->a[i];
+        dst->data[4 + idx] = src->b[i];
+        dst->data[8 + idx] = src->c[i];
+        dst->data[12 + idx] = src->d[i];
+    }
 }
 
 void store_block_local(__local struct block_g *dst, const struct block_th *src, uint thread)
 {
-    dst->data[0 * THREADS_PER_LANE + thread] = src->a;
-    dst->data[1 * THREADS_PER_LANE + thread] = src->b;
-    dst->data[2 * THREADS_PER_LANE + thread] = src->c;
-    dst->data[3 * THREADS_PER_LANE + thread] = src->d;
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        dst->data[0 * G_PER_ROUND + G_INDEX(i)] = src->a[i];
+        dst->data[1 * G_PER_ROUND + G_INDEX(i)] = src->b[i];
+        dst->data[2 * G_PER_ROUND + G_INDEX(i)] = src->c[i];
+        dst->data[3 * G_PER_ROUND + G_INDEX(i)] = src->d[i];
+    }
 }
 
 #ifdef cl_amd_media_ops
@@ -190,100 +287,253 @@ inline ulong f(ulong x, ulong y)
 
 void g(struct block_th *block)
 {
-    ulong a, b, c, d;
-    a = block->a;
-    b = block->b;
-    c = block->c;
-    d = block->d;
-
-    a = f(a, b);
-    d = rotr_32(d ^ a);
-    c = f(c, d);
-    b = rotr_24(b ^ c);
-    a = f(a, b);
-    d = rotr_16(d ^ a);
-    c = f(c, d);
-    b = rotr_63(b ^ c);
-
-    block->a = a;
-    block->b = b;
-    block->c = c;
-    block->d = d;
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        ulong a, b, c, d;
+        a = block->a[i];
+        b = block->b[i];
+        c = block->c[i];
+        d = block->d[i];
+
+        a = f(a, b);
+        d = rotr_32(d ^ a);
+        c = f(c, d);
+        b = rotr_24(b ^ c);
+        a = f(a, b);
+        d = rotr_16(d ^ a);
+        c = f(c, d);
+        b = rotr_63(b ^ c);
+
+        block->a[i] = a;
+        block->b[i] = b;
+        block->c[i] = c;
+        block->d[i] = d;
+    }
 }
 
 void shuffle_block(struct block_th *block, __local struct block_g *buf, uint thread)
 {
     g(block);
 
+    LOCAL_BARRIER();
     // Shuffle 1, index of A doesn't change
-    buf->data[IDX_B(1)] = block->b;
-    buf->data[IDX_C(1)] = block->c;
-    buf->data[IDX_D(1)] = block->d;
-    //barrier(CLK_LOCAL_MEM_FENCE);
-    block->b = buf->data[IDX_B(2)];
-    block->c = buf->data[IDX_C(2)];
-    block->d = buf->data[IDX_D(2)];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        buf->data[IDX_B(1, G_INDEX(i))] = block->b[i];
+        buf->data[IDX_C(1, G_INDEX(i))] = block->c[i];
+        buf->data[IDX_D(1, G_INDEX(i))] = block->d[i];
+    }
+    LOCAL_BARRIER();
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        block->b[i] = buf->data[IDX_B(2, G_INDEX(i))];
+        block->c[i] = buf->data[IDX_C(2, G_INDEX(i))];
+        block->d[i] = buf->data[IDX_D(2, G_INDEX(i))];
+    }
 
     g(block);
 
     // Shuffle 2
-    buf->data[IDX_A(2)] = block->a;
-    buf->data[IDX_B(2)] = block->b;
-    buf->data[IDX_C(2)] = block->c;
-    buf->data[IDX_D(2)] = block->d;
-    //barrier(CLK_LOCAL_MEM_FENCE);
-    block->a = buf->data[IDX_A(3)];
-    block->b = buf->data[IDX_B(3)];
-    block->c = buf->data[IDX_C(3)];
-    block->d = buf->data[IDX_D(3)];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        buf->data[IDX_A(2, G_INDEX(i))] = block->a[i];
+        buf->data[IDX_B(2, G_INDEX(i))] = block->b[i];
+        buf->data[IDX_C(2, G_INDEX(i))] = block->c[i];
+        buf->data[IDX_D(2, G_INDEX(i))] = block->d[i];
+    }
+    LOCAL_BARRIER();
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        block->a[i] = buf->data[IDX_A(3, G_INDEX(i))];
+        block->b[i] = buf->data[IDX_B(3, G_INDEX(i))];
+        block->c[i] = buf->data[IDX_C(3, G_INDEX(i))];
+        block->d[i] = buf->data[IDX_D(3, G_INDEX(i))];
+    }
 
     g(block);
 
     // Shuffle 3, index of A doesn't change
-    buf->data[IDX_B(3)] = block->b;
-    buf->data[IDX_C(3)] = block->c;
-    buf->data[IDX_D(3)] = block->d;
-    //barrier(CLK_LOCAL_MEM_FENCE);
-    block->b = buf->data[IDX_B(4)];
-    block->c = buf->data[IDX_C(4)];
-    block->d = buf->data[IDX_D(4)];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        buf->data[IDX_B(3, G_INDEX(i))] = block->b[i];
+        buf->data[IDX_C(3, G_INDEX(i))] = block->c[i];
+        buf->data[IDX_D(3, G_INDEX(i))] = block->d[i];
+    }
+    LOCAL_BARRIER();
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        block->b[i] = buf->data[IDX_B(4, G_INDEX(i))];
+        block->c[i] = buf->data[IDX_C(4, G_INDEX(i))];
+        block->d[i] = buf->data[IDX_D(4, G_INDEX(i))];
+    }
 
     g(block);
 
     // Revert to initial
-    buf->data[IDX_A(4)] = block->a;
-    buf->data[IDX_B(4)] = block->b;
-    buf->data[IDX_C(4)] = block->c;
-    buf->data[IDX_D(4)] = block->d;
-    //barrier(CLK_LOCAL_MEM_FENCE);
-    block->a = buf->data[IDX_A(1)];
-    block->b = buf->data[IDX_B(1)];
-    block->c = buf->data[IDX_C(1)];
-    block->d = buf->data[IDX_D(1)];
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        buf->data[IDX_A(4, G_INDEX(i))] = block->a[i];
+        buf->data[IDX_B(4, G_INDEX(i))] = block->b[i];
+        buf->data[IDX_C(4, G_INDEX(i))] = block->c[i];
+        buf->data[IDX_D(4, G_INDEX(i))] = block->d[i];
+    }
+    LOCAL_BARRIER();
+    for (uint i = 0; i < G_PER_THREAD; i++)
+    {
+        block->a[i] = buf->data[IDX_A(1, G_INDEX(i))];
+        block->b[i] = buf->data[IDX_B(1, G_INDEX(i))];
+        block->c[i] = buf->data[IDX_C(1, G_INDEX(i))];
+        block->d[i] = buf->data[IDX_D(1, G_INDEX(i))];
+    }
 }
 
-uint compute_ref_index(__local struct block_g *block, uint curr_index)
+uint seed_ref_index(ulong v, uint curr_index)
 {
-    ulong v = block->data[0];
     uint ref_index = (uint) v;
     uint ref_area_size = curr_index; // -1
     ref_index = mul_hi(ref_index, ref_index);
     return ref_area_size - 1 - mul_hi(ref_area_size, ref_index);
 }
 
-__kernel
-__attribute__((reqd_work_group_size(32, JOBS_PER_BLOCK, 1)))
-void argon2(__local struct block_g *shmem, __global struct block_g *memory)
+uint compute_ref_index(__local struct block_g *block, uint curr_index)
 {
-    uint job_id = get_global_id(1);
-    uint warp   = get_local_id(1);
-    uint thread = get_local_id(0);
-    uint nonces_per_run = get_global_size(1);
+    return seed_ref_index(block->data[0], curr_index);
+}
 
-    __local struct block_g *cache = &shmem[warp * CACHE_SIZE];
+#if PASSES > 1
+// Ref of the block after curr_index in passes > 0: anything but the current segment
+uint next_pass_ref_index(__local struct block_g *block, uint curr_index)
+{
+    uint next_index = (curr_index + 1) % MEMORY_COST;
+    uint slice = next_index / SEGMENT_LENGTH;
+    uint ref_area_size = MEMORY_COST - SEGMENT_LENGTH + next_index % SEGMENT_LENGTH - 1;
+    uint start_position = (slice == SYNC_POINTS - 1) ? 0 : (slice + 1) * SEGMENT_LENGTH;
+    uint ref_index = (uint) block->data[0];
+    ref_index = mul_hi(ref_index, ref_index);
+    return (start_position + ref_area_size - 1 - mul_hi(ref_area_size, ref_index)) % MEMORY_COST;
+}
+#endif
 
-    memory += job_id;
+#ifdef TMTO_K
+bool is_stored(uint index)
+{
+    return index < 2 || index % TMTO_K == 0;
+}
 
+uint block_slot(uint index)
+{
+    return (index < 2) ? index : 1 + index / TMTO_K;
+}
+
+uint chain_start(uint index)
+{
+    return (index < TMTO_K) ? 1 : index - index % TMTO_K;
+}
+
+__global struct block_g *chain_block(__global struct block_g *memory, uint level, uint offset, uint nonces_per_run)
+{
+    return memory + (TMTO_SCRATCH_SLOT + level * TMTO_K + offset) * nonces_per_run;
+}
+
+// data[0] of a block for the whole lane, read back from local memory like in the main loop
+ulong block_seed(__local struct block_g *buf, const struct block_th *block, uint thread)
+{
+    LOCAL_BARRIER();
+    store_block_local(buf, block, thread);
+    LOCAL_BARRIER();
+    return buf->data[0];
+}
+
+// Rebuilds a block that wasn't stored, starting from the closest stored block before it.
+// Each nesting level keeps its chain in its own scratch blocks, references to other missing
+// blocks start a chain one level deeper. Returns 0 once that would exceed TMTO_DEPTH.
+__global struct block_g *recompute_block(__local struct block_g *buf, __global struct block_g *memory, uint target,
+                                         uint thread, uint nonces_per_run)
+{
+    uint start[TMTO_DEPTH], next[TMTO_DEPTH], last[TMTO_DEPTH];
+    ulong seed[TMTO_DEPTH];
+    struct block_th block, tmp;
+
+    for (uint l = 0; l < TMTO_DEPTH; l++)
+    {
+        start[l] = 0;
+        next[l] = 0;
+    }
+
+    int level = 0;
+    start[0] = chain_start(target);
+    next[0] = start[0] + 1;
+    last[0] = target;
+    load_block_global(&block, memory + block_slot(start[0]) * nonces_per_run, thread);
+    seed[0] = block_seed(buf, &block, thread);
+
+    while (next[0] <= last[0])
+    {
+        uint curr_index = next[level];
+        if (curr_index > last[level])
+        {
+            level--; // the parent finds the block in this chain now
+            continue;
+        }
+        uint ref_index = seed_ref_index(seed[level], curr_index - 1);
+
+        __global struct block_g *ref = 0;
+        if (is_stored(ref_index))
+        {
+            ref = memory + block_slot(ref_index) * nonces_per_run;
+        }
+        for (uint l = 0; l < TMTO_DEPTH; l++)
+        {
+            if (ref_index > start[l] && ref_index < next[l])
+            {
+                ref = chain_block(memory, l, ref_index - start[l], nonces_per_run);
+            }
+        }
+
+        if (ref == 0)
+        {
+            if (level + 1 == TMTO_DEPTH)
+            {
+                return 0;
+            }
+            level++;
+            start[level] = chain_start(ref_index);
+            next[level] = start[level] + 1;
+            last[level] = ref_index;
+            load_block_global(&block, memory + block_slot(start[level]) * nonces_per_run, thread);
+            seed[level] = block_seed(buf, &block, thread);
+            continue;
+        }
+
+        uint prev_index = curr_index - 1;
+        __global struct block_g *prev = (prev_index == start[level]) ? memory + block_slot(prev_index) * nonces_per_run
+                                                                     : chain_block(memory, level, prev_index - start[level], nonces_per_run);
+        load_block_global(&block, prev, thread);
+        load_block_xor_global(&block, ref, thread);
+        move_block(&tmp, &block);
+        shuffle_block(&block, buf, thread);
+        xor_block(&block, &tmp);
+        store_block_global(chain_block(memory, level, curr_index - start[level], nonces_per_run), &block, thread);
+
+        seed[level] = block_seed(buf, &block, thread);
+        next[level]++;
+    }
+    return chain_block(memory, 0, target - start[0], nonces_per_run);
+}
+#endif
+
+// Nonces skipped by the time-memory tradeoff have no valid last block
+bool nonce_valid(__global struct block_g *memory, uint nonces_per_run)
+{
+#ifdef TMTO_K
+    return memory[TMTO_FLAG_SLOT * nonces_per_run].data[0] != 0;
+#else
+    return true;
+#endif
+}
+
+void fill_memory(__local struct block_g *cache, __global struct block_g *memory, uint thread, uint nonces_per_run REF_PROFILE_PARAM)
+{
     struct block_th tmp, prev, evicted;
 
     load_block_global(&tmp, memory, thread);
@@ -294,38 +544,130 @@ void argon2(__local struct block_g *shmem, __global struct block_g *memory)
     store_block_local(cache + 1, &prev, thread);
 
     uint ref_index = 0;
+#ifdef TMTO_K
+    bool valid = true;
+#endif
 
-    for (uint curr_index = 2; curr_index < MEMORY_COST; curr_index++)
+    // The cache ring is indexed by seq, the position across all passes
+    for (uint pass = 0; pass < PASSES; pass++)
     {
-        uint ref_offset = curr_index - ref_index;
-        if (ref_offset <= CACHE_SIZE)
+        for (uint curr_index = (pass == 0) ? 2 : 0; curr_index < MEMORY_COST; curr_index++)
         {
-            load_block_xor_local(&prev, cache + ref_index % CACHE_SIZE, thread);
-        }
-        else
-        {
-            load_block_xor_global(&prev, memory + ref_index * nonces_per_run, thread);
+            uint seq = pass * MEMORY_COST + curr_index;
+            uint ref_offset = REF_OFFSET(curr_index, ref_index);
+            COUNT_REF(ref_offset);
+            if (ref_offset <= CACHE_SIZE)
+            {
+                load_block_xor_local(&prev, cache + (seq - ref_offset) % CACHE_SIZE, thread);
+            }
+            else
+            {
+#ifdef TMTO_K
+                __global struct block_g *ref = is_stored(ref_index) ? memory + block_slot(ref_index) * nonces_per_run
+                                                                    : recompute_block(cache + CACHE_SIZE, memory, ref_index, thread, nonces_per_run);
+                if (ref == 0)
+                {
+                    valid = false;
+                    break;
+                }
+                load_block_xor_global(&prev, ref, thread);
+#else
+                load_block_xor_global(&prev, memory + ref_index * nonces_per_run, thread);
+#endif
+            }
+
+            __local struct block_g *curr_cache = cache + (seq % CACHE_SIZE);
+
+            load_block_local(&evicted, curr_cache, thread);
+
+            move_block(&tmp, &prev);
+            shuffle_block(&prev, curr_cache, thread);
+            xor_block(&prev, &tmp);
+#if PASSES > 1
+            if (pass > 0)
+            {
+                // Version 0x13 keeps the previous pass' block, it was evicted CACHE_SIZE blocks after it was computed
+                load_block_xor_global(&prev, memory + curr_index * nonces_per_run, thread);
+            }
+#endif
+
+            LOCAL_BARRIER();
+            store_block_local(curr_cache, &prev, thread);
+            LOCAL_BARRIER();
+
+            // next block ref_index
+#if PASSES > 1
+            if (pass > 0 || curr_index == MEMORY_COST - 1)
+            {
+                ref_index = next_pass_ref_index(curr_cache, curr_index);
+            }
+            else
+#endif
+            {
+                ref_index = compute_ref_index(curr_cache, curr_index);
+            }
+
+            if (seq > CACHE_SIZE + 1)
+            {
+                uint evicted_index = (seq - CACHE_SIZE) % MEMORY_COST;
+#ifdef TMTO_K
+                if (is_stored(evicted_index))
+                {
+                    store_block_global(memory + block_slot(evicted_index) * nonces_per_run, &evicted, thread);
+                }
+#else
+                store_block_global(memory + evicted_index * nonces_per_run, &evicted, thread);
+#endif
+            }
         }
+    }
 
-        __local struct block_g *curr_cache = cache + (curr_index % CACHE_SIZE);
+    store_last_block(memory + LAST_BLOCK_SLOT * nonces_per_run, &prev, thread);
+#ifdef TMTO_K
+    if (thread == 0)
+    {
+        memory[TMTO_FLAG_SLOT * nonces_per_run].data[0] = valid;
+    }
+#endif
+}
 
-        load_block_local(&evicted, curr_cache, thread);
+__kernel
+__attribute__((reqd_work_group_size(THREADS_PER_LANE, JOBS_PER_BLOCK, 1)))
+void argon2(__local struct block_g *shmem, __global struct block_g *memory
+#ifdef PROFILE_REFS
+            , __global uint *ref_profile
+#endif
+            )
+{
+    uint job_id = get_global_id(1);
+    uint warp   = get_local_id(1);
+    uint thread = get_local_id(0);
+    uint nonces_per_run = get_global_size(1);
 
-        move_block(&tmp, &prev);
-        shuffle_block(&prev, curr_cache, thread);
-        xor_block(&prev, &tmp);
+    __local struct block_g *cache = &shmem[warp * CACHE_STRIDE];
 
-        store_block_local(curr_cache, &prev, thread);
-        //barrier(CLK_LOCAL_MEM_FENCE);
+#ifdef PROFILE_REFS
+    __local uint ref_counts[REF_PROFILE_SIZE];
+    uint local_id = warp * THREADS_PER_LANE + thread;
+    for (uint i = local_id; i < REF_PROFILE_SIZE; i += THREADS_PER_LANE * JOBS_PER_BLOCK)
+    {
+        ref_counts[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
 
-        ref_index = compute_ref_index(curr_cache, curr_index); // next block ref_index
+    fill_memory(cache, memory + job_id, thread, nonces_per_run REF_PROFILE_ARG);
 
-        if (curr_index > CACHE_SIZE + 1)
+#ifdef PROFILE_REFS
+    // One global atomic per counter and work-group
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint i = local_id; i < REF_PROFILE_SIZE; i += THREADS_PER_LANE * JOBS_PER_BLOCK)
+    {
+        if (ref_counts[i] > 0)
         {
-            store_block_global(memory + (curr_index - CACHE_SIZE) * nonces_per_run, &evicted, thread);
+            atomic_add(&ref_profile[i], ref_counts[i]);
         }
     }
-
-    store_last_block(memory + (MEMORY_COST - 1) * nonces_per_run, &prev, thread);
+#endif
 }
 )===="};
@@ -0,0 +1,15 @@
+/*
+* Streaming copy
+* the global memory bandwidth the Argon2 kernels are compared against, measured on their own buffer
+*/
+
+#include <string>
+
+std::string srcBandwidth{R"====(
+__kernel
+void copy_stream(global ulong4 *memory, uint half)
+{
+  size_t i = get_global_id(0);
+  memory[half + i] = memory[i];
+}
+)===="};
@@ -12,7 +12,17 @@ std::string srcBlake2b{R"====(
 #define BLAKE2B_BLOCK_SIZE 128
 #define BLAKE2B_QWORDS_IN_BLOCK (BLAKE2B_BLOCK_SIZE / 8)
 
+// Layout of the initial seed, the host generates it for the configured parameter set
+#ifndef ARGON2_INITIAL_SEED_SIZE
 #define ARGON2_INITIAL_SEED_SIZE 197
+#endif
+#ifndef NONCE_OFFSET
+#define NONCE_OFFSET 170
+#endif
+#ifndef SEED_BLOCKS
+#define SEED_BLOCKS 2
+#endif
+#define SEED_QWORDS (SEED_BLOCKS * BLAKE2B_QWORDS_IN_BLOCK)
 #define ARGON2_PREHASH_SEED_SIZE 76
 
 #define IV0 0x6a09e667f3bcc908UL
@@ -26,6 +36,73 @@ std::string srcBlake2b{R"====(
 
 #define SWAP64(n) (as_ulong(as_uchar8(n).s76543210))
 
+void blake2b_init(ulong *h, uint hashlen)
+{
+  h[0] = IV0 ^ (0x01010000 | hashlen);
+  h[1] = IV1;
+  h[2] = IV2;
+  h[3] = IV3;
+  h[4] = IV4;
+  h[5] = IV5;
+  h[6] = IV6;
+  h[7] = IV7;
+}
+
+#ifdef BLAKE2B_VECTOR
+// Rows of the state as vectors, the columns and then the diagonals are four G functions each.
+// Rounds are unrolled with the message permutation as literal indices instead of the sigma table.
+#define ROTR4(x, n) rotate(x, (ulong4)(64 - n))
+
+#define G_V(a, b, c, d, m0, m1) \
+  do {                          \
+    a = a + b + m0;             \
+    d = ROTR4(d ^ a, 32);       \
+    c = c + d;                  \
+    b = ROTR4(b ^ c, 24);       \
+    a = a + b + m1;             \
+    d = ROTR4(d ^ a, 16);       \
+    c = c + d;                  \
+    b = ROTR4(b ^ c, 63);       \
+  } while(0)
+
+#define ROUND_V(s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, s12, s13, s14, s15)      \
+  do {                                                                                     \
+    G_V(row1, row2, row3, row4,                                                            \
+        (ulong4)(m[s0], m[s2], m[s4], m[s6]), (ulong4)(m[s1], m[s3], m[s5], m[s7]));       \
+    row2 = row2.s1230;                                                                     \
+    row3 = row3.s2301;                                                                     \
+    row4 = row4.s3012;                                                                     \
+    G_V(row1, row2, row3, row4,                                                            \
+        (ulong4)(m[s8], m[s10], m[s12], m[s14]), (ulong4)(m[s9], m[s11], m[s13], m[s15])); \
+    row2 = row2.s3012;                                                                     \
+    row3 = row3.s2301;                                                                     \
+    row4 = row4.s1230;                                                                     \
+  } while(0)
+
+void blake2b_compress(ulong *h, ulong *m, uint bytes_compressed, bool last_block)
+{
+  ulong4 row1 = vload4(0, h);
+  ulong4 row2 = vload4(1, h);
+  ulong4 row3 = (ulong4)(IV0, IV1, IV2, IV3);
+  ulong4 row4 = (ulong4)(IV4 ^ bytes_compressed, IV5, last_block ? ~IV6 : IV6, IV7);
+
+  ROUND_V(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  ROUND_V(14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3);
+  ROUND_V(11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4);
+  ROUND_V(7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8);
+  ROUND_V(9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13);
+  ROUND_V(2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9);
+  ROUND_V(12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11);
+  ROUND_V(13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10);
+  ROUND_V(6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5);
+  ROUND_V(10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0);
+  ROUND_V(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  ROUND_V(14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3);
+
+  vstore4(vload4(0, h) ^ row1 ^ row3, 0, h);
+  vstore4(vload4(1, h) ^ row2 ^ row4, 1, h);
+}
+#else
 constant uint sigma[12][16] = {
   {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
   {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
@@ -41,18 +118,6 @@ constant uint sigma[12][16] = {
   {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
 };
 
-void blake2b_init(ulong *h, uint hashlen)
-{
-  h[0] = IV0 ^ (0x01010000 | hashlen);
-  h[1] = IV1;
-  h[2] = IV2;
-  h[3] = IV3;
-  h[4] = IV4;
-  h[5] = IV5;
-  h[6] = IV6;
-  h[7] = IV7;
-}
-
 #define G(i, a, b, c, d)                \
   do {                                  \
     a = a + b + m[sigma[r][2 * i]];     \
@@ -113,27 +178,35 @@ void blake2b_compress(ulong *h, ulong *m, uint bytes_compressed, bool last_block
   h[6] = h[6] ^ v[6] ^ v[14];
   h[7] = h[7] ^ v[7] ^ v[15];
 }
+#endif
 
 void set_nonce(ulong *inseed, uint nonce)
 {
-  // bytes 170-173
+  // big endian, bytes NONCE_OFFSET to NONCE_OFFSET+3
   ulong n = as_uint(as_uchar4(nonce).s3210);
-  inseed[21] = inseed[21] | (n << 16);
+  inseed[NONCE_OFFSET / 8] = inseed[NONCE_OFFSET / 8] | (n << (8 * (NONCE_OFFSET % 8)));
+#if NONCE_OFFSET % 8 > 4
+  inseed[NONCE_OFFSET / 8 + 1] = inseed[NONCE_OFFSET / 8 + 1] | (n >> (64 - 8 * (NONCE_OFFSET % 8)));
+#endif
 }
 
 void initial_hash(ulong *hash, global ulong *inseed, uint nonce)
 {
-  ulong is[32];
+  ulong is[SEED_QWORDS];
 #pragma unroll
-  for (uint i = 0; i < 32; i++)
+  for (uint i = 0; i < SEED_QWORDS; i++)
   {
     is[i] = inseed[i];
   }
   set_nonce(is, nonce);
 
   blake2b_init(hash, BLAKE2B_HASH_LENGTH);
-  blake2b_compress(hash, &is[0], BLAKE2B_BLOCK_SIZE, false);
-  blake2b_compress(hash, &is[BLAKE2B_QWORDS_IN_BLOCK], ARGON2_INITIAL_SEED_SIZE, true);
+#pragma unroll
+  for (uint i = 0; i < SEED_BLOCKS - 1; i++)
+  {
+    blake2b_compress(hash, &is[i * BLAKE2B_QWORDS_IN_BLOCK], (i + 1) * BLAKE2B_BLOCK_SIZE, false);
+  }
+  blake2b_compress(hash, &is[(SEED_BLOCKS - 1) * BLAKE2B_QWORDS_IN_BLOCK], ARGON2_INITIAL_SEED_SIZE, true);
 }
 
 void fill_first_block(global struct block_g *memory, global ulong *inseed, uint nonce, uint block)
@@ -279,23 +352,79 @@ void init_memory(global struct block_g *memory, global ulong *inseed, uint start
 
 __kernel
 __attribute__((reqd_work_group_size(256, 1, 1)))
-void get_nonce(global struct block_g *memory, uint start_nonce, uint share_compact, global uint *nonce_found)
+void get_nonce(global struct block_g *memory, uint start_nonce, uint share_compact, uint block_compact, global uint *nonce_found,
+               uint sample_count, uint sample_offset, global ulong *samples)
 {
   uint job_id = get_global_id(0);
   uint nonce = start_nonce + job_id;
   uint nonces_per_run = get_global_size(0);
 
-  ulong hash[8];
+  ulong hash[8] = {0};
   ulong target[4];
 
-  memory += job_id + nonces_per_run * (MEMORY_COST - 1);
+  // Every interval-th hash goes to the host for verification on the CPU, zeros if skipped
+  uint sample_interval = (sample_count > 0) ? nonces_per_run / sample_count : 0;
+  bool sampled = (sample_interval > 0) && (job_id % sample_interval == sample_offset) && (job_id / sample_interval < sample_count);
 
-  compact_to_target(share_compact, target);
-  hash_last_block(memory, hash);
+  memory += job_id;
+  bool valid = nonce_valid(memory, nonces_per_run);
+  if (valid)
+  {
+    hash_last_block(memory + nonces_per_run * LAST_BLOCK_SLOT, hash);
+  }
+  if (sampled)
+  {
+    samples += (job_id / sample_interval) * (ARGON2_HASH_LENGTH / 8);
+    #pragma unroll
+    for (uint i = 0; i < ARGON2_HASH_LENGTH / 8; i++)
+    {
+      samples[i] = hash[i];
+    }
+  }
+  if (!valid)
+  {
+    atomic_inc(&nonce_found[1]); // skipped
+    return;
+  }
+
+  // Block solutions have their own slot, so that a share of the same batch can't hide them
+  if (block_compact != 0)
+  {
+    compact_to_target(block_compact, target);
+    if (is_proof_of_work(hash, target))
+    {
+      atomic_cmpxchg(&nonce_found[2], 0, nonce);
+      return;
+    }
+  }
 
+  compact_to_target(share_compact, target);
   if (is_proof_of_work(hash, target))
   {
     atomic_cmpxchg(nonce_found, 0, nonce);
   }
 }
+
+__kernel
+__attribute__((reqd_work_group_size(256, 1, 1)))
+void get_hashes(global struct block_g *memory, global ulong *hashes)
+{
+  uint job_id = get_global_id(0);
+  uint nonces_per_run = get_global_size(0);
+
+  ulong hash[8] = {0};
+
+  memory += job_id;
+  if (nonce_valid(memory, nonces_per_run))
+  {
+    hash_last_block(memory + nonces_per_run * LAST_BLOCK_SLOT, hash);
+  }
+
+  hashes += job_id * (ARGON2_HASH_LENGTH / 8);
+  #pragma unroll
+  for (uint i = 0; i < ARGON2_HASH_LENGTH / 8; i++)
+  {
+    hashes[i] = hash[i];
+  }
+}
 )===="};
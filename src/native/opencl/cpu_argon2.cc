@@ -0,0 +1,379 @@
+#include "cpu_argon2.h"
+
+#include <cstring>
+
+#define ARGON2_VERSION 0x13
+#define ARGON2_SYNC_POINTS 4
+#define ARGON2_BLOCK_SIZE 1024
+#define ARGON2_QWORDS_IN_BLOCK (ARGON2_BLOCK_SIZE / 8)
+#define ARGON2_PREHASH_DIGEST_LENGTH 64
+#define ARGON2_PREHASH_SEED_LENGTH (ARGON2_PREHASH_DIGEST_LENGTH + 8)
+
+#define BLAKE2B_BLOCK_SIZE 128
+#define BLAKE2B_OUT_LENGTH 64
+
+/*
+* Blake2b
+*/
+
+static const uint64_t blake2bIV[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL};
+
+static const uint8_t blake2bSigma[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}};
+
+struct Blake2bState
+{
+  uint64_t h[8];
+  uint64_t t;
+  uint8_t buffer[BLAKE2B_BLOCK_SIZE];
+  size_t bufferLength;
+  size_t outLength;
+};
+
+static inline uint64_t Rotr64(uint64_t x, uint32_t n)
+{
+  return (x >> n) | (x << (64 - n));
+}
+
+static inline uint64_t Load64(const uint8_t *src)
+{
+  uint64_t value;
+  memcpy(&value, src, sizeof(value)); // little endian hosts only
+  return value;
+}
+
+static inline void Store32(uint8_t *dst, uint32_t value)
+{
+  memcpy(dst, &value, sizeof(value));
+}
+
+static void Blake2bCompress(Blake2bState *state, const uint8_t *block, bool last)
+{
+  uint64_t m[16];
+  uint64_t v[16];
+  for (int i = 0; i < 16; i++)
+  {
+    m[i] = Load64(block + i * 8);
+  }
+  for (int i = 0; i < 8; i++)
+  {
+    v[i] = state->h[i];
+    v[i + 8] = blake2bIV[i];
+  }
+  v[12] ^= state->t;
+  if (last)
+  {
+    v[14] = ~v[14];
+  }
+
+#define G(r, i, a, b, c, d)                        \
+  a = a + b + m[blake2bSigma[r][2 * i]];           \
+  d = Rotr64(d ^ a, 32);                           \
+  c = c + d;                                       \
+  b = Rotr64(b ^ c, 24);                           \
+  a = a + b + m[blake2bSigma[r][2 * i + 1]];       \
+  d = Rotr64(d ^ a, 16);                           \
+  c = c + d;                                       \
+  b = Rotr64(b ^ c, 63);
+
+  for (int r = 0; r < 12; r++)
+  {
+    G(r, 0, v[0], v[4], v[8], v[12]);
+    G(r, 1, v[1], v[5], v[9], v[13]);
+    G(r, 2, v[2], v[6], v[10], v[14]);
+    G(r, 3, v[3], v[7], v[11], v[15]);
+    G(r, 4, v[0], v[5], v[10], v[15]);
+    G(r, 5, v[1], v[6], v[11], v[12]);
+    G(r, 6, v[2], v[7], v[8], v[13]);
+    G(r, 7, v[3], v[4], v[9], v[14]);
+  }
+#undef G
+
+  for (int i = 0; i < 8; i++)
+  {
+    state->h[i] ^= v[i] ^ v[i + 8];
+  }
+}
+
+static void Blake2bInit(Blake2bState *state, size_t outLength)
+{
+  memcpy(state->h, blake2bIV, sizeof(state->h));
+  state->h[0] ^= 0x01010000 ^ outLength; // no key, fanout and depth 1
+  state->t = 0;
+  state->bufferLength = 0;
+  state->outLength = outLength;
+}
+
+static void Blake2bUpdate(Blake2bState *state, const void *data, size_t length)
+{
+  const uint8_t *in = (const uint8_t *)data;
+  while (length > 0)
+  {
+    // The last block is only compressed in Blake2bFinal
+    if (state->bufferLength == BLAKE2B_BLOCK_SIZE)
+    {
+      state->t += BLAKE2B_BLOCK_SIZE;
+      Blake2bCompress(state, state->buffer, false);
+      state->bufferLength = 0;
+    }
+    size_t chunk = BLAKE2B_BLOCK_SIZE - state->bufferLength;
+    if (chunk > length)
+    {
+      chunk = length;
+    }
+    memcpy(state->buffer + state->bufferLength, in, chunk);
+    state->bufferLength += chunk;
+    in += chunk;
+    length -= chunk;
+  }
+}
+
+static void Blake2bFinal(Blake2bState *state, uint8_t *out)
+{
+  state->t += state->bufferLength;
+  memset(state->buffer + state->bufferLength, 0, BLAKE2B_BLOCK_SIZE - state->bufferLength);
+  Blake2bCompress(state, state->buffer, true);
+  memcpy(out, state->h, state->outLength);
+}
+
+static void Blake2bUpdate32(Blake2bState *state, uint32_t value)
+{
+  uint8_t bytes[4];
+  Store32(bytes, value);
+  Blake2bUpdate(state, bytes, sizeof(bytes));
+}
+
+// H' of the Argon2 spec, variable-length hash built from Blake2b
+static void Blake2bLong(uint8_t *out, size_t outLength, const uint8_t *in, size_t inLength)
+{
+  Blake2bState state;
+  if (outLength <= BLAKE2B_OUT_LENGTH)
+  {
+    Blake2bInit(&state, outLength);
+    Blake2bUpdate32(&state, outLength);
+    Blake2bUpdate(&state, in, inLength);
+    Blake2bFinal(&state, out);
+    return;
+  }
+
+  uint8_t v[BLAKE2B_OUT_LENGTH];
+  Blake2bInit(&state, BLAKE2B_OUT_LENGTH);
+  Blake2bUpdate32(&state, outLength);
+  Blake2bUpdate(&state, in, inLength);
+  Blake2bFinal(&state, v);
+  memcpy(out, v, BLAKE2B_OUT_LENGTH / 2);
+  out += BLAKE2B_OUT_LENGTH / 2;
+  size_t remaining = outLength - BLAKE2B_OUT_LENGTH / 2;
+
+  while (remaining > BLAKE2B_OUT_LENGTH)
+  {
+    Blake2bInit(&state, BLAKE2B_OUT_LENGTH);
+    Blake2bUpdate(&state, v, BLAKE2B_OUT_LENGTH);
+    Blake2bFinal(&state, v);
+    memcpy(out, v, BLAKE2B_OUT_LENGTH / 2);
+    out += BLAKE2B_OUT_LENGTH / 2;
+    remaining -= BLAKE2B_OUT_LENGTH / 2;
+  }
+
+  Blake2bInit(&state, remaining);
+  Blake2bUpdate(&state, v, BLAKE2B_OUT_LENGTH);
+  Blake2bFinal(&state, out);
+}
+
+/*
+* Argon2d
+*/
+
+static inline uint64_t FBlaMka(uint64_t x, uint64_t y)
+{
+  return x + y + 2 * (x & 0xFFFFFFFF) * (y & 0xFFFFFFFF);
+}
+
+#define GB(a, b, c, d)       \
+  a = FBlaMka(a, b);         \
+  d = Rotr64(d ^ a, 32);     \
+  c = FBlaMka(c, d);         \
+  b = Rotr64(b ^ c, 24);     \
+  a = FBlaMka(a, b);         \
+  d = Rotr64(d ^ a, 16);     \
+  c = FBlaMka(c, d);         \
+  b = Rotr64(b ^ c, 63);
+
+#define BLAKE2_ROUND(v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14, v15) \
+  GB(v0, v4, v8, v12);                                                                       \
+  GB(v1, v5, v9, v13);                                                                       \
+  GB(v2, v6, v10, v14);                                                                      \
+  GB(v3, v7, v11, v15);                                                                      \
+  GB(v0, v5, v10, v15);                                                                      \
+  GB(v1, v6, v11, v12);                                                                      \
+  GB(v2, v7, v8, v13);                                                                       \
+  GB(v3, v4, v9, v14);
+
+// next = G(prev, ref), xor'ed into next instead of overwriting it when withXor (passes after the first)
+static void FillBlock(const uint64_t *prev, const uint64_t *ref, uint64_t *next, bool withXor)
+{
+  uint64_t r[ARGON2_QWORDS_IN_BLOCK];
+  uint64_t tmp[ARGON2_QWORDS_IN_BLOCK];
+  for (int i = 0; i < ARGON2_QWORDS_IN_BLOCK; i++)
+  {
+    r[i] = prev[i] ^ ref[i];
+    tmp[i] = withXor ? r[i] ^ next[i] : r[i];
+  }
+
+  for (int i = 0; i < 8; i++)
+  {
+    uint64_t *v = r + 16 * i;
+    BLAKE2_ROUND(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11], v[12], v[13], v[14], v[15]);
+  }
+  for (int i = 0; i < 8; i++)
+  {
+    uint64_t *v = r + 2 * i;
+    BLAKE2_ROUND(v[0], v[1], v[16], v[17], v[32], v[33], v[48], v[49], v[64], v[65], v[80], v[81], v[96], v[97], v[112], v[113]);
+  }
+
+  for (int i = 0; i < ARGON2_QWORDS_IN_BLOCK; i++)
+  {
+    next[i] = tmp[i] ^ r[i];
+  }
+}
+
+#undef BLAKE2_ROUND
+#undef GB
+
+CpuArgon2d::CpuArgon2d(uint32_t memoryCost, uint32_t passes, uint32_t lanes)
+    : passes(passes), lanes(lanes)
+{
+  // Rounded down to a multiple of 4 blocks per lane, at least 8 per lane
+  uint32_t minCost = 2 * ARGON2_SYNC_POINTS * lanes;
+  this->memoryCost = (memoryCost < minCost) ? minCost : memoryCost;
+  segmentLength = this->memoryCost / (lanes * ARGON2_SYNC_POINTS);
+  this->memoryCost = segmentLength * lanes * ARGON2_SYNC_POINTS;
+  laneLength = segmentLength * ARGON2_SYNC_POINTS;
+  memory.resize((size_t)this->memoryCost * ARGON2_QWORDS_IN_BLOCK);
+}
+
+void CpuArgon2d::FillSegment(uint32_t pass, uint32_t lane, uint32_t slice)
+{
+  uint32_t startIndex = (pass == 0 && slice == 0) ? 2 : 0;
+  uint32_t currOffset = lane * laneLength + slice * segmentLength + startIndex;
+  uint32_t prevOffset = (currOffset % laneLength == 0) ? currOffset + laneLength - 1 : currOffset - 1;
+
+  for (uint32_t index = startIndex; index < segmentLength; index++, currOffset++, prevOffset++)
+  {
+    if (currOffset % laneLength == 1)
+    {
+      prevOffset = currOffset - 1;
+    }
+
+    uint64_t *prev = &memory[(size_t)prevOffset * ARGON2_QWORDS_IN_BLOCK];
+    uint64_t pseudoRand = prev[0];
+    uint32_t refLane = (uint32_t)((pseudoRand >> 32) % lanes);
+    if (pass == 0 && slice == 0)
+    {
+      refLane = lane;
+    }
+    bool sameLane = (refLane == lane);
+
+    // Blocks that can be referenced, see index_alpha of the reference implementation
+    uint32_t areaSize;
+    if (pass == 0)
+    {
+      if (slice == 0)
+      {
+        areaSize = index - 1;
+      }
+      else
+      {
+        areaSize = sameLane ? slice * segmentLength + index - 1 : slice * segmentLength - (index == 0 ? 1 : 0);
+      }
+    }
+    else
+    {
+      areaSize = sameLane ? laneLength - segmentLength + index - 1 : laneLength - segmentLength - (index == 0 ? 1 : 0);
+    }
+    uint64_t relative = pseudoRand & 0xFFFFFFFF;
+    relative = (relative * relative) >> 32;
+    relative = areaSize - 1 - ((areaSize * relative) >> 32);
+    uint32_t startPosition = (pass != 0 && slice != ARGON2_SYNC_POINTS - 1) ? (slice + 1) * segmentLength : 0;
+    uint32_t refIndex = (uint32_t)((startPosition + relative) % laneLength);
+
+    uint64_t *ref = &memory[((size_t)refLane * laneLength + refIndex) * ARGON2_QWORDS_IN_BLOCK];
+    uint64_t *curr = &memory[(size_t)currOffset * ARGON2_QWORDS_IN_BLOCK];
+    FillBlock(prev, ref, curr, pass != 0);
+  }
+}
+
+void CpuArgon2d::Hash(uint8_t *out, size_t outLength,
+                      const uint8_t *pwd, size_t pwdLength, const uint8_t *salt, size_t saltLength,
+                      const uint8_t *secret, size_t secretLength, const uint8_t *ad, size_t adLength)
+{
+  // H0
+  uint8_t seed[ARGON2_PREHASH_SEED_LENGTH];
+  Blake2bState state;
+  Blake2bInit(&state, ARGON2_PREHASH_DIGEST_LENGTH);
+  Blake2bUpdate32(&state, lanes);
+  Blake2bUpdate32(&state, outLength);
+  Blake2bUpdate32(&state, memoryCost);
+  Blake2bUpdate32(&state, passes);
+  Blake2bUpdate32(&state, ARGON2_VERSION);
+  Blake2bUpdate32(&state, 0); // Argon2d
+  Blake2bUpdate32(&state, pwdLength);
+  Blake2bUpdate(&state, pwd, pwdLength);
+  Blake2bUpdate32(&state, saltLength);
+  Blake2bUpdate(&state, salt, saltLength);
+  Blake2bUpdate32(&state, secretLength);
+  Blake2bUpdate(&state, secret, secretLength);
+  Blake2bUpdate32(&state, adLength);
+  Blake2bUpdate(&state, ad, adLength);
+  Blake2bFinal(&state, seed);
+
+  // First two blocks of every lane
+  for (uint32_t lane = 0; lane < lanes; lane++)
+  {
+    for (uint32_t block = 0; block < 2; block++)
+    {
+      Store32(seed + ARGON2_PREHASH_DIGEST_LENGTH, block);
+      Store32(seed + ARGON2_PREHASH_DIGEST_LENGTH + 4, lane);
+      uint8_t bytes[ARGON2_BLOCK_SIZE];
+      Blake2bLong(bytes, ARGON2_BLOCK_SIZE, seed, ARGON2_PREHASH_SEED_LENGTH);
+      memcpy(&memory[((size_t)lane * laneLength + block) * ARGON2_QWORDS_IN_BLOCK], bytes, ARGON2_BLOCK_SIZE);
+    }
+  }
+
+  for (uint32_t pass = 0; pass < passes; pass++)
+  {
+    for (uint32_t slice = 0; slice < ARGON2_SYNC_POINTS; slice++)
+    {
+      for (uint32_t lane = 0; lane < lanes; lane++)
+      {
+        FillSegment(pass, lane, slice);
+      }
+    }
+  }
+
+  // Last blocks of all lanes
+  uint64_t finalBlock[ARGON2_QWORDS_IN_BLOCK];
+  memcpy(finalBlock, &memory[(size_t)(laneLength - 1) * ARGON2_QWORDS_IN_BLOCK], ARGON2_BLOCK_SIZE);
+  for (uint32_t lane = 1; lane < lanes; lane++)
+  {
+    const uint64_t *last = &memory[((size_t)lane * laneLength + laneLength - 1) * ARGON2_QWORDS_IN_BLOCK];
+    for (int i = 0; i < ARGON2_QWORDS_IN_BLOCK; i++)
+    {
+      finalBlock[i] ^= last[i];
+    }
+  }
+  Blake2bLong(out, outLength, (const uint8_t *)finalBlock, ARGON2_BLOCK_SIZE);
+}
@@ -0,0 +1,33 @@
+#ifndef CPU_ARGON2_H_
+#define CPU_ARGON2_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/*
+* Argon2d (version 0x13) on the CPU
+* a plain port of the reference implementation, used to check GPU results in the background
+*/
+class CpuArgon2d
+{
+public:
+  CpuArgon2d(uint32_t memoryCost, uint32_t passes, uint32_t lanes);
+
+  void Hash(uint8_t *out, size_t outLength,
+            const uint8_t *pwd, size_t pwdLength, const uint8_t *salt, size_t saltLength,
+            const uint8_t *secret = nullptr, size_t secretLength = 0, const uint8_t *ad = nullptr, size_t adLength = 0);
+
+private:
+  void FillSegment(uint32_t pass, uint32_t lane, uint32_t slice);
+
+  uint32_t memoryCost;
+  uint32_t passes;
+  uint32_t lanes;
+  uint32_t laneLength;
+  uint32_t segmentLength;
+  std::vector<uint64_t> memory; // kept between hashes
+};
+
+#endif /* CPU_ARGON2_H_ */
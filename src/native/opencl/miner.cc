@@ -3,33 +3,345 @@
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "argon2d.hpp"
 #include "blake2b.hpp"
+#include "persistent.hpp"
+#include "bandwidth.hpp"
 #include "miner.h"
+#include "cpu_argon2.h"
 
 #define VENDOR_AMD "Advanced Micro Devices"
 #define VENDOR_NVIDIA "NVIDIA Corporation"
 
+#define WARMUP_SHARE_COMPACT 0x03000001 // target of 1, never met
+
+#define PERSISTENT_CHUNK_RUNS 8     // batches per persistent kernel launch
+#define PERSISTENT_POLL_INTERVAL 5 // ms
+
+#define TUNER_TRIAL_INTERVAL 10  // one batch out of N runs the variant on trial
+#define TUNER_MAX_TRIAL_INTERVAL 160
+#define TUNER_TRIAL_BATCHES 5    // batches measured before a decision
+#define TUNER_MARGIN 0.02        // required speedup to switch
+#define TUNER_HISTORY_SIZE 100
+
+#define WATCHDOG_INTERVAL 1000       // ms between health checks
+#define WATCHDOG_TIMEOUT_FACTOR 5    // a batch is hung after N times its average duration
+#define WATCHDOG_MIN_TIMEOUT 10      // s
+#define WATCHDOG_INITIAL_TIMEOUT 60  // s, until the average batch duration is known
+#define WATCHDOG_FREE_TIMEOUT 5000   // ms to wait for the threads of a failed device
+#define RECOVERY_HISTORY_SIZE 20
+
+#define TRACE_MAX_EVENTS 1000000 // later events of a trace window are dropped
+#define TRACE_PID_MINER 1000     // trace process of block switches, devices use their index
+#define TRACE_TID_QUEUE 100      // trace thread of a MinerThread's command queue, added to its index
+#define TRACE_TID_JS 1000        // trace thread of result delivery into JS
+
+#define VERIFY_THREADS 2          // CPU threads recomputing sampled hashes
+#define VERIFY_QUEUE_SIZE 4096    // samples waiting for a CPU thread, more are dropped
+
+#define NONCE_SLICE_SIZE (1 << 22) // nonces, unit of stride and offset of a nonce range
+#define LEASE_WAIT_INTERVAL 20     // ms a thread sleeps while its job has no leased nonces left
+
+#define COVERAGE_MAX_HEADERS 64    // headers whose searched nonces are remembered, least recently mined go first
+#define COVERAGE_MAX_INTERVALS 256 // per header, the smallest intervals are forgotten first
+
+#define COPY_RUNS 5         // copy_stream launches timed for the bandwidth report
+#define COPY_VECTOR_SIZE 32 // bytes copied per copy_stream work-item
+
 const cl_uint zero = 0;
+const cl_uint zeroNonce[3] = {0, 0, 0}; // share nonce, nonces skipped by the time-memory tradeoff, block nonce
+const persistent_control zeroControl = {};
+
+struct MinerResult
+{
+  uint32_t nonce;
+  uint32_t shareCompact; // share compact the batch was computed for
+  uint32_t hashes;       // nonces completed since the previous result
+  bool block;            // nonce meets the block target of the header, not only the share target
+  int64_t found;         // Tracer::Now() when the host read the nonce
+  int64_t sent;          // Tracer::Now() when handed to the progress queue
+};
+
+typedef Nan::AsyncBareProgressQueueWorker<MinerResult>::ExecutionProgress MinerProgress;
+
+// Nonces of a job: [start, end) cut into slices of NONCE_SLICE_SIZE, of which every stride-th one
+// starting at offset is mined. Instances sharing a header and address mine disjoint slices.
+struct NonceRange
+{
+  uint64_t start = 0;
+  uint64_t end = UINT32_MAX;
+  uint32_t stride = 1;
+  uint32_t offset = 0;
+};
 
-typedef Nan::AsyncBareProgressQueueWorker<uint32_t>::ExecutionProgress MinerProgress;
+// Nonces leased from a coordinator shared with other miner processes, handed out from next on
+struct NonceLease
+{
+  uint32_t workId;
+  uint64_t start;
+  uint64_t end;
+  uint64_t next;
+};
+
+// Argon2d parameter set the kernels are specialized for, Nimiq's by default
+struct Argon2Params
+{
+  uint32_t memoryCost = NIMIQ_ARGON2_COST; // blocks
+  uint32_t passes = 1;
+  uint32_t lanes = 1;
+  std::string salt = NIMIQ_ARGON2_SALT;
+  uint32_t headerLength = NIMIQ_HEADER_LENGTH; // password, including the nonce
+
+  std::string Validate() const; // error message, empty if valid
+  uint32_t GetSeedSize() const;
+  uint32_t GetSeedBlocks() const; // BLAKE2b blocks of the initial seed
+  uint32_t GetNonceOffset() const;
+  std::vector<uint8_t> GetInitialSeed(const work_header *header) const;
+  std::string GetBuildOptions() const;
+  uint32_t GetTrafficBlocks(uint32_t cache) const; // global block transfers of the argon2 kernel per nonce, without ref misses
+  double GetExpectedRefMisses(uint32_t cache) const; // per nonce
+};
 
 class Device;
 class MinerThread;
 
+class ProgramCache
+{
+public:
+  cl::Program Build(const cl::Context &context, const cl::Device &device, const std::string &buildOptions, bool *cacheHit);
+
+private:
+  typedef std::vector<unsigned char> Binary;
+
+  static cl::Program BuildFromSource(const cl::Context &context, const cl::Device &device, const std::string &buildOptions);
+  static Binary GetBinary(const cl::Program &program);
+
+  std::mutex mutex;
+  std::map<std::string, std::shared_future<Binary>> binaries;
+};
+
+// Records Trace Event Format (chrome://tracing, Perfetto) events between Start and Stop
+class Tracer
+{
+public:
+  Tracer();
+
+  static int64_t Now(); // uv_hrtime ns, the clock of process.hrtime() in JS
+
+  void Start();
+  std::string Stop(const std::map<uint32_t, std::string> &processNames);
+  bool IsActive();
+
+  void Span(const char *name, const char *category, uint32_t pid, uint32_t tid, int64_t start, int64_t end, const std::string &args = "");
+  void Instant(const char *name, const char *category, uint32_t pid, uint32_t tid, int64_t time, const std::string &args = "");
+
+private:
+  struct Event
+  {
+    const char *name;
+    const char *category;
+    char phase;
+    uint32_t pid;
+    uint32_t tid;
+    int64_t time;
+    int64_t duration;
+    std::string args; // JSON object members
+  };
+
+  void Add(const Event &event);
+  static std::string ThreadName(uint32_t pid, uint32_t tid);
+  static std::string JsonString(const std::string &value);
+
+  std::mutex mutex;
+  std::atomic_bool active;
+  int64_t origin = 0;
+  std::vector<Event> events;
+  uint64_t dropped = 0;
+};
+
+// Recomputes sampled GPU hashes with the CPU Argon2d in the background, mismatches are counted per device
+class Verifier
+{
+public:
+  struct Sample
+  {
+    Device *device;
+    uint32_t nonce;
+    uint8_t hash[ARGON2_HASH_LENGTH];
+  };
+
+  Verifier(const Argon2Params &argon2Params);
+  ~Verifier();
+
+  // Returns the number of samples dropped because the CPU threads fell behind
+  uint32_t Submit(const work_header &header, const std::vector<Sample> &samples);
+  void Stop();
+
+private:
+  struct Job
+  {
+    std::shared_ptr<work_header> header; // shared by the samples of a batch
+    Sample sample;
+  };
+
+  void Run();
+
+  Argon2Params argon2Params;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Job> queue;
+  std::vector<std::thread> threads; // started with the first sample
+  bool stopped = false;
+};
+
+// Nonce intervals completed per header, a job for a header that comes back skips them
+class NonceCoverage
+{
+public:
+  typedef std::map<uint64_t, uint64_t> Intervals; // start -> end, disjoint and not adjacent
+
+  static bool Contains(const Intervals &intervals, uint64_t start, uint64_t end);
+
+  std::shared_ptr<const Intervals> Resume(uint64_t headerHash); // nullptr for a new header
+  void Add(uint64_t headerHash, uint64_t start, uint64_t end);
+  void ReportAvoided(uint64_t nonces);
+  void FillStats(v8::Local<v8::Object> stats);
+
+private:
+  struct Entry
+  {
+    Intervals intervals;
+    std::list<uint64_t>::iterator recent;
+  };
+
+  Entry &Touch(uint64_t headerHash);
+
+  std::mutex mutex;
+  std::map<uint64_t, Entry> headers;
+  std::list<uint64_t> recent; // header hashes, most recently mined first
+  uint64_t resumedJobs = 0;
+  uint64_t evictedHeaders = 0;
+  uint64_t forgottenNonces = 0; // in intervals dropped to stay within COVERAGE_MAX_INTERVALS
+  std::atomic<uint64_t> avoidedNonces{0};
+};
+
+struct KernelVariant
+{
+  uint32_t cache;
+  uint32_t jobs;
+  cl::Program program;
+  double hashrate; // moving average of a single thread, H/s
+};
+
+// Accumulated ref_profile counters of a thread
+struct RefProfileTotals
+{
+  uint64_t localHits = 0;
+  uint64_t globalMisses = 0;
+  uint64_t offsets[REF_PROFILE_OFFSETS + 1] = {};
+  uint64_t nonces = 0;
+  double argon2Time = 0; // s, from queue profiling
+};
+
+// Wall time of each kernel of a computeHashes batch, run one after another
+struct KernelTimes
+{
+  double initMemory = 0; // ms
+  double argon2 = 0;     // ms
+  double getHashes = 0;  // ms
+};
+
+// Bytes the kernels of a batch move according to their access pattern, against a streaming copy
+struct BandwidthReport
+{
+  uint32_t noncesPerRun = 0;
+  double copyBytes = 0;
+  double copyTime = 0; // ms
+  KernelTimes times;
+  double initMemoryBytes = 0;
+  double argon2Bytes = 0;
+  double getHashesBytes = 0;
+  double refMisses = 0; // per nonce
+  bool refMissesMeasured = false; // from a profile build, estimated otherwise
+};
+
+struct RecoveryEvent
+{
+  double time;     // ms since epoch
+  double duration; // ms
+  bool success;
+  std::string reason;
+  std::string error;
+};
+
+struct TunerDecision
+{
+  double time; // ms since epoch
+  uint32_t fromCache, fromJobs, toCache, toJobs;
+  double fromHashrate, toHashrate;
+};
+
+// Builds alternative argon2 kernels in the background and tries them on a few batches while mining
+class Tuner
+{
+public:
+  typedef std::function<cl::Program(uint32_t cache, uint32_t jobs)> BuildFunction;
+
+  Tuner(uint32_t cache, uint32_t jobs, cl::Program program);
+  ~Tuner();
+
+  void Start(const std::vector<std::pair<uint32_t, uint32_t>> &candidates, BuildFunction build);
+  void Stop(); // waits for the variant being built, the ones built stay usable
+  size_t SelectVariant();
+  void Report(size_t variant, double hashrate);
+  KernelVariant GetVariant(size_t variant);
+  void FillStats(v8::Local<v8::Object> stats);
+
+private:
+  std::mutex mutex;
+  std::thread builder;
+  std::atomic_bool stopped;
+
+  std::vector<KernelVariant> variants;
+  std::vector<TunerDecision> history;
+  size_t best = 0;
+  size_t candidate = 0; // last variant put on trial
+  bool onTrial = false;
+  uint32_t trialBatches = 0;
+  double trialHashrate = 0;
+  uint32_t trialsWithoutImprovement = 0;
+  uint32_t trialInterval = TUNER_TRIAL_INTERVAL;
+  uint64_t batches = 0;
+};
+
 class Miner : public Nan::ObjectWrap
 {
 public:
-  explicit Miner();
+  Miner(bool allDevices, bool tracing, const Argon2Params &argon2Params);
   ~Miner();
 
   static NAN_MODULE_INIT(Init);
@@ -39,22 +351,83 @@ public:
   static NAN_METHOD(SetShareCompact);
   static NAN_METHOD(StartMiningOnBlock);
   static NAN_METHOD(Stop);
-  // TODO static NAN_METHOD(FreeDevices);
+  static NAN_METHOD(GetStats);
+  static NAN_METHOD(ComputeHashes);
+  static NAN_METHOD(MeasureBandwidth);
+  static NAN_METHOD(FreeDevices);
+  static NAN_METHOD(ReconfigureDevice);
+  static NAN_METHOD(StartTrace);
+  static NAN_METHOD(StopTrace);
+  static NAN_METHOD(AddNonceLease);
+  static NAN_METHOD(GetNonceLeases);
+  static NAN_METHOD(StopLeasing);
+
+  static uint64_t HashBlockHeader(const work_header *blockHeader);
+  static uint32_t GetBlockCompact(const work_header *blockHeader);
+  static double CompactToTarget(uint32_t compact);
+
+  void JoinCurrentJob(Device *device);
+  void StartWatchdog();
 
   uint32_t GetShareCompact();
   bool IsMiningEnabled();
-  uint64_t GetNextStartNonce(uint32_t noncesPerRun);
+  bool GetNextStartNonce(uint32_t count, uint32_t *startNonce); // false once the nonce range or the leases are used up
+  void ReportCoverage(uint32_t workId, uint64_t headerHash, uint32_t startNonce, uint32_t count);
+  bool IsWaitingForLeases();
   uint32_t GetWorkId();
+  bool IsResultValid(uint32_t workId, const MinerResult &result);
+  void ReportStaleResult();
+  void ReportBlock(bool stale);
+  ProgramCache &GetProgramCache();
+  Tracer *GetTracer(); // nullptr unless created with tracing enabled
+  const Argon2Params &GetArgon2Params();
+  Verifier &GetVerifier();
 
 private:
   static Nan::Persistent<v8::Function> constructor;
 
+  static void HandleRecoveries(uv_async_t *handle);
+  static bool ReadNonceRange(v8::Local<v8::Object> range, NonceRange *nonceRange); // false if invalid
+  void RunWatchdog();
+  void CloseLeases();
+
   std::vector<Device *> devices;
   bool devicesInitialized = false;
   std::atomic_uint_fast32_t shareCompact;
   std::atomic_bool miningEnabled;
   std::atomic_uint_fast32_t workId;
-  std::atomic_uint_fast64_t startNonce;
+  std::atomic_uint_fast64_t nextNonce; // nonces handed out in the current job, before mapping to the range
+  std::shared_ptr<const NonceRange> nonceRange = std::make_shared<const NonceRange>(); // replaced on the main thread while threads read it
+  NonceCoverage coverage;
+  std::shared_ptr<const NonceCoverage::Intervals> jobCovered; // searched before the current job started, nullptr if none
+
+  // Leased jobs take their nonces from leases instead of nonceRange, used up leases are reported back
+  std::atomic_bool leased;
+  std::mutex leaseMutex;
+  std::deque<NonceLease> leases;
+  std::vector<NonceLease> closedLeases;
+  uint32_t leaseBatch = 0; // largest batch taken from leases, shorter leases are of no use
+  std::atomic_uint_fast64_t staleResults;
+  std::atomic_uint_fast64_t blocksFound;
+  std::atomic_uint_fast64_t staleBlocks;
+  ProgramCache programCache;
+  bool tracing;
+  Tracer tracer;
+  Argon2Params argon2Params;
+  Verifier verifier;
+
+  // Current job, for devices that become ready after it was started
+  Nan::Callback jobCallback;
+  work_header jobHeader;
+  uint64_t jobHeaderHash = 0;
+
+  // Watchdog, failed devices are recovered on the main thread with the initializeDevices callback
+  Nan::Callback deviceCallback;
+  std::thread watchdog;
+  std::atomic_bool watchdogStopped;
+  uv_async_t *recoveryAsync = nullptr;
+  std::mutex recoveryMutex;
+  std::vector<Device *> pendingRecoveries;
 };
 
 class Device
@@ -67,83 +440,276 @@ public:
   static NAN_SETTER(HandleSetters);
 
   bool IsEnabled();
+  bool IsReady();
+  void SetReady(bool ready);
   uint32_t GetDeviceIndex();
+  std::string GetName();
+  double GetBuildTime();
+  bool IsBuildCacheHit();
 
   void Initialize();
-  void StartMiningOnBlock(const v8::Local<v8::Function> &cbFunc, uint32_t workId, nimiq_block_header *blockHeader);
-  void MineNonces(uint32_t workId, uint32_t threadIndex, nimiq_block_header *blockHeader, const MinerProgress &progress);
+  void Free(bool keepBuffers, bool force);
+  void StartMiningOnBlock(const v8::Local<v8::Function> &cbFunc, uint32_t workId, uint64_t headerHash, work_header *blockHeader);
+  void MineNonces(uint32_t generation, uint32_t threadIndex, uint32_t workId, work_header *blockHeader, const MinerProgress &progress);
+  uint32_t ComputeHashes(work_header *blockHeader, uint32_t startNonce, std::vector<uint8_t> &hashes, KernelTimes &times);
+  void MeasureBandwidth(BandwidthReport &report);
+  void FillStats(v8::Local<v8::Object> stats);
+
+  void ReportVerification(bool valid);
+  void ReportDroppedSamples(uint32_t count);
+
+  bool CheckHealth(std::string *reason);
+  bool BeginRecovery(const std::string &reason);
+  void EndRecovery(bool success, double duration, const std::string &error);
 
 private:
+  std::string GetBuildOptions(uint32_t cache, uint32_t jobsPerBlock);
+  cl::Buffer AcquireBuffer(size_t size, bool *reused);
+  MinerThread *AcquireThread(uint32_t generation, uint32_t threadIndex);
+  void ReleaseThread(MinerThread *minerThread);
+  void ReportError(uint32_t generation, const std::string &error);
+
   Miner *miner;
   cl::Device device;
   uint32_t deviceIndex;
   bool isAMD;
+  bool isGPU;
 
   bool enabled = true;
+  std::atomic_bool ready;
   uint32_t memory = 0; // auto
   uint32_t threads = 2;
   uint32_t cache = 2;
   uint32_t jobs = 2;
+  uint32_t threadsPerLane = THREADS_PER_LANE; // work-items per hash
+  bool persistent = false;
+  bool vectorBlake2b = false; // ulong4 BLAKE2b in init_memory and the final hash
+
+  bool tune = false;
+  bool profile = false;
+  uint32_t tmto = 0; // store every k-th Argon2 block only, 0 = off
+  uint32_t verify = 0; // hashes per batch recomputed on the CPU, 0 = off
+
+  // Verification results since the last Initialize
+  std::atomic<uint64_t> verifiedSamples;
+  std::atomic<uint64_t> invalidSamples;
+  std::atomic<uint64_t> droppedSamples;
+
+  double buildTime = 0; // ms
+  bool buildCacheHit = false;
+
+  std::shared_ptr<Tuner> tuner; // shared with the threads, abandoned ones may still use it
 
+  // Serializes Initialize and Free, both run on worker threads
+  std::mutex lifecycleMutex;
+
+  // MinerThreads are only used between AcquireThread and ReleaseThread, Free waits for them
+  std::mutex threadsMutex;
+  std::condition_variable threadsIdle;
   std::vector<MinerThread *> minerThreads;
+  std::map<MinerThread *, uint32_t> threadUsers;
+  std::vector<MinerThread *> abandonedThreads; // stuck in a failed device, deleted by their last user
+  uint32_t generation = 0;
+  bool failed = false;
+  std::string lastError;
+
+  std::atomic_bool recovering;
+  std::string recoveryReason;
+  std::vector<RecoveryEvent> recoveryHistory;
+  uint32_t recoveries = 0;
+
+  // Argon2 buffers of freed threads, reused by the next Initialize
+  std::vector<cl::Buffer> bufferPool;
 
   cl::Context context;
   cl::Program program;
+  std::string programOptions;
 };
 
 class MinerThread
 {
 public:
   MinerThread(Miner *miner, uint32_t threadIndex, uint32_t noncesPerRun,
-              cl::CommandQueue queue, cl::Buffer memInitialSeed, cl::Buffer memArgon2, cl::Buffer memNonce,
-              cl::Kernel kernelInitMemory, cl::Kernel kernelArgon2, cl::Kernel kernelGetNonce,
+              cl::CommandQueue queue, cl::Buffer memInitialSeed, cl::Buffer memArgon2, cl::Buffer memNonce, cl::Buffer memHashes,
+              cl::Kernel kernelInitMemory, cl::Kernel kernelArgon2, cl::Kernel kernelGetNonce, cl::Kernel kernelGetHashes,
               cl::NDRange globalInitMemory, cl::NDRange localInitMemory,
               cl::NDRange globalArgon2, cl::NDRange localArgon2,
               cl::NDRange globalGetNonce, cl::NDRange localGetNonce);
+  ~MinerThread();
 
   uint32_t GetThreadIndex();
   uint32_t GetNoncesPerRun();
+  cl::Buffer GetArgon2Buffer();
+  void Stop();
+  double GetBatchRunningTime();
+  double GetAverageBatchTime();
+  uint64_t GetSkippedNonces();
+
+  void EnablePersistentMode(cl::Kernel kernelPersistent, cl::Buffer memControl, cl::Buffer memNextJob);
+  void SetTuner(std::shared_ptr<Tuner> tuner);
+  void EnableRefProfile(cl::Buffer memRefProfile);
+  void EnableTracing(Tracer *tracer, uint32_t pid);
+  void EnableVerification(Device *device, cl::Buffer memSamples, uint32_t samples, bool tmto);
+  void AddRefProfile(RefProfileTotals &totals);
 
-  void MineNonces(uint32_t workId, nimiq_block_header *blockHeader, const MinerProgress &progress);
+  void WarmUp();
+  void MineNonces(uint32_t workId, work_header *blockHeader, const MinerProgress &progress);
+  void ComputeHashes(work_header *blockHeader, uint32_t startNonce, std::vector<uint8_t> &hashes, KernelTimes &times);
+  void MeasureCopyBandwidth(const cl::Program &program, double *bytes, double *time);
 
 private:
-  void SetBlockHeader(nimiq_block_header *blockHeader);
-  uint32_t MineNonces(uint32_t startNonce, uint32_t shareCompact);
+  void SetBlockHeader(work_header *blockHeader);
+  uint32_t MineNonces(uint32_t startNonce, uint32_t shareCompact, uint32_t blockCompact, uint32_t *skipped, bool *block, uint32_t *share, int64_t *readTime);
+  void MineNoncesPersistent(uint32_t workId, uint64_t headerHash, uint32_t blockCompact, const MinerProgress &progress);
+  void SelectArgon2Variant(size_t variant);
+  void BeginBatch();
+  void EndBatch(bool measured);
+  void CollectRefProfile(const cl::Event &argon2Event);
+
+  struct TracedCommand
+  {
+    const char *name;
+    const char *category;
+    cl::Event event;
+  };
+  bool IsTracing();
+  void TraceCommands(const std::vector<TracedCommand> &commands, int64_t hostEnd);
 
   Miner *miner;
   uint32_t threadIndex;
   uint32_t noncesPerRun;
 
   std::mutex mutex;
+  std::atomic_bool stopped;
+  std::atomic<int64_t> batchStart;    // steady_clock ns, 0 while idle
+  std::atomic<double> averageBatchTime; // s
+  std::atomic<uint64_t> skippedNonces;
   cl::CommandQueue queue;
   cl::Buffer memInitialSeed;
   cl::Buffer memArgon2;
   cl::Buffer memNonce;
+  cl::Buffer memHashes;
   cl::Kernel kernelInitMemory;
   cl::Kernel kernelArgon2;
   cl::Kernel kernelGetNonce;
+  cl::Kernel kernelGetHashes;
   cl::NDRange globalInitMemory;
   cl::NDRange localInitMemory;
   cl::NDRange globalArgon2;
   cl::NDRange localArgon2;
   cl::NDRange globalGetNonce;
   cl::NDRange localGetNonce;
+
+  // Persistent mode
+  cl::Kernel kernelPersistent;
+  cl::Buffer memControl;
+  cl::Buffer memNextJob;
+  volatile persistent_control *control = nullptr;
+
+  // Online tuning, kernels are created per thread since they hold this thread's buffers
+  std::shared_ptr<Tuner> tuner;
+  std::vector<cl::Kernel> variantKernels;
+  std::vector<cl::NDRange> variantLocalArgon2;
+
+  // Reference locality profiling, -DPROFILE_REFS builds only
+  cl::Buffer memRefProfile;
+  bool refProfiling = false;
+  std::mutex refProfileMutex;
+  RefProfileTotals refProfile;
+
+  // Timeline tracing, the queue is profiled so that commands can be traced
+  Tracer *tracer = nullptr;
+  uint32_t tracePid = 0;
+
+  // Sampled hashes for the Verifier, get_nonce writes them
+  Device *device = nullptr;
+  cl::Buffer memSamples;
+  uint32_t samples = 0;
+  bool sampleSkips = false; // the time-memory tradeoff leaves the hashes of nonces it gave up on zero
+  std::vector<uint8_t> sampleHashes;
+  std::mt19937 sampleRandom;
+  work_header header; // of the current job
 };
 
-class MinerWorker : public Nan::AsyncProgressQueueWorker<uint32_t>
+class MinerWorker : public Nan::AsyncProgressQueueWorker<MinerResult>
 {
 public:
-  MinerWorker(Nan::Callback *callback, Device *device, MinerThread *minerThread, uint32_t workId, nimiq_block_header blockHeader);
+  MinerWorker(Nan::Callback *callback, Miner *miner, Device *device, uint32_t generation, uint32_t threadIndex, uint32_t noncesPerRun,
+              uint32_t workId, uint64_t headerHash, work_header blockHeader);
 
   void Execute(const MinerProgress &progress);
-  void HandleProgressCallback(const uint32_t *data, size_t count);
+  void HandleProgressCallback(const MinerResult *result, size_t count);
   void HandleOKCallback();
+  void HandleErrorCallback();
 
 private:
+  v8::Local<v8::Object> NewResultObject(bool done);
+
+  Miner *miner;
   Device *device;
-  MinerThread *minerThread;
+  // The MinerThread itself may be freed while results are still queued
+  uint32_t generation;
+  uint32_t threadIndex;
+  uint32_t noncesPerRun;
   uint32_t workId;
-  nimiq_block_header blockHeader;
+  uint64_t headerHash;
+  work_header blockHeader;
+};
+
+class HashWorker : public Nan::AsyncWorker
+{
+public:
+  HashWorker(Nan::Callback *callback, Device *device, work_header blockHeader, uint32_t startNonce);
+
+  void Execute();
+  void HandleOKCallback();
+
+private:
+  Device *device;
+  work_header blockHeader;
+  uint32_t startNonce;
+  uint32_t noncesPerRun = 0;
+  std::vector<uint8_t> hashes;
+  KernelTimes times;
+};
+
+class BandwidthWorker : public Nan::AsyncWorker
+{
+public:
+  BandwidthWorker(Nan::Callback *callback, Device *device);
+
+  void Execute();
+  void HandleOKCallback();
+
+private:
+  static v8::Local<v8::Object> Entry(double bytes, double time);
+
+  Device *device;
+  BandwidthReport report;
+};
+
+class DeviceWorker : public Nan::AsyncWorker
+{
+public:
+  enum Action
+  {
+    INITIALIZE,
+    RECONFIGURE,
+    RECOVER,
+    FREE
+  };
+
+  DeviceWorker(Nan::Callback *callback, Miner *miner, Device *device, Action action);
+
+  void Execute();
+  void HandleOKCallback();
+  void HandleErrorCallback();
+
+private:
+  Miner *miner;
+  Device *device;
+  Action action;
+  double time = 0; // ms
 };
 
 /*
@@ -152,7 +718,9 @@ private:
 
 Nan::Persistent<v8::Function> Miner::constructor;
 
-Miner::Miner()
+Miner::Miner(bool allDevices, bool tracing, const Argon2Params &argon2Params)
+    : shareCompact(0), miningEnabled(false), workId(0), nextNonce(0), leased(false), staleResults(0), blocksFound(0), staleBlocks(0), tracing(tracing), argon2Params(argon2Params),
+      verifier(argon2Params), watchdogStopped(false)
 {
   try
   {
@@ -171,7 +739,7 @@ Miner::Miner()
       bool isAMD = (platformVendor.find(VENDOR_AMD) == 0);
       bool isNvidia = (platformVendor.find(VENDOR_NVIDIA) == 0);
 
-      if (!isAMD && !isNvidia)
+      if (!isAMD && !isNvidia && !allDevices)
       {
         continue;
       }
@@ -179,7 +747,7 @@ Miner::Miner()
       try
       {
         std::vector<cl::Device> platformDevices;
-        platform.getDevices(CL_DEVICE_TYPE_GPU, &platformDevices);
+        platform.getDevices(allDevices ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_GPU, &platformDevices);
         for (auto const &platformDevice : platformDevices)
         {
           devices.push_back(new Device(this, platformDevice, deviceIndex++));
@@ -210,6 +778,14 @@ Miner::Miner()
 
 Miner::~Miner()
 {
+  verifier.Stop(); // reports to the devices
+  if (watchdog.joinable())
+  {
+    watchdogStopped = true;
+    watchdog.join();
+    uv_close((uv_handle_t *)recoveryAsync, [](uv_handle_t *handle) { delete (uv_async_t *)handle; });
+  }
+
   for (size_t i = 0; i < devices.size(); i++)
   {
     delete devices[i];
@@ -226,105 +802,399 @@ bool Miner::IsMiningEnabled()
   return miningEnabled;
 }
 
-uint64_t Miner::GetNextStartNonce(uint32_t noncesPerRun)
+bool Miner::GetNextStartNonce(uint32_t count, uint32_t *startNonce)
 {
-  return startNonce.fetch_add(noncesPerRun);
+  if (leased)
+  {
+    std::lock_guard<std::mutex> lock(leaseMutex);
+    leaseBatch = std::max(leaseBatch, count);
+    while (!leases.empty())
+    {
+      NonceLease &lease = leases.front();
+      if (lease.next + count <= lease.end)
+      {
+        *startNonce = (uint32_t)lease.next;
+        lease.next += count;
+        return true;
+      }
+      // The rest of the lease is too short for a batch, the coordinator leases it out again
+      closedLeases.push_back(lease);
+      leases.pop_front();
+    }
+    return false;
+  }
+  std::shared_ptr<const NonceRange> range = std::atomic_load(&nonceRange);
+  if (range->stride > 1 && count > NONCE_SLICE_SIZE)
+  {
+    return false;
+  }
+  std::shared_ptr<const NonceCoverage::Intervals> covered = std::atomic_load(&jobCovered);
+  while (true)
+  {
+    // A batch can't cross into the next slice when it belongs to another instance
+    uint_fast64_t next = nextNonce;
+    uint_fast64_t claimed;
+    do
+    {
+      claimed = next;
+      if (range->stride > 1 && claimed % NONCE_SLICE_SIZE + count > NONCE_SLICE_SIZE)
+      {
+        claimed += NONCE_SLICE_SIZE - claimed % NONCE_SLICE_SIZE;
+      }
+    } while (!nextNonce.compare_exchange_weak(next, claimed + count));
+
+    uint64_t slice = claimed / NONCE_SLICE_SIZE * range->stride + range->offset;
+    uint64_t start = range->start + slice * NONCE_SLICE_SIZE + claimed % NONCE_SLICE_SIZE;
+    if (start + count > range->end)
+    {
+      return false;
+    }
+    // Searched by an earlier job for the same header, partly searched batches are mined again
+    if (covered && NonceCoverage::Contains(*covered, start, start + count))
+    {
+      coverage.ReportAvoided(count);
+      continue;
+    }
+    *startNonce = (uint32_t)start;
+    return true;
+  }
 }
 
-uint32_t Miner::GetWorkId()
+// Batches of the current job are remembered once completed, leased or not
+void Miner::ReportCoverage(uint32_t workId, uint64_t headerHash, uint32_t startNonce, uint32_t count)
 {
-  return workId;
+  if (workId == this->workId)
+  {
+    coverage.Add(headerHash, startNonce, (uint64_t)startNonce + count);
+  }
 }
 
-NAN_MODULE_INIT(Miner::Init)
+bool Miner::IsWaitingForLeases()
 {
-  v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
-  tpl->SetClassName(Nan::New("Miner").ToLocalChecked());
-  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  return leased && miningEnabled;
+}
 
-  Nan::SetPrototypeMethod(tpl, "getDevices", GetDevices);
-  Nan::SetPrototypeMethod(tpl, "initializeDevices", InitializeDevices);
-  Nan::SetPrototypeMethod(tpl, "setShareCompact", SetShareCompact);
-  Nan::SetPrototypeMethod(tpl, "startMiningOnBlock", StartMiningOnBlock);
-  Nan::SetPrototypeMethod(tpl, "stop", Stop);
+// Ends the leases of the previous job, nonces from next on were not mined
+void Miner::CloseLeases()
+{
+  std::lock_guard<std::mutex> lock(leaseMutex);
+  closedLeases.insert(closedLeases.end(), leases.begin(), leases.end());
+  leases.clear();
+}
 
-  constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
-  Nan::Set(target, Nan::New("Miner").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+uint32_t Miner::GetWorkId()
+{
+  return workId;
 }
 
-NAN_METHOD(Miner::New)
+uint64_t Miner::HashBlockHeader(const work_header *blockHeader)
 {
-  if (!info.IsConstructCall())
+  // FNV-1a over the header without the nonce, only used to tell jobs apart
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < blockHeader->length - NONCE_LENGTH; i++)
   {
-    return Nan::ThrowError(Nan::New("Miner() must be called with new keyword.").ToLocalChecked());
+    hash ^= blockHeader->data[i];
+    hash *= 0x100000001b3ULL;
   }
+  return hash;
+}
 
-  try
-  {
-    Miner *miner = new Miner();
-    miner->Wrap(info.This());
-    info.GetReturnValue().Set(info.This());
-  }
-  catch (std::exception &e)
+uint32_t Miner::GetBlockCompact(const work_header *blockHeader)
+{
+  // Only Nimiq headers carry nbits, other work has no block target to check
+  if (blockHeader->length != NIMIQ_HEADER_LENGTH)
   {
-    return Nan::ThrowError(Nan::New(e.what()).ToLocalChecked());
+    return 0;
   }
+  const uint8_t *nbits = blockHeader->data + NIMIQ_NBITS_OFFSET;
+  return ((uint32_t)nbits[0] << 24) | ((uint32_t)nbits[1] << 16) | ((uint32_t)nbits[2] << 8) | nbits[3];
 }
 
-NAN_METHOD(Miner::GetDevices)
+double Miner::CompactToTarget(uint32_t compact)
 {
-  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
-  v8::Local<v8::Array> devices = Nan::New<v8::Array>(miner->devices.size());
+  return std::ldexp((double)(compact & 0xFFFFFF), 8 * ((int)(compact >> 24) - 3));
+}
 
-  for (size_t deviceIndex = 0; deviceIndex < miner->devices.size(); deviceIndex++)
+bool Miner::IsResultValid(uint32_t resultWorkId, const MinerResult &result)
+{
+  if (resultWorkId != workId)
   {
-    v8::Local<v8::Object> device = Nan::New<v8::Object>();
-    Nan::SetPrivate(device, Nan::New("device").ToLocalChecked(), v8::External::New(info.GetIsolate(), miner->devices[deviceIndex]));
-    Nan::SetAccessor(device, Nan::New("name").ToLocalChecked(), Device::HandleGetters);
-    Nan::SetAccessor(device, Nan::New("vendor").ToLocalChecked(), Device::HandleGetters);
-    Nan::SetAccessor(device, Nan::New("driverVersion").ToLocalChecked(), Device::HandleGetters);
-    Nan::SetAccessor(device, Nan::New("maxComputeUnits").ToLocalChecked(), Device::HandleGetters);
-    Nan::SetAccessor(device, Nan::New("maxClockFrequency").ToLocalChecked(), Device::HandleGetters);
-    Nan::SetAccessor(device, Nan::New("maxMemAllocSize").ToLocalChecked(), Device::HandleGetters);
-    Nan::SetAccessor(device, Nan::New("globalMemSize").ToLocalChecked(), Device::HandleGetters);
-    Nan::SetAccessor(device, Nan::New("enabled").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
-    Nan::SetAccessor(device, Nan::New("memory").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
-    Nan::SetAccessor(device, Nan::New("threads").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
-    Nan::SetAccessor(device, Nan::New("cache").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
-    Nan::SetAccessor(device, Nan::New("jobs").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
-    devices->Set(deviceIndex, device);
+    return false;
   }
-  info.GetReturnValue().Set(devices);
+  // Share target got harder while the batch was running, block solutions are still good
+  uint32_t currentShareCompact = shareCompact;
+  if (!result.block && result.shareCompact != currentShareCompact && CompactToTarget(result.shareCompact) > CompactToTarget(currentShareCompact))
+  {
+    return false;
+  }
+  return true;
 }
 
-NAN_METHOD(Miner::InitializeDevices)
+void Miner::ReportStaleResult()
 {
-  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+  staleResults++;
+}
 
-  if (miner->devicesInitialized)
+void Miner::ReportBlock(bool stale)
+{
+  blocksFound++;
+  if (stale)
   {
-    return Nan::ThrowError(Nan::New("Devices already initialized.").ToLocalChecked());
+    staleBlocks++;
   }
+}
 
-  try
-  {
-    for (auto device : miner->devices)
-    {
-      if (device->IsEnabled())
-      {
-        device->Initialize();
-      }
-    }
-
-    miner->devicesInitialized = true;
-  }
-  catch (cl::Error &error)
-  {
-    return Nan::ThrowError(Nan::New("Failed to initialize devices: " + std::string(error.what())).ToLocalChecked());
-  }
+ProgramCache &Miner::GetProgramCache()
+{
+  return programCache;
 }
 
-NAN_METHOD(Miner::SetShareCompact)
+Tracer *Miner::GetTracer()
+{
+  return tracing ? &tracer : nullptr;
+}
+
+const Argon2Params &Miner::GetArgon2Params()
+{
+  return argon2Params;
+}
+
+Verifier &Miner::GetVerifier()
+{
+  return verifier;
+}
+
+void Miner::JoinCurrentJob(Device *device)
+{
+  if (!miningEnabled || jobCallback.IsEmpty())
+  {
+    return;
+  }
+  Nan::HandleScope scope;
+  device->StartMiningOnBlock(jobCallback.GetFunction(), workId, jobHeaderHash, &jobHeader);
+}
+
+void Miner::StartWatchdog()
+{
+  if (watchdog.joinable())
+  {
+    return;
+  }
+
+  recoveryAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), recoveryAsync, HandleRecoveries);
+  recoveryAsync->data = this;
+  uv_unref((uv_handle_t *)recoveryAsync); // doesn't keep the process alive
+
+  watchdog = std::thread(&Miner::RunWatchdog, this);
+}
+
+void Miner::RunWatchdog()
+{
+  while (!watchdogStopped)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(WATCHDOG_INTERVAL));
+
+    bool pending = false;
+    for (auto device : devices)
+    {
+      std::string reason;
+      if (device->IsReady() && device->CheckHealth(&reason) && device->BeginRecovery(reason))
+      {
+        std::lock_guard<std::mutex> lock(recoveryMutex);
+        pendingRecoveries.push_back(device);
+        pending = true;
+      }
+    }
+    if (pending)
+    {
+      uv_async_send(recoveryAsync);
+    }
+  }
+}
+
+void Miner::HandleRecoveries(uv_async_t *handle)
+{
+  Nan::HandleScope scope;
+
+  Miner *miner = (Miner *)handle->data;
+  std::vector<Device *> devices;
+  {
+    std::lock_guard<std::mutex> lock(miner->recoveryMutex);
+    devices.swap(miner->pendingRecoveries);
+  }
+
+  // Isolate the failed devices, the others keep mining
+  for (auto device : devices)
+  {
+    device->SetReady(false);
+    Nan::AsyncQueueWorker(new DeviceWorker(new Nan::Callback(miner->deviceCallback.GetFunction()), miner, device, DeviceWorker::RECOVER));
+  }
+}
+
+NAN_MODULE_INIT(Miner::Init)
+{
+  v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+  tpl->SetClassName(Nan::New("Miner").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  Nan::SetPrototypeMethod(tpl, "getDevices", GetDevices);
+  Nan::SetPrototypeMethod(tpl, "initializeDevices", InitializeDevices);
+  Nan::SetPrototypeMethod(tpl, "setShareCompact", SetShareCompact);
+  Nan::SetPrototypeMethod(tpl, "startMiningOnBlock", StartMiningOnBlock);
+  Nan::SetPrototypeMethod(tpl, "stop", Stop);
+  Nan::SetPrototypeMethod(tpl, "getStats", GetStats);
+  Nan::SetPrototypeMethod(tpl, "computeHashes", ComputeHashes);
+  Nan::SetPrototypeMethod(tpl, "measureBandwidth", MeasureBandwidth);
+  Nan::SetPrototypeMethod(tpl, "freeDevices", FreeDevices);
+  Nan::SetPrototypeMethod(tpl, "reconfigureDevice", ReconfigureDevice);
+  Nan::SetPrototypeMethod(tpl, "startTrace", StartTrace);
+  Nan::SetPrototypeMethod(tpl, "stopTrace", StopTrace);
+  Nan::SetPrototypeMethod(tpl, "addNonceLease", AddNonceLease);
+  Nan::SetPrototypeMethod(tpl, "getNonceLeases", GetNonceLeases);
+  Nan::SetPrototypeMethod(tpl, "stopLeasing", StopLeasing);
+
+  constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
+  Nan::Set(target, Nan::New("Miner").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+NAN_METHOD(Miner::New)
+{
+  if (!info.IsConstructCall())
+  {
+    return Nan::ThrowError(Nan::New("Miner() must be called with new keyword.").ToLocalChecked());
+  }
+
+  // CPU devices and other vendors (e.g. POCL) are only used for testing
+  bool allDevices = false;
+  // Command queues are created with profiling enabled, so that kernels show up in traces
+  bool tracing = false;
+  if (info[0]->IsObject())
+  {
+    v8::Local<v8::Value> value = Nan::Get(info[0].As<v8::Object>(), Nan::New("allDevices").ToLocalChecked()).ToLocalChecked();
+    allDevices = value->IsBoolean() && Nan::To<bool>(value).FromJust();
+    value = Nan::Get(info[0].As<v8::Object>(), Nan::New("trace").ToLocalChecked()).ToLocalChecked();
+    tracing = value->IsBoolean() && Nan::To<bool>(value).FromJust();
+  }
+
+  // Other Argon2d parameter sets than Nimiq's, e.g. for testing
+  Argon2Params argon2Params;
+  v8::Local<v8::Value> argon2 = info[0]->IsObject() ? Nan::Get(info[0].As<v8::Object>(), Nan::New("argon2").ToLocalChecked()).ToLocalChecked()
+                                                    : v8::Local<v8::Value>(Nan::Undefined());
+  if (argon2->IsObject())
+  {
+    v8::Local<v8::Object> options = argon2.As<v8::Object>();
+    std::vector<std::pair<const char *, uint32_t *>> numbers = {
+        {"memoryCost", &argon2Params.memoryCost},
+        {"passes", &argon2Params.passes},
+        {"lanes", &argon2Params.lanes},
+        {"headerLength", &argon2Params.headerLength}};
+    for (auto const &number : numbers)
+    {
+      v8::Local<v8::Value> value = Nan::Get(options, Nan::New(number.first).ToLocalChecked()).ToLocalChecked();
+      if (value->IsUndefined())
+      {
+        continue;
+      }
+      if (!value->IsUint32())
+      {
+        return Nan::ThrowError(Nan::New("Argon2 " + std::string(number.first) + " must be an integer.").ToLocalChecked());
+      }
+      *number.second = Nan::To<uint32_t>(value).FromJust();
+    }
+    v8::Local<v8::Value> salt = Nan::Get(options, Nan::New("salt").ToLocalChecked()).ToLocalChecked();
+    if (salt->IsString())
+    {
+      argon2Params.salt = *Nan::Utf8String(salt);
+    }
+    else if (!salt->IsUndefined())
+    {
+      return Nan::ThrowError(Nan::New("Argon2 salt must be a string.").ToLocalChecked());
+    }
+  }
+  std::string argon2Error = argon2Params.Validate();
+  if (!argon2Error.empty())
+  {
+    return Nan::ThrowError(Nan::New(argon2Error).ToLocalChecked());
+  }
+
+  try
+  {
+    Miner *miner = new Miner(allDevices, tracing, argon2Params);
+    miner->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  }
+  catch (std::exception &e)
+  {
+    return Nan::ThrowError(Nan::New(e.what()).ToLocalChecked());
+  }
+}
+
+NAN_METHOD(Miner::GetDevices)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+  v8::Local<v8::Array> devices = Nan::New<v8::Array>(miner->devices.size());
+
+  for (size_t deviceIndex = 0; deviceIndex < miner->devices.size(); deviceIndex++)
+  {
+    v8::Local<v8::Object> device = Nan::New<v8::Object>();
+    Nan::SetPrivate(device, Nan::New("device").ToLocalChecked(), v8::External::New(info.GetIsolate(), miner->devices[deviceIndex]));
+    Nan::SetAccessor(device, Nan::New("name").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("vendor").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("driverVersion").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("maxComputeUnits").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("maxClockFrequency").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("maxMemAllocSize").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("globalMemSize").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("enabled").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("memory").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("threads").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("cache").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("jobs").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("threadsPerLane").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("persistent").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("vectorBlake2b").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("tune").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("profile").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("tmto").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("verify").ToLocalChecked(), Device::HandleGetters, Device::HandleSetters);
+    Nan::SetAccessor(device, Nan::New("buildTime").ToLocalChecked(), Device::HandleGetters);
+    Nan::SetAccessor(device, Nan::New("buildCacheHit").ToLocalChecked(), Device::HandleGetters);
+    devices->Set(deviceIndex, device);
+  }
+  info.GetReturnValue().Set(devices);
+}
+
+NAN_METHOD(Miner::InitializeDevices)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+
+  if (miner->devicesInitialized)
+  {
+    return Nan::ThrowError(Nan::New("Devices already initialized.").ToLocalChecked());
+  }
+
+  if (!info[0]->IsFunction())
+  {
+    return Nan::ThrowError(Nan::New("Callback required.").ToLocalChecked());
+  }
+  v8::Local<v8::Function> cbFunc = info[0].As<v8::Function>();
+  miner->deviceCallback.Reset(cbFunc);
+  miner->StartWatchdog();
+
+  // Devices are independent, each one reports back and joins the current job as soon as it's ready
+  for (auto device : miner->devices)
+  {
+    if (device->IsEnabled())
+    {
+      Nan::AsyncQueueWorker(new DeviceWorker(new Nan::Callback(cbFunc), miner, device, DeviceWorker::INITIALIZE));
+    }
+  }
+
+  miner->devicesInitialized = true;
+}
+
+NAN_METHOD(Miner::SetShareCompact)
 {
   if (!info[0]->IsUint32())
   {
@@ -343,12 +1213,15 @@ NAN_METHOD(Miner::StartMiningOnBlock)
   {
     return Nan::ThrowError(Nan::New("Block header required.").ToLocalChecked());
   }
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
   v8::Local<v8::Uint8Array> blockHeader = info[0].As<v8::Uint8Array>();
-  if (blockHeader->Length() != sizeof(nimiq_block_header))
+  if (blockHeader->Length() != miner->argon2Params.headerLength)
   {
     return Nan::ThrowError(Nan::New("Invalid block header size.").ToLocalChecked());
   }
-  nimiq_block_header *header = (nimiq_block_header *)blockHeader->Buffer()->GetContents().Data();
+  work_header header;
+  header.length = blockHeader->Length();
+  memcpy(header.data, (uint8_t *)blockHeader->Buffer()->GetContents().Data() + blockHeader->ByteOffset(), header.length);
 
   if (!info[1]->IsFunction())
   {
@@ -356,7 +1229,6 @@ NAN_METHOD(Miner::StartMiningOnBlock)
   }
   v8::Local<v8::Function> cbFunc = info[1].As<v8::Function>();
 
-  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
   if (!miner->devicesInitialized)
   {
     return Nan::ThrowError(Nan::New("Devices are not initialized.").ToLocalChecked());
@@ -367,16 +1239,51 @@ NAN_METHOD(Miner::StartMiningOnBlock)
     return Nan::ThrowError(Nan::New("Share compact is not set.").ToLocalChecked());
   }
 
+  // Optional { start, end, stride, offset }, e.g. assigned by the pool or one rig out of several,
+  // or { leased: true } to mine only what is passed to addNonceLease for the returned work id
+  NonceRange nonceRange;
+  bool leased = false;
+  if (info[2]->IsObject())
+  {
+    v8::Local<v8::Object> range = info[2].As<v8::Object>();
+    v8::Local<v8::Value> value = Nan::Get(range, Nan::New("leased").ToLocalChecked()).ToLocalChecked();
+    leased = Nan::To<bool>(value).FromJust();
+    if (!ReadNonceRange(range, &nonceRange))
+    {
+      return Nan::ThrowError(Nan::New("Invalid nonce range.").ToLocalChecked());
+    }
+  }
+
+  miner->CloseLeases();
   miner->miningEnabled = true;
+  std::atomic_store(&miner->nonceRange, std::make_shared<const NonceRange>(nonceRange));
+  miner->leased = leased;
   uint32_t workId = ++miner->workId;
-  miner->startNonce = 0;
+  uint64_t headerHash = HashBlockHeader(&header);
+  miner->nextNonce = 0;
+  std::atomic_store(&miner->jobCovered, leased ? nullptr : miner->coverage.Resume(headerHash));
+
+  miner->jobCallback.Reset(cbFunc);
+  miner->jobHeader = header;
+  miner->jobHeaderHash = headerHash;
+
+  if (miner->tracer.IsActive())
+  {
+    char args[64];
+    snprintf(args, sizeof(args), "\"workId\": %u, \"headerHash\": \"%016llx\"", workId, (unsigned long long)headerHash);
+    miner->tracer.Instant("block", "miner", TRACE_PID_MINER, 0, Tracer::Now(), args);
+  }
 
   int enabledDevices = 0;
   for (auto device : miner->devices)
   {
     if (device->IsEnabled())
     {
-      device->StartMiningOnBlock(cbFunc, workId, header);
+      // Devices still initializing pick the job up in JoinCurrentJob
+      if (device->IsReady())
+      {
+        device->StartMiningOnBlock(cbFunc, workId, headerHash, &header);
+      }
       enabledDevices++;
     }
   }
@@ -385,366 +1292,2752 @@ NAN_METHOD(Miner::StartMiningOnBlock)
   {
     return Nan::ThrowError(Nan::New("Can't start mining - all devices are disabled.").ToLocalChecked());
   }
+
+  info.GetReturnValue().Set(workId);
+}
+
+bool Miner::ReadNonceRange(v8::Local<v8::Object> range, NonceRange *nonceRange)
+{
+  // Fields left out keep their default, anything but an unsigned 32 bit integer makes the range invalid
+  auto read = [range](const char *name, uint32_t *field) {
+    v8::Local<v8::Value> value = Nan::Get(range, Nan::New(name).ToLocalChecked()).ToLocalChecked();
+    if (value->IsUndefined())
+    {
+      return true;
+    }
+    if (!value->IsUint32())
+    {
+      return false;
+    }
+    *field = Nan::To<uint32_t>(value).FromJust();
+    return true;
+  };
+  uint32_t start = (uint32_t)nonceRange->start;
+  uint32_t end = (uint32_t)nonceRange->end;
+  if (!read("start", &start) || !read("end", &end) || !read("stride", &nonceRange->stride) || !read("offset", &nonceRange->offset))
+  {
+    return false;
+  }
+  nonceRange->start = start;
+  nonceRange->end = end;
+  return nonceRange->end > nonceRange->start && nonceRange->stride > 0 && nonceRange->offset < nonceRange->stride;
 }
 
 NAN_METHOD(Miner::Stop)
 {
   Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
   miner->miningEnabled = false;
+  miner->workId++; // anything still in flight belongs to stopped work
+  miner->CloseLeases();
 }
 
-/*
-* Device
-*/
-
-Device::Device(Miner *miner, const cl::Device &device, uint32_t deviceIndex) : miner(miner), device(device), deviceIndex(deviceIndex)
+NAN_METHOD(Miner::GetStats)
 {
-  std::string deviceVendor = device.getInfo<CL_DEVICE_VENDOR>();
-  isAMD = (deviceVendor.find(VENDOR_AMD) == 0);
-}
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
 
-Device::~Device()
-{
-  for (size_t i = 0; i < minerThreads.size(); i++)
+  v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+  Nan::Set(stats, Nan::New("workId").ToLocalChecked(), Nan::New(miner->GetWorkId()));
+  Nan::Set(stats, Nan::New("staleResults").ToLocalChecked(), Nan::New((double)miner->staleResults));
+  Nan::Set(stats, Nan::New("blocksFound").ToLocalChecked(), Nan::New((double)miner->blocksFound));
+  Nan::Set(stats, Nan::New("staleBlocks").ToLocalChecked(), Nan::New((double)miner->staleBlocks));
+
+  v8::Local<v8::Object> coverage = Nan::New<v8::Object>();
+  miner->coverage.FillStats(coverage);
+  Nan::Set(stats, Nan::New("coverage").ToLocalChecked(), coverage);
+
+  v8::Local<v8::Array> devices = Nan::New<v8::Array>();
+  for (auto device : miner->devices)
   {
-    delete minerThreads[i];
+    if (device->IsEnabled())
+    {
+      v8::Local<v8::Object> deviceStats = Nan::New<v8::Object>();
+      device->FillStats(deviceStats);
+      Nan::Set(devices, devices->Length(), deviceStats);
+    }
   }
+  Nan::Set(stats, Nan::New("devices").ToLocalChecked(), devices);
+  info.GetReturnValue().Set(stats);
 }
 
-NAN_GETTER(Device::HandleGetters)
+NAN_METHOD(Miner::ComputeHashes)
 {
-  v8::Local<v8::Value> ext = Nan::GetPrivate(info.This(), Nan::New("device").ToLocalChecked()).ToLocalChecked();
-  Device *device = (Device *)ext.As<v8::External>()->Value();
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
 
-  std::string propertyName = std::string(*Nan::Utf8String(property));
-  if (propertyName == "name")
-  {
-    std::string deviceName = device->device.getInfo<CL_DEVICE_NAME>(); // Includes null-terminator
-    info.GetReturnValue().Set(Nan::New(deviceName.c_str()).ToLocalChecked());
-  }
-  else if (propertyName == "vendor")
+  if (!info[0]->IsUint32() || Nan::To<uint32_t>(info[0]).FromJust() >= miner->devices.size())
   {
-    std::string deviceVendor = device->device.getInfo<CL_DEVICE_VENDOR>();
-    info.GetReturnValue().Set(Nan::New(deviceVendor.c_str()).ToLocalChecked());
+    return Nan::ThrowError(Nan::New("Invalid device index.").ToLocalChecked());
   }
-  else if (propertyName == "driverVersion")
+  Device *device = miner->devices[Nan::To<uint32_t>(info[0]).FromJust()];
+
+  if (!info[1]->IsUint8Array())
   {
-    std::string driverVersion = device->device.getInfo<CL_DRIVER_VERSION>();
-    info.GetReturnValue().Set(Nan::New(driverVersion.c_str()).ToLocalChecked());
+    return Nan::ThrowError(Nan::New("Block header required.").ToLocalChecked());
   }
-  else if (propertyName == "maxComputeUnits")
+  v8::Local<v8::Uint8Array> blockHeader = info[1].As<v8::Uint8Array>();
+  if (blockHeader->Length() != miner->argon2Params.headerLength)
   {
-    info.GetReturnValue().Set(device->device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+    return Nan::ThrowError(Nan::New("Invalid block header size.").ToLocalChecked());
   }
-  else if (propertyName == "maxClockFrequency")
+  work_header header;
+  header.length = blockHeader->Length();
+  memcpy(header.data, (uint8_t *)blockHeader->Buffer()->GetContents().Data() + blockHeader->ByteOffset(), header.length);
+
+  if (!info[2]->IsUint32())
   {
-    info.GetReturnValue().Set(device->device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>()); // MHz
+    return Nan::ThrowError(Nan::New("Start nonce required.").ToLocalChecked());
   }
-  else if (propertyName == "maxMemAllocSize")
+  uint32_t startNonce = Nan::To<uint32_t>(info[2]).FromJust();
+
+  if (!info[3]->IsFunction())
   {
-    info.GetReturnValue().Set((double)device->device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+    return Nan::ThrowError(Nan::New("Callback required.").ToLocalChecked());
   }
-  else if (propertyName == "globalMemSize")
+  v8::Local<v8::Function> cbFunc = info[3].As<v8::Function>();
+
+  if (!device->IsReady())
   {
-    info.GetReturnValue().Set((double)device->device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>());
+    return Nan::ThrowError(Nan::New("Device is not initialized.").ToLocalChecked());
   }
-  else if (propertyName == "enabled")
+
+  // Shares the buffers of the first miner thread
+  if (miner->miningEnabled)
   {
-    info.GetReturnValue().Set(device->enabled);
+    return Nan::ThrowError(Nan::New("Can't compute hashes while mining.").ToLocalChecked());
   }
-  else if (propertyName == "memory")
+
+  Nan::AsyncQueueWorker(new HashWorker(new Nan::Callback(cbFunc), device, header, startNonce));
+}
+
+NAN_METHOD(Miner::MeasureBandwidth)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+
+  if (!info[0]->IsUint32() || Nan::To<uint32_t>(info[0]).FromJust() >= miner->devices.size())
   {
-    info.GetReturnValue().Set(device->memory);
+    return Nan::ThrowError(Nan::New("Invalid device index.").ToLocalChecked());
   }
-  else if (propertyName == "threads")
+  Device *device = miner->devices[Nan::To<uint32_t>(info[0]).FromJust()];
+
+  if (!info[1]->IsFunction())
   {
-    info.GetReturnValue().Set(device->threads);
+    return Nan::ThrowError(Nan::New("Callback required.").ToLocalChecked());
   }
-  else if (propertyName == "cache")
+  v8::Local<v8::Function> cbFunc = info[1].As<v8::Function>();
+
+  if (!device->IsReady())
   {
-    info.GetReturnValue().Set(device->cache);
+    return Nan::ThrowError(Nan::New("Device is not initialized.").ToLocalChecked());
   }
-  else if (propertyName == "jobs")
+
+  // Overwrites the Argon2 buffer of the first miner thread
+  if (miner->miningEnabled)
   {
-    info.GetReturnValue().Set(device->jobs);
+    return Nan::ThrowError(Nan::New("Can't measure bandwidth while mining.").ToLocalChecked());
   }
+
+  Nan::AsyncQueueWorker(new BandwidthWorker(new Nan::Callback(cbFunc), device));
 }
 
-NAN_SETTER(Device::HandleSetters)
+NAN_METHOD(Miner::FreeDevices)
 {
-  v8::Local<v8::Value> ext = Nan::GetPrivate(info.This(), Nan::New("device").ToLocalChecked()).ToLocalChecked();
-  Device *device = (Device *)ext.As<v8::External>()->Value();
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
 
-  std::string propertyName = std::string(*Nan::Utf8String(property));
-  if (propertyName == "enabled")
+  if (!info[0]->IsFunction())
   {
-    if (!value->IsBoolean())
-    {
-      return Nan::ThrowError(Nan::New("Boolean value required.").ToLocalChecked());
-    }
+    return Nan::ThrowError(Nan::New("Callback required.").ToLocalChecked());
+  }
+  v8::Local<v8::Function> cbFunc = info[0].As<v8::Function>();
+
+  // Running batches finish first, their results are still reported
+  for (auto device : miner->devices)
+  {
+    device->SetReady(false);
+    Nan::AsyncQueueWorker(new DeviceWorker(new Nan::Callback(cbFunc), miner, device, DeviceWorker::FREE));
+  }
+
+  miner->devicesInitialized = false;
+}
+
+// Opens a trace window, the miner must have been created with { trace: true }
+NAN_METHOD(Miner::StartTrace)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+  if (miner->GetTracer() == nullptr)
+  {
+    return Nan::ThrowError(Nan::New("Tracing is not enabled.").ToLocalChecked());
+  }
+  miner->tracer.Start();
+}
+
+// Closes the trace window and returns it as Trace Event Format JSON
+NAN_METHOD(Miner::StopTrace)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+  if (miner->GetTracer() == nullptr)
+  {
+    return Nan::ThrowError(Nan::New("Tracing is not enabled.").ToLocalChecked());
+  }
+
+  std::map<uint32_t, std::string> processNames;
+  for (auto device : miner->devices)
+  {
+    processNames[device->GetDeviceIndex()] = "GPU #" + std::to_string(device->GetDeviceIndex()) + ": " + device->GetName();
+  }
+  info.GetReturnValue().Set(Nan::New(miner->tracer.Stop(processNames)).ToLocalChecked());
+}
+
+NAN_METHOD(Miner::AddNonceLease)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+  if (!info[0]->IsUint32() || !info[1]->IsNumber() || !info[2]->IsNumber())
+  {
+    return Nan::ThrowError(Nan::New("Work id, start and end nonce required.").ToLocalChecked());
+  }
+  NonceLease lease;
+  lease.workId = Nan::To<uint32_t>(info[0]).FromJust();
+  lease.start = Nan::To<uint32_t>(info[1]).FromJust();
+  lease.end = std::min((uint64_t)Nan::To<int64_t>(info[2]).FromJust(), (uint64_t)UINT32_MAX);
+  lease.next = lease.start;
+  if (lease.end <= lease.start)
+  {
+    return Nan::ThrowError(Nan::New("Invalid nonce lease.").ToLocalChecked());
+  }
+
+  std::lock_guard<std::mutex> lock(miner->leaseMutex);
+  // Leases that arrive after their job ended go straight back
+  if (lease.workId == miner->GetWorkId() && miner->leased && miner->miningEnabled)
+  {
+    miner->leases.push_back(lease);
+  }
+  else
+  {
+    miner->closedLeases.push_back(lease);
+  }
+}
+
+// Nonces left in the leases of the current job, and the leases closed since the last call with how far they got
+NAN_METHOD(Miner::GetNonceLeases)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+  std::vector<NonceLease> closed;
+  double remaining = 0;
+  uint32_t batch;
+  {
+    std::lock_guard<std::mutex> lock(miner->leaseMutex);
+    batch = miner->leaseBatch;
+    closed.swap(miner->closedLeases);
+    for (const auto &lease : miner->leases)
+    {
+      remaining += lease.end - lease.next;
+    }
+  }
+
+  v8::Local<v8::Array> leases = Nan::New<v8::Array>((int)closed.size());
+  for (size_t i = 0; i < closed.size(); i++)
+  {
+    v8::Local<v8::Object> lease = Nan::New<v8::Object>();
+    Nan::Set(lease, Nan::New("workId").ToLocalChecked(), Nan::New(closed[i].workId));
+    Nan::Set(lease, Nan::New("start").ToLocalChecked(), Nan::New((double)closed[i].start));
+    Nan::Set(lease, Nan::New("end").ToLocalChecked(), Nan::New((double)closed[i].end));
+    Nan::Set(lease, Nan::New("covered").ToLocalChecked(), Nan::New((double)closed[i].next));
+    Nan::Set(leases, (uint32_t)i, lease);
+  }
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  Nan::Set(result, Nan::New("remaining").ToLocalChecked(), Nan::New(remaining));
+  Nan::Set(result, Nan::New("batch").ToLocalChecked(), Nan::New(batch));
+  Nan::Set(result, Nan::New("closed").ToLocalChecked(), leases);
+  info.GetReturnValue().Set(result);
+}
+
+// stopLeasing(workId, nonceRange): the coordinator is gone, the job goes on with a nonce range of its own.
+// Its open leases are closed, the nonces mined from them are skipped as covered.
+NAN_METHOD(Miner::StopLeasing)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+  if (!info[0]->IsUint32())
+  {
+    return Nan::ThrowError(Nan::New("Work id required.").ToLocalChecked());
+  }
+  NonceRange nonceRange;
+  if (info[1]->IsObject() && !ReadNonceRange(info[1].As<v8::Object>(), &nonceRange))
+  {
+    return Nan::ThrowError(Nan::New("Invalid nonce range.").ToLocalChecked());
+  }
+  if (Nan::To<uint32_t>(info[0]).FromJust() != miner->GetWorkId() || !miner->leased)
+  {
+    return;
+  }
+
+  miner->CloseLeases();
+  std::atomic_store(&miner->nonceRange, std::make_shared<const NonceRange>(nonceRange));
+  miner->nextNonce = 0;
+  std::atomic_store(&miner->jobCovered, miner->coverage.Resume(miner->jobHeaderHash));
+  // Published last, threads waiting for leases take their next batch from the range
+  miner->leased = false;
+}
+
+NAN_METHOD(Miner::ReconfigureDevice)
+{
+  Miner *miner = Nan::ObjectWrap::Unwrap<Miner>(info.This());
+
+  if (!miner->devicesInitialized)
+  {
+    return Nan::ThrowError(Nan::New("Devices are not initialized.").ToLocalChecked());
+  }
+
+  if (!info[0]->IsUint32())
+  {
+    return Nan::ThrowError(Nan::New("Invalid device index.").ToLocalChecked());
+  }
+  uint32_t deviceIndex = Nan::To<uint32_t>(info[0]).FromJust();
+  if (deviceIndex >= miner->devices.size())
+  {
+    return Nan::ThrowError(Nan::New("Invalid device index.").ToLocalChecked());
+  }
+
+  if (!info[1]->IsFunction())
+  {
+    return Nan::ThrowError(Nan::New("Callback required.").ToLocalChecked());
+  }
+  v8::Local<v8::Function> cbFunc = info[1].As<v8::Function>();
+
+  // Other devices keep mining, this one rejoins the current job once it's rebuilt
+  Device *device = miner->devices[deviceIndex];
+  device->SetReady(false);
+  Nan::AsyncQueueWorker(new DeviceWorker(new Nan::Callback(cbFunc), miner, device, DeviceWorker::RECONFIGURE));
+}
+
+/*
+* Argon2Params
+*/
+
+std::string Argon2Params::Validate() const
+{
+  if (memoryCost < 2 * ARGON2_SYNC_POINTS || memoryCost % ARGON2_SYNC_POINTS != 0)
+  {
+    return "Argon2 memory cost must be a multiple of 4 and >= 8.";
+  }
+  if (passes < 1)
+  {
+    return "Argon2 passes must be >= 1.";
+  }
+  // Several lanes would need the warps of a nonce to synchronize at every segment
+  if (lanes != 1)
+  {
+    return "Only a single Argon2 lane is supported.";
+  }
+  if (salt.size() > MAX_SALT_LENGTH)
+  {
+    return "Argon2 salt must be at most " + std::to_string(MAX_SALT_LENGTH) + " bytes.";
+  }
+  if (headerLength < NONCE_LENGTH || headerLength > MAX_HEADER_LENGTH)
+  {
+    return "Argon2 header length must be between " + std::to_string(NONCE_LENGTH) + " and " + std::to_string(MAX_HEADER_LENGTH) + " bytes.";
+  }
+  // Lay out a seed once so a size mismatch fails at startup rather than in a miner thread
+  work_header header = {};
+  header.length = headerLength;
+  try
+  {
+    GetInitialSeed(&header);
+  }
+  catch (const std::runtime_error &e)
+  {
+    return e.what();
+  }
+  return "";
+}
+
+uint32_t Argon2Params::GetSeedSize() const
+{
+  // 6 parameters and the header length, header, salt, secret and associated data with their lengths
+  return 7 * 4 + headerLength + 4 + salt.size() + 4 + 4;
+}
+
+uint32_t Argon2Params::GetSeedBlocks() const
+{
+  return (GetSeedSize() + BLAKE2B_BLOCK_SIZE - 1) / BLAKE2B_BLOCK_SIZE;
+}
+
+uint32_t Argon2Params::GetNonceOffset() const
+{
+  return 7 * 4 + headerLength - NONCE_LENGTH;
+}
+
+std::vector<uint8_t> Argon2Params::GetInitialSeed(const work_header *header) const
+{
+  std::vector<uint8_t> seed;
+  seed.reserve(GetSeedBlocks() * BLAKE2B_BLOCK_SIZE);
+  auto put = [&seed](uint32_t value) {
+    for (int i = 0; i < 4; i++)
+    {
+      seed.push_back((uint8_t)(value >> (8 * i))); // little endian
+    }
+  };
+  put(lanes);
+  put(ARGON2_HASH_LENGTH);
+  put(memoryCost);
+  put(passes);
+  put(ARGON2_VERSION);
+  put(0); // Argon2d
+  put(headerLength);
+  seed.insert(seed.end(), header->data, header->data + headerLength);
+  put(salt.size());
+  seed.insert(seed.end(), salt.begin(), salt.end());
+  put(0); // secret
+  put(0); // associated data
+  // The kernels are built with GetSeedSize() and GetNonceOffset(), they must describe this layout
+  if (seed.size() != GetSeedSize())
+  {
+    throw std::runtime_error("Initial seed is " + std::to_string(seed.size()) + " bytes, expected " + std::to_string(GetSeedSize()) + ".");
+  }
+  seed.resize(GetSeedBlocks() * BLAKE2B_BLOCK_SIZE, 0);
+  return seed;
+}
+
+std::string Argon2Params::GetBuildOptions() const
+{
+  std::string buildOptions;
+  buildOptions += " -DMEMORY_COST=" + std::to_string(memoryCost);
+  buildOptions += " -DPASSES=" + std::to_string(passes);
+  buildOptions += " -DARGON2_INITIAL_SEED_SIZE=" + std::to_string(GetSeedSize());
+  buildOptions += " -DNONCE_OFFSET=" + std::to_string(GetNonceOffset());
+  buildOptions += " -DSEED_BLOCKS=" + std::to_string(GetSeedBlocks());
+  return buildOptions;
+}
+
+uint32_t Argon2Params::GetTrafficBlocks(uint32_t cache) const
+{
+  // First 2 blocks read, evicted and last blocks written, passes after the first also read the blocks they overwrite
+  return 2 + memoryCost * passes - cache - 1 + memoryCost * (passes - 1);
+}
+
+double Argon2Params::GetExpectedRefMisses(uint32_t cache) const
+{
+  // A reference lies 2 + area * x^2 blocks back for a uniform x, the last cache blocks are in local memory
+  uint32_t segmentLength = memoryCost / ARGON2_SYNC_POINTS;
+  double misses = 0;
+  for (uint32_t pass = 0; pass < passes; pass++)
+  {
+    for (uint32_t index = (pass == 0) ? 2 : 0; index < memoryCost; index++)
+    {
+      uint32_t area = (pass == 0) ? index - 1 : memoryCost - segmentLength + index % segmentLength - 1;
+      misses += 1 - std::min(1.0, std::sqrt((double)(cache - 1) / area));
+    }
+  }
+  return misses;
+}
+
+/*
+* ProgramCache
+*/
+
+cl::Program ProgramCache::Build(const cl::Context &context, const cl::Device &device, const std::string &buildOptions, bool *cacheHit)
+{
+  cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+  std::string key = platform.getInfo<CL_PLATFORM_NAME>() + "/" +
+                    device.getInfo<CL_DEVICE_NAME>() + "/" +
+                    device.getInfo<CL_DRIVER_VERSION>() + "/" +
+                    buildOptions;
+
+  std::promise<Binary> promise;
+  std::shared_future<Binary> binary;
+  bool owner = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = binaries.find(key);
+    if (it == binaries.end())
+    {
+      binary = promise.get_future().share();
+      binaries[key] = binary;
+      owner = true;
+    }
+    else
+    {
+      binary = it->second;
+    }
+  }
+
+  if (owner)
+  {
+    // First device with this key compiles, identical devices wait for its binary
+    *cacheHit = false;
+    try
+    {
+      cl::Program program = BuildFromSource(context, device, buildOptions);
+      promise.set_value(GetBinary(program));
+      return program;
+    }
+    catch (...)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        binaries.erase(key);
+      }
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+  }
+
+  const Binary &bin = binary.get();
+  if (!bin.empty())
+  {
+    try
+    {
+      cl::Program::Binaries programBinaries{std::make_pair(bin.data(), bin.size())};
+      cl::Program program(context, {device}, programBinaries);
+      program.build(buildOptions.c_str());
+      *cacheHit = true;
+      return program;
+    }
+    catch (cl::Error &)
+    {
+      // Driver refused the binary, compile it ourselves
+    }
+  }
+
+  *cacheHit = false;
+  return BuildFromSource(context, device, buildOptions);
+}
+
+cl::Program ProgramCache::BuildFromSource(const cl::Context &context, const cl::Device &device, const std::string &buildOptions)
+{
+  cl::Program::Sources sources{
+      std::make_pair(srcArgon2d.c_str(), srcArgon2d.size()),
+      std::make_pair(srcBlake2b.c_str(), srcBlake2b.size()),
+      std::make_pair(srcPersistent.c_str(), srcPersistent.size()),
+      std::make_pair(srcBandwidth.c_str(), srcBandwidth.size())};
+
+  cl::Program program = cl::Program(context, sources);
+  try
+  {
+    program.build(buildOptions.c_str());
+  }
+  catch (cl::Error &error)
+  {
+    std::string buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+    std::cerr << buildLog << std::endl;
+    throw;
+  }
+  return program;
+}
+
+ProgramCache::Binary ProgramCache::GetBinary(const cl::Program &program)
+{
+  size_t binarySize = 0;
+  if (clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL) != CL_SUCCESS || binarySize == 0)
+  {
+    return Binary();
+  }
+
+  Binary binary(binarySize);
+  unsigned char *binaryData = binary.data();
+  if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binaryData, NULL) != CL_SUCCESS)
+  {
+    return Binary();
+  }
+  return binary;
+}
+
+/*
+* Tracer
+*/
+
+Tracer::Tracer() : active(false)
+{
+}
+
+int64_t Tracer::Now()
+{
+  return (int64_t)uv_hrtime();
+}
+
+void Tracer::Start()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  events.clear();
+  dropped = 0;
+  origin = Now();
+  active = true;
+}
+
+bool Tracer::IsActive()
+{
+  return active;
+}
+
+void Tracer::Span(const char *name, const char *category, uint32_t pid, uint32_t tid, int64_t start, int64_t end, const std::string &args)
+{
+  Add({name, category, 'X', pid, tid, start, std::max(end - start, (int64_t)0), args});
+}
+
+void Tracer::Instant(const char *name, const char *category, uint32_t pid, uint32_t tid, int64_t time, const std::string &args)
+{
+  Add({name, category, 'i', pid, tid, time, 0, args});
+}
+
+void Tracer::Add(const Event &event)
+{
+  if (!active)
+  {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (events.size() >= TRACE_MAX_EVENTS)
+  {
+    dropped++;
+    return;
+  }
+  events.push_back(event);
+}
+
+std::string Tracer::ThreadName(uint32_t pid, uint32_t tid)
+{
+  if (pid == TRACE_PID_MINER)
+  {
+    return "main";
+  }
+  if (tid == TRACE_TID_JS)
+  {
+    return "js callbacks";
+  }
+  if (tid > TRACE_TID_JS)
+  {
+    return "thread " + std::to_string(tid - TRACE_TID_JS - 1) + " delivery";
+  }
+  if (tid >= TRACE_TID_QUEUE)
+  {
+    return "thread " + std::to_string(tid - TRACE_TID_QUEUE) + " queue";
+  }
+  return "thread " + std::to_string(tid);
+}
+
+std::string Tracer::JsonString(const std::string &value)
+{
+  std::string json = "\"";
+  for (char c : value)
+  {
+    if (c == '"' || c == '\\')
+    {
+      json += '\\';
+    }
+    json += ((unsigned char)c < 0x20) ? ' ' : c;
+  }
+  return json + "\"";
+}
+
+std::string Tracer::Stop(const std::map<uint32_t, std::string> &processNames)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  active = false;
+
+  std::string json = "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"droppedEvents\": " + std::to_string(dropped) + "}, \"traceEvents\": [\n";
+  char buf[256];
+  std::map<std::pair<uint32_t, uint32_t>, bool> threads;
+  for (auto const &event : events)
+  {
+    snprintf(buf, sizeof(buf), "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"pid\": %u, \"tid\": %u, \"ts\": %.3f",
+             event.name, event.category, event.phase, event.pid, event.tid, (event.time - origin) / 1e3);
+    json += buf;
+    if (event.phase == 'X')
+    {
+      snprintf(buf, sizeof(buf), ", \"dur\": %.3f", event.duration / 1e3);
+      json += buf;
+    }
+    else
+    {
+      json += (event.pid == TRACE_PID_MINER) ? ", \"s\": \"g\"" : ", \"s\": \"t\"";
+    }
+    if (!event.args.empty())
+    {
+      json += ", \"args\": {" + event.args + "}";
+    }
+    json += "},\n";
+    threads[std::make_pair(event.pid, event.tid)] = true;
+  }
+
+  for (auto const &name : processNames)
+  {
+    json += "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " + std::to_string(name.first) +
+            ", \"args\": {\"name\": " + JsonString(name.second) + "}},\n";
+  }
+  json += "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " + std::to_string(TRACE_PID_MINER) + ", \"args\": {\"name\": \"Miner\"}}";
+  for (auto const &thread : threads)
+  {
+    json += ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " + std::to_string(thread.first.first) +
+            ", \"tid\": " + std::to_string(thread.first.second) +
+            ", \"args\": {\"name\": " + JsonString(ThreadName(thread.first.first, thread.first.second)) + "}}";
+  }
+  json += "\n]}\n";
+
+  events.clear();
+  events.shrink_to_fit();
+  return json;
+}
+
+/*
+* Verifier
+*/
+
+Verifier::Verifier(const Argon2Params &argon2Params) : argon2Params(argon2Params)
+{
+}
+
+Verifier::~Verifier()
+{
+  Stop();
+}
+
+void Verifier::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+    queue.clear();
+  }
+  cv.notify_all();
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  threads.clear();
+}
+
+uint32_t Verifier::Submit(const work_header &header, const std::vector<Sample> &samples)
+{
+  std::shared_ptr<work_header> sharedHeader = std::make_shared<work_header>(header);
+  uint32_t queued = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopped)
+    {
+      return samples.size();
+    }
+    if (threads.empty())
+    {
+      for (int i = 0; i < VERIFY_THREADS; i++)
+      {
+        threads.push_back(std::thread(&Verifier::Run, this));
+      }
+    }
+    for (; queued < samples.size() && queue.size() < VERIFY_QUEUE_SIZE; queued++)
+    {
+      queue.push_back({sharedHeader, samples[queued]});
+    }
+  }
+  cv.notify_all();
+  return samples.size() - queued;
+}
+
+void Verifier::Run()
+{
+  CpuArgon2d argon2d(argon2Params.memoryCost, argon2Params.passes, argon2Params.lanes);
+  work_header password;
+  while (true)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return stopped || !queue.empty(); });
+      if (stopped)
+      {
+        return;
+      }
+      job = queue.front();
+      queue.pop_front();
+    }
+
+    // The nonce is the big endian tail of the header
+    password = *job.header;
+    uint8_t *nonce = password.data + password.length - NONCE_LENGTH;
+    nonce[0] = (uint8_t)(job.sample.nonce >> 24);
+    nonce[1] = (uint8_t)(job.sample.nonce >> 16);
+    nonce[2] = (uint8_t)(job.sample.nonce >> 8);
+    nonce[3] = (uint8_t)job.sample.nonce;
+
+    uint8_t hash[ARGON2_HASH_LENGTH];
+    argon2d.Hash(hash, sizeof(hash), password.data, password.length, (const uint8_t *)argon2Params.salt.data(), argon2Params.salt.size());
+    job.sample.device->ReportVerification(memcmp(hash, job.sample.hash, sizeof(hash)) == 0);
+  }
+}
+
+/*
+* NonceCoverage
+*/
+
+bool NonceCoverage::Contains(const Intervals &intervals, uint64_t start, uint64_t end)
+{
+  auto it = intervals.upper_bound(start);
+  if (it == intervals.begin())
+  {
+    return false;
+  }
+  --it;
+  return end <= it->second;
+}
+
+NonceCoverage::Entry &NonceCoverage::Touch(uint64_t headerHash)
+{
+  auto it = headers.find(headerHash);
+  if (it != headers.end())
+  {
+    recent.splice(recent.begin(), recent, it->second.recent);
+    return it->second;
+  }
+  if (headers.size() >= COVERAGE_MAX_HEADERS)
+  {
+    headers.erase(recent.back());
+    recent.pop_back();
+    evictedHeaders++;
+  }
+  recent.push_front(headerHash);
+  Entry &entry = headers[headerHash];
+  entry.recent = recent.begin();
+  return entry;
+}
+
+std::shared_ptr<const NonceCoverage::Intervals> NonceCoverage::Resume(uint64_t headerHash)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = headers.find(headerHash);
+  if (it == headers.end() || it->second.intervals.empty())
+  {
+    return nullptr;
+  }
+  resumedJobs++;
+  return std::make_shared<const Intervals>(Touch(headerHash).intervals);
+}
+
+void NonceCoverage::Add(uint64_t headerHash, uint64_t start, uint64_t end)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  Intervals &intervals = Touch(headerHash).intervals;
+
+  // Merge with every interval that overlaps or touches [start, end)
+  auto it = intervals.upper_bound(start);
+  if (it != intervals.begin() && std::prev(it)->second >= start)
+  {
+    --it;
+  }
+  while (it != intervals.end() && it->first <= end)
+  {
+    start = std::min(start, it->first);
+    end = std::max(end, it->second);
+    it = intervals.erase(it);
+  }
+  intervals[start] = end;
+
+  if (intervals.size() > COVERAGE_MAX_INTERVALS)
+  {
+    auto smallest = std::min_element(intervals.begin(), intervals.end(), [](const Intervals::value_type &a, const Intervals::value_type &b) {
+      return a.second - a.first < b.second - b.first;
+    });
+    forgottenNonces += smallest->second - smallest->first;
+    intervals.erase(smallest);
+  }
+}
+
+void NonceCoverage::ReportAvoided(uint64_t nonces)
+{
+  avoidedNonces += nonces;
+}
+
+void NonceCoverage::FillStats(v8::Local<v8::Object> stats)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  uint64_t intervals = 0;
+  for (auto const &header : headers)
+  {
+    intervals += header.second.intervals.size();
+  }
+  Nan::Set(stats, Nan::New("headers").ToLocalChecked(), Nan::New((double)headers.size()));
+  Nan::Set(stats, Nan::New("intervals").ToLocalChecked(), Nan::New((double)intervals));
+  Nan::Set(stats, Nan::New("resumedJobs").ToLocalChecked(), Nan::New((double)resumedJobs));
+  Nan::Set(stats, Nan::New("avoidedNonces").ToLocalChecked(), Nan::New((double)avoidedNonces));
+  Nan::Set(stats, Nan::New("evictedHeaders").ToLocalChecked(), Nan::New((double)evictedHeaders));
+  Nan::Set(stats, Nan::New("forgottenNonces").ToLocalChecked(), Nan::New((double)forgottenNonces));
+}
+
+/*
+* Tuner
+*/
+
+Tuner::Tuner(uint32_t cache, uint32_t jobs, cl::Program program) : stopped(false)
+{
+  variants.push_back({cache, jobs, program, 0});
+}
+
+Tuner::~Tuner()
+{
+  Stop();
+}
+
+void Tuner::Stop()
+{
+  stopped = true;
+  if (builder.joinable())
+  {
+    builder.join();
+  }
+}
+
+void Tuner::Start(const std::vector<std::pair<uint32_t, uint32_t>> &candidates, BuildFunction build)
+{
+  builder = std::thread([this, candidates, build]() {
+    for (auto const &candidate : candidates)
+    {
+      if (stopped)
+      {
+        break;
+      }
+      try
+      {
+        cl::Program program = build(candidate.first, candidate.second);
+        std::lock_guard<std::mutex> lock(mutex);
+        variants.push_back({candidate.first, candidate.second, program, 0});
+      }
+      catch (std::exception &)
+      {
+        // Variant doesn't build on this device, skip it
+      }
+    }
+  });
+}
+
+size_t Tuner::SelectVariant()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  batches++;
+  if (variants.size() < 2 || batches % trialInterval != 0)
+  {
+    return best;
+  }
+
+  if (!onTrial)
+  {
+    // Next candidate in round-robin order
+    candidate = (candidate + 1) % variants.size();
+    if (candidate == best)
+    {
+      candidate = (candidate + 1) % variants.size();
+    }
+    onTrial = true;
+    trialBatches = 0;
+    trialHashrate = 0;
+  }
+  return candidate;
+}
+
+void Tuner::Report(size_t variant, double hashrate)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (variant == best)
+  {
+    double &average = variants[best].hashrate;
+    average = (average == 0) ? hashrate : 0.8 * average + 0.2 * hashrate;
+    return;
+  }
+  if (!onTrial || variant != candidate)
+  {
+    return;
+  }
+
+  trialHashrate += hashrate;
+  if (++trialBatches < TUNER_TRIAL_BATCHES)
+  {
+    return;
+  }
+  onTrial = false;
+
+  KernelVariant &trial = variants[candidate];
+  trial.hashrate = trialHashrate / trialBatches;
+  if (variants[best].hashrate > 0 && trial.hashrate > variants[best].hashrate * (1 + TUNER_MARGIN))
+  {
+    TunerDecision decision;
+    decision.time = std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
+    decision.fromCache = variants[best].cache;
+    decision.fromJobs = variants[best].jobs;
+    decision.toCache = trial.cache;
+    decision.toJobs = trial.jobs;
+    decision.fromHashrate = variants[best].hashrate;
+    decision.toHashrate = trial.hashrate;
+    if (history.size() >= TUNER_HISTORY_SIZE)
+    {
+      history.erase(history.begin());
+    }
+    history.push_back(decision);
+
+    best = candidate;
+    trialsWithoutImprovement = 0;
+    trialInterval = TUNER_TRIAL_INTERVAL;
+  }
+  else if (++trialsWithoutImprovement >= variants.size() - 1)
+  {
+    // Everything tried without improvement, keep watching for drift but less often
+    trialsWithoutImprovement = 0;
+    trialInterval = std::min(trialInterval * 2, (uint32_t)TUNER_MAX_TRIAL_INTERVAL);
+  }
+}
+
+KernelVariant Tuner::GetVariant(size_t variant)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return variants[variant];
+}
+
+void Tuner::FillStats(v8::Local<v8::Object> stats)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  Nan::Set(stats, Nan::New("cache").ToLocalChecked(), Nan::New(variants[best].cache));
+  Nan::Set(stats, Nan::New("jobs").ToLocalChecked(), Nan::New(variants[best].jobs));
+  Nan::Set(stats, Nan::New("variants").ToLocalChecked(), Nan::New((uint32_t)variants.size()));
+
+  v8::Local<v8::Array> decisions = Nan::New<v8::Array>(history.size());
+  for (size_t i = 0; i < history.size(); i++)
+  {
+    const TunerDecision &decision = history[i];
+    v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+    Nan::Set(obj, Nan::New("time").ToLocalChecked(), Nan::New(decision.time));
+    Nan::Set(obj, Nan::New("fromCache").ToLocalChecked(), Nan::New(decision.fromCache));
+    Nan::Set(obj, Nan::New("fromJobs").ToLocalChecked(), Nan::New(decision.fromJobs));
+    Nan::Set(obj, Nan::New("toCache").ToLocalChecked(), Nan::New(decision.toCache));
+    Nan::Set(obj, Nan::New("toJobs").ToLocalChecked(), Nan::New(decision.toJobs));
+    Nan::Set(obj, Nan::New("fromHashrate").ToLocalChecked(), Nan::New(decision.fromHashrate));
+    Nan::Set(obj, Nan::New("toHashrate").ToLocalChecked(), Nan::New(decision.toHashrate));
+    Nan::Set(decisions, (uint32_t)i, obj);
+  }
+  Nan::Set(stats, Nan::New("history").ToLocalChecked(), decisions);
+}
+
+/*
+* Device
+*/
+
+Device::Device(Miner *miner, const cl::Device &device, uint32_t deviceIndex)
+    : miner(miner), device(device), deviceIndex(deviceIndex), ready(false),
+      verifiedSamples(0), invalidSamples(0), droppedSamples(0), recovering(false)
+{
+  std::string deviceVendor = device.getInfo<CL_DEVICE_VENDOR>();
+  isAMD = (deviceVendor.find(VENDOR_AMD) == 0);
+  isGPU = (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU) != 0;
+}
+
+Device::~Device()
+{
+  for (size_t i = 0; i < minerThreads.size(); i++)
+  {
+    delete minerThreads[i];
+  }
+}
+
+NAN_GETTER(Device::HandleGetters)
+{
+  v8::Local<v8::Value> ext = Nan::GetPrivate(info.This(), Nan::New("device").ToLocalChecked()).ToLocalChecked();
+  Device *device = (Device *)ext.As<v8::External>()->Value();
+
+  std::string propertyName = std::string(*Nan::Utf8String(property));
+  if (propertyName == "name")
+  {
+    std::string deviceName = device->device.getInfo<CL_DEVICE_NAME>(); // Includes null-terminator
+    info.GetReturnValue().Set(Nan::New(deviceName.c_str()).ToLocalChecked());
+  }
+  else if (propertyName == "vendor")
+  {
+    std::string deviceVendor = device->device.getInfo<CL_DEVICE_VENDOR>();
+    info.GetReturnValue().Set(Nan::New(deviceVendor.c_str()).ToLocalChecked());
+  }
+  else if (propertyName == "driverVersion")
+  {
+    std::string driverVersion = device->device.getInfo<CL_DRIVER_VERSION>();
+    info.GetReturnValue().Set(Nan::New(driverVersion.c_str()).ToLocalChecked());
+  }
+  else if (propertyName == "maxComputeUnits")
+  {
+    info.GetReturnValue().Set(device->device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+  }
+  else if (propertyName == "maxClockFrequency")
+  {
+    info.GetReturnValue().Set(device->device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>()); // MHz
+  }
+  else if (propertyName == "maxMemAllocSize")
+  {
+    info.GetReturnValue().Set((double)device->device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+  }
+  else if (propertyName == "globalMemSize")
+  {
+    info.GetReturnValue().Set((double)device->device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>());
+  }
+  else if (propertyName == "enabled")
+  {
+    info.GetReturnValue().Set(device->enabled);
+  }
+  else if (propertyName == "memory")
+  {
+    info.GetReturnValue().Set(device->memory);
+  }
+  else if (propertyName == "threads")
+  {
+    info.GetReturnValue().Set(device->threads);
+  }
+  else if (propertyName == "cache")
+  {
+    info.GetReturnValue().Set(device->cache);
+  }
+  else if (propertyName == "jobs")
+  {
+    info.GetReturnValue().Set(device->jobs);
+  }
+  else if (propertyName == "persistent")
+  {
+    info.GetReturnValue().Set(device->persistent);
+  }
+  else if (propertyName == "vectorBlake2b")
+  {
+    info.GetReturnValue().Set(device->vectorBlake2b);
+  }
+  else if (propertyName == "tune")
+  {
+    info.GetReturnValue().Set(device->tune);
+  }
+  else if (propertyName == "profile")
+  {
+    info.GetReturnValue().Set(device->profile);
+  }
+  else if (propertyName == "tmto")
+  {
+    info.GetReturnValue().Set(device->tmto);
+  }
+  else if (propertyName == "threadsPerLane")
+  {
+    info.GetReturnValue().Set(device->threadsPerLane);
+  }
+  else if (propertyName == "verify")
+  {
+    info.GetReturnValue().Set(device->verify);
+  }
+  else if (propertyName == "buildTime")
+  {
+    info.GetReturnValue().Set(device->buildTime);
+  }
+  else if (propertyName == "buildCacheHit")
+  {
+    info.GetReturnValue().Set(device->buildCacheHit);
+  }
+}
+
+NAN_SETTER(Device::HandleSetters)
+{
+  v8::Local<v8::Value> ext = Nan::GetPrivate(info.This(), Nan::New("device").ToLocalChecked()).ToLocalChecked();
+  Device *device = (Device *)ext.As<v8::External>()->Value();
+
+  std::string propertyName = std::string(*Nan::Utf8String(property));
+  if (propertyName == "enabled")
+  {
+    if (!value->IsBoolean())
+    {
+      return Nan::ThrowError(Nan::New("Boolean value required.").ToLocalChecked());
+    }
     device->enabled = Nan::To<bool>(value).FromJust();
   }
-  else if (propertyName == "memory")
+  else if (propertyName == "memory")
+  {
+    if (!value->IsUint32())
+    {
+      return Nan::ThrowError(Nan::New("Memory must be >= 0.").ToLocalChecked());
+    }
+    device->memory = Nan::To<uint32_t>(value).FromJust();
+  }
+  else if (propertyName == "threads")
+  {
+    if (!value->IsUint32())
+    {
+      return Nan::ThrowError(Nan::New("Threads must be >= 1").ToLocalChecked());
+    }
+    uint32_t threads = Nan::To<uint32_t>(value).FromJust();
+    if (threads < 1)
+    {
+      return Nan::ThrowError(Nan::New("Threads must be >= 1.").ToLocalChecked());
+    }
+    device->threads = threads;
+  }
+  else if (propertyName == "cache")
+  {
+    if (!value->IsUint32())
+    {
+      return Nan::ThrowError(Nan::New("Cache must be >= 2.").ToLocalChecked());
+    }
+    uint32_t cache = Nan::To<uint32_t>(value).FromJust();
+    if (cache < 2)
+    {
+      return Nan::ThrowError(Nan::New("Cache must be >= 2.").ToLocalChecked());
+    }
+    device->cache = cache;
+  }
+  else if (propertyName == "jobs")
+  {
+    if (!value->IsUint32())
+    {
+      return Nan::ThrowError(Nan::New("Jobs must be >= 1.").ToLocalChecked());
+    }
+    uint32_t jobs = Nan::To<uint32_t>(value).FromJust();
+    if (jobs < 1)
+    {
+      return Nan::ThrowError(Nan::New("Jobs must be >= 1.").ToLocalChecked());
+    }
+    device->jobs = jobs;
+  }
+  else if (propertyName == "persistent")
+  {
+    if (!value->IsBoolean())
+    {
+      return Nan::ThrowError(Nan::New("Boolean value required.").ToLocalChecked());
+    }
+    device->persistent = Nan::To<bool>(value).FromJust();
+  }
+  else if (propertyName == "vectorBlake2b")
+  {
+    if (!value->IsBoolean())
+    {
+      return Nan::ThrowError(Nan::New("Boolean value required.").ToLocalChecked());
+    }
+    device->vectorBlake2b = Nan::To<bool>(value).FromJust();
+  }
+  else if (propertyName == "tune")
+  {
+    if (!value->IsBoolean())
+    {
+      return Nan::ThrowError(Nan::New("Boolean value required.").ToLocalChecked());
+    }
+    device->tune = Nan::To<bool>(value).FromJust();
+  }
+  else if (propertyName == "profile")
+  {
+    if (!value->IsBoolean())
+    {
+      return Nan::ThrowError(Nan::New("Boolean value required.").ToLocalChecked());
+    }
+    device->profile = Nan::To<bool>(value).FromJust();
+  }
+  else if (propertyName == "tmto")
+  {
+    if (!value->IsUint32())
+    {
+      return Nan::ThrowError(Nan::New("TMTO must be 0 or >= 2.").ToLocalChecked());
+    }
+    uint32_t tmto = Nan::To<uint32_t>(value).FromJust();
+    if (tmto == 1)
+    {
+      return Nan::ThrowError(Nan::New("TMTO must be 0 or >= 2.").ToLocalChecked());
+    }
+    device->tmto = tmto;
+  }
+  else if (propertyName == "threadsPerLane")
+  {
+    uint32_t threadsPerLane = value->IsUint32() ? Nan::To<uint32_t>(value).FromJust() : 0;
+    if (threadsPerLane != 8 && threadsPerLane != 16 && threadsPerLane != 32)
+    {
+      return Nan::ThrowError(Nan::New("Threads per lane must be 8, 16 or 32.").ToLocalChecked());
+    }
+    device->threadsPerLane = threadsPerLane;
+  }
+  else if (propertyName == "verify")
+  {
+    if (!value->IsUint32())
+    {
+      return Nan::ThrowError(Nan::New("Verify must be >= 0.").ToLocalChecked());
+    }
+    device->verify = Nan::To<uint32_t>(value).FromJust();
+  }
+}
+
+bool Device::IsEnabled()
+{
+  return enabled;
+}
+
+bool Device::IsReady()
+{
+  return ready;
+}
+
+void Device::SetReady(bool ready)
+{
+  this->ready = ready;
+}
+
+double Device::GetBuildTime()
+{
+  return buildTime;
+}
+
+bool Device::IsBuildCacheHit()
+{
+  return buildCacheHit;
+}
+
+uint32_t Device::GetDeviceIndex()
+{
+  return deviceIndex;
+}
+
+std::string Device::GetName()
+{
+  std::string deviceName = device.getInfo<CL_DEVICE_NAME>();
+  return deviceName.c_str(); // Includes null-terminator
+}
+
+void Device::Initialize()
+{
+  std::lock_guard<std::mutex> lifecycleLock(lifecycleMutex);
+
+  // The error rate is judged for the current settings only
+  verifiedSamples = 0;
+  invalidSamples = 0;
+  droppedSamples = 0;
+
+  size_t memSize = (size_t)memory * ONE_MB;
+  // Autoconfig memory size
+  if (memSize == 0)
+  {
+    cl_ulong globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+
+    memSize = (globalMemSize / ONE_GB - 1) * ONE_GB / threads;
+    if (isAMD)
+    {
+      cl_ulong maxMemAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+      if (memSize > maxMemAllocSize)
+      {
+        memSize = (maxMemAllocSize / ONE_GB) * ONE_GB;
+      }
+    }
+  }
+
+  const Argon2Params &argon2Params = miner->GetArgon2Params();
+  if (cache >= argon2Params.memoryCost)
+  {
+    throw std::runtime_error("Cache must be smaller than the Argon2 memory cost.");
+  }
+  if (tmto > 0 && argon2Params.passes > 1)
+  {
+    throw std::runtime_error("TMTO requires a single Argon2 pass.");
+  }
+
+  uint32_t noncesPerRun = memSize / (ARGON2_BLOCK_SIZE * argon2Params.memoryCost);
+
+  cl_uint jobsPerBlock = (isAMD ? jobs : 1);
+  size_t shmemSize = cache * jobsPerBlock * ARGON2_BLOCK_SIZE;
+
+  // Fewer blocks per nonce fit more nonces into the same memory, each lane needs an extra local block to recompute in
+  if (tmto > 0)
+  {
+    noncesPerRun = memSize / (ARGON2_BLOCK_SIZE * TMTO_BLOCKS(argon2Params.memoryCost, tmto));
+    noncesPerRun -= noncesPerRun % 256; // get_nonce work-group size
+    if (!isGPU)
+    {
+      jobsPerBlock = 1; // recomputation depth differs between lanes, barriers must not
+    }
+    shmemSize = (cache + 1) * jobsPerBlock * ARGON2_BLOCK_SIZE;
+  }
+
+  // printf("Mem size: %lu, nonces per run: %u, jobs: %u, cache: %u, shared mem size: %lu\n", memSize, noncesPerRun, jobsPerBlock, cache, shmemSize);
+
+  // Kept across reconfigurations, pooled buffers belong to it
+  if (context() == NULL)
+  {
+    context = cl::Context(device);
+  }
+
+  std::string buildOptions = GetBuildOptions(cache, jobsPerBlock);
+
+  // printf("Build options: `%s`\n", buildOptions.c_str());
+  if (program() == NULL || buildOptions != programOptions)
+  {
+    auto buildStart = std::chrono::steady_clock::now();
+    program = miner->GetProgramCache().Build(context, device, buildOptions, &buildCacheHit);
+    buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+    programOptions = buildOptions;
+  }
+  else
+  {
+    buildCacheHit = true;
+    buildTime = 0;
+  }
+
+  // Pooled buffers that are too small can't be used, release them before allocating bigger ones
+  bufferPool.erase(std::remove_if(bufferPool.begin(), bufferPool.end(), [memSize](const cl::Buffer &buffer) {
+                     return buffer.getInfo<CL_MEM_SIZE>() < memSize;
+                   }),
+                   bufferPool.end());
+  std::vector<MinerThread *> newThreads;
+  std::vector<MinerThread *> coldThreads;
+
+  // Persistent kernels run a whole chunk per launch, there are no batch boundaries to swap kernels at.
+  // Profiling builds take an extra argon2 argument the variants wouldn't get.
+  // Tradeoff builds need more local memory than the variants are sized for.
+  if (tune && !persistent && !profile && tmto == 0)
+  {
+    std::shared_ptr<Tuner> tuner = std::make_shared<Tuner>(cache, jobsPerBlock, program);
+
+    cl_ulong localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    size_t maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    std::vector<uint32_t> jobsCandidates = isAMD ? std::vector<uint32_t>{1, 2, 4, 8, 16} : std::vector<uint32_t>{1};
+
+    std::vector<std::pair<uint32_t, uint32_t>> candidates;
+    for (uint32_t c : {2, 4, 8, 16})
+    {
+      for (uint32_t j : jobsCandidates)
+      {
+        // Like the configured cache, it must leave blocks for global memory that later passes read back
+        bool fits = (c < argon2Params.memoryCost) &&
+                    ((cl_ulong)c * j * ARGON2_BLOCK_SIZE <= localMemSize) &&
+                    (threadsPerLane * j <= maxWorkGroupSize) &&
+                    (noncesPerRun % j == 0);
+        if (fits && !(c == cache && j == jobsPerBlock))
+        {
+          candidates.push_back(std::make_pair(c, j));
+        }
+      }
+    }
+
+    tuner->Start(candidates, [this](uint32_t c, uint32_t j) {
+      bool cacheHit;
+      return miner->GetProgramCache().Build(context, device, GetBuildOptions(c, j), &cacheHit);
+    });
+
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    this->tuner = tuner;
+  }
+
+  for (uint32_t threadIndex = 0; threadIndex < threads; threadIndex++)
+  {
+    bool profiled = profile || (miner->GetTracer() != nullptr);
+    cl::CommandQueue queue = cl::CommandQueue(context, device, profiled ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+    cl::Buffer memInitialSeed = cl::Buffer(context, CL_MEM_READ_WRITE, argon2Params.GetSeedBlocks() * BLAKE2B_BLOCK_SIZE);
+    bool reused;
+    cl::Buffer memArgon2 = AcquireBuffer(memSize, &reused);
+    cl::Buffer memNonce = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(zeroNonce));
+    cl::Buffer memHashes = cl::Buffer(context, CL_MEM_WRITE_ONLY, (size_t)noncesPerRun * ARGON2_HASH_LENGTH);
+
+    cl::Kernel kernelInitMemory = cl::Kernel(program, "init_memory");
+    kernelInitMemory.setArg(0, memArgon2);
+    kernelInitMemory.setArg(1, memInitialSeed);
+
+    cl::Kernel kernelArgon2 = cl::Kernel(program, "argon2");
+    kernelArgon2.setArg(0, shmemSize, NULL);
+    kernelArgon2.setArg(1, memArgon2);
+
+    // get_nonce always needs a sample buffer, sample count 0 leaves it alone
+    uint32_t samples = persistent ? 0 : std::min(verify, noncesPerRun);
+    cl::Buffer memSamples = cl::Buffer(context, CL_MEM_WRITE_ONLY, std::max(samples, 1u) * ARGON2_HASH_LENGTH);
+
+    cl::Kernel kernelGetNonce = cl::Kernel(program, "get_nonce");
+    kernelGetNonce.setArg(0, memArgon2);
+    kernelGetNonce.setArg(4, memNonce);
+    kernelGetNonce.setArg(5, (cl_uint)0);
+    kernelGetNonce.setArg(6, (cl_uint)0);
+    kernelGetNonce.setArg(7, memSamples);
+
+    cl::Kernel kernelGetHashes = cl::Kernel(program, "get_hashes");
+    kernelGetHashes.setArg(0, memArgon2);
+    kernelGetHashes.setArg(1, memHashes);
+
+    cl::NDRange globalInitMemory = cl::NDRange(noncesPerRun, 2);
+    cl::NDRange localInitMemory = cl::NDRange(128, 2);
+
+    cl::NDRange globalArgon2 = cl::NDRange(threadsPerLane, noncesPerRun);
+    cl::NDRange localArgon2 = cl::NDRange(threadsPerLane, jobsPerBlock);
+
+    cl::NDRange globalGetNonce = cl::NDRange(noncesPerRun);
+    cl::NDRange localGetNonce = cl::NDRange(256);
+
+    MinerThread *minerThread = new MinerThread(miner, threadIndex, noncesPerRun,
+                                               queue, memInitialSeed, memArgon2, memNonce, memHashes,
+                                               kernelInitMemory, kernelArgon2, kernelGetNonce, kernelGetHashes,
+                                               globalInitMemory, localInitMemory,
+                                               globalArgon2, localArgon2,
+                                               globalGetNonce, localGetNonce);
+    newThreads.push_back(minerThread);
+    if (!reused)
+    {
+      coldThreads.push_back(minerThread);
+    }
+
+    if (persistent)
+    {
+      cl::Buffer memControl = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(persistent_control));
+      cl::Buffer memNextJob = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+
+      cl::Kernel kernelPersistent = cl::Kernel(program, "mine_persistent");
+      kernelPersistent.setArg(0, shmemSize, NULL);
+      kernelPersistent.setArg(1, memArgon2);
+      kernelPersistent.setArg(2, memInitialSeed);
+      kernelPersistent.setArg(3, memControl);
+      kernelPersistent.setArg(4, memNextJob);
+
+      minerThread->EnablePersistentMode(kernelPersistent, memControl, memNextJob);
+    }
+
+    if (tuner != nullptr)
+    {
+      minerThread->SetTuner(tuner);
+    }
+
+    if (profile)
+    {
+      minerThread->EnableRefProfile(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(ref_profile)));
+    }
+
+    if (miner->GetTracer() != nullptr)
+    {
+      minerThread->EnableTracing(miner->GetTracer(), deviceIndex);
+    }
+
+    if (samples > 0)
+    {
+      minerThread->EnableVerification(this, memSamples, samples, tmto > 0);
+    }
+  }
+
+  // Fault in the buffers before the first real batch, reused ones already are
+  for (auto minerThread : coldThreads)
+  {
+    minerThread->WarmUp();
+  }
+  bufferPool.clear();
+
+  std::lock_guard<std::mutex> lock(threadsMutex);
+  minerThreads = newThreads;
+  failed = false;
+}
+
+void Device::Free(bool keepBuffers, bool force)
+{
+  std::lock_guard<std::mutex> lifecycleLock(lifecycleMutex);
+
+  std::vector<MinerThread *> freedThreads;
+  std::shared_ptr<Tuner> freedTuner;
+  {
+    std::unique_lock<std::mutex> lock(threadsMutex);
+    generation++; // jobs queued for the old threads won't start
+    for (auto minerThread : minerThreads)
+    {
+      minerThread->Stop();
+    }
+
+    auto idle = [this] {
+      for (auto minerThread : minerThreads)
+      {
+        if (threadUsers.count(minerThread) > 0)
+        {
+          return false;
+        }
+      }
+      return true;
+    };
+    if (force)
+    {
+      // A hung kernel never returns, its thread is left behind
+      threadsIdle.wait_for(lock, std::chrono::milliseconds(WATCHDOG_FREE_TIMEOUT), idle);
+    }
+    else
+    {
+      threadsIdle.wait(lock, idle);
+    }
+
+    for (auto minerThread : minerThreads)
+    {
+      if (threadUsers.count(minerThread) > 0)
+      {
+        abandonedThreads.push_back(minerThread);
+      }
+      else
+      {
+        freedThreads.push_back(minerThread);
+      }
+    }
+    minerThreads.clear();
+
+    freedTuner.swap(tuner);
+  }
+
+  // Abandoned threads keep their reference, the builder uses the context and must be done before it goes
+  if (freedTuner != nullptr)
+  {
+    freedTuner->Stop();
+  }
+
+  for (auto minerThread : freedThreads)
+  {
+    if (keepBuffers)
+    {
+      bufferPool.push_back(minerThread->GetArgon2Buffer());
+    }
+    delete minerThread;
+  }
+
+  if (!keepBuffers)
+  {
+    bufferPool.clear();
+    program = cl::Program();
+    programOptions.clear();
+    context = cl::Context();
+  }
+}
+
+cl::Buffer Device::AcquireBuffer(size_t size, bool *reused)
+{
+  for (auto it = bufferPool.begin(); it != bufferPool.end(); ++it)
+  {
+    if (it->getInfo<CL_MEM_SIZE>() >= size)
+    {
+      cl::Buffer buffer = *it;
+      bufferPool.erase(it);
+      *reused = true;
+      return buffer;
+    }
+  }
+  *reused = false;
+  return cl::Buffer(context, CL_MEM_READ_WRITE, size);
+}
+
+MinerThread *Device::AcquireThread(uint32_t generation, uint32_t threadIndex)
+{
+  std::lock_guard<std::mutex> lock(threadsMutex);
+  if (generation != this->generation || threadIndex >= minerThreads.size())
+  {
+    return nullptr;
+  }
+  MinerThread *minerThread = minerThreads[threadIndex];
+  threadUsers[minerThread]++;
+  return minerThread;
+}
+
+void Device::ReleaseThread(MinerThread *minerThread)
+{
+  bool abandoned = false;
+  {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    if (--threadUsers[minerThread] == 0)
+    {
+      threadUsers.erase(minerThread);
+      auto it = std::find(abandonedThreads.begin(), abandonedThreads.end(), minerThread);
+      if (it != abandonedThreads.end())
+      {
+        abandonedThreads.erase(it);
+        abandoned = true;
+      }
+    }
+    threadsIdle.notify_all();
+  }
+  if (abandoned)
+  {
+    delete minerThread;
+  }
+}
+
+void Device::ReportError(uint32_t generation, const std::string &error)
+{
+  std::lock_guard<std::mutex> lock(threadsMutex);
+  // Errors of threads that were already replaced don't count
+  if (generation == this->generation)
+  {
+    failed = true;
+    lastError = error;
+  }
+}
+
+void Device::ReportVerification(bool valid)
+{
+  verifiedSamples++;
+  if (!valid)
+  {
+    invalidSamples++;
+  }
+}
+
+void Device::ReportDroppedSamples(uint32_t count)
+{
+  droppedSamples += count;
+}
+
+bool Device::CheckHealth(std::string *reason)
+{
+  std::lock_guard<std::mutex> lock(threadsMutex);
+
+  if (failed)
+  {
+    *reason = lastError;
+    return true;
+  }
+
+  for (auto minerThread : minerThreads)
   {
-    if (!value->IsUint32())
+    double running = minerThread->GetBatchRunningTime();
+    double average = minerThread->GetAverageBatchTime();
+    double timeout = (average > 0) ? std::max(average * WATCHDOG_TIMEOUT_FACTOR, (double)WATCHDOG_MIN_TIMEOUT) : WATCHDOG_INITIAL_TIMEOUT;
+    if (running > timeout)
     {
-      return Nan::ThrowError(Nan::New("Memory must be >= 0.").ToLocalChecked());
+      char message[128];
+      snprintf(message, sizeof(message), "Batch on thread %u running for %.1f s (average %.1f s).", minerThread->GetThreadIndex(), running, average);
+      *reason = message;
+      return true;
     }
-    device->memory = Nan::To<uint32_t>(value).FromJust();
   }
-  else if (propertyName == "threads")
+  return false;
+}
+
+bool Device::BeginRecovery(const std::string &reason)
+{
+  if (recovering.exchange(true))
   {
-    if (!value->IsUint32())
+    return false;
+  }
+  recoveryReason = reason;
+  return true;
+}
+
+void Device::EndRecovery(bool success, double duration, const std::string &error)
+{
+  RecoveryEvent event;
+  event.time = std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
+  event.duration = duration;
+  event.success = success;
+  event.reason = recoveryReason;
+  event.error = error;
+  if (recoveryHistory.size() >= RECOVERY_HISTORY_SIZE)
+  {
+    recoveryHistory.erase(recoveryHistory.begin());
+  }
+  recoveryHistory.push_back(event);
+  recoveries++;
+
+  // A device that failed to recover stays isolated
+  recovering = false;
+}
+
+void Device::StartMiningOnBlock(const v8::Local<v8::Function> &cbFunc, uint32_t workId, uint64_t headerHash, work_header *blockHeader)
+{
+  Nan::HandleScope scope;
+
+  std::lock_guard<std::mutex> lock(threadsMutex);
+  for (auto minerThread : minerThreads)
+  {
+    Nan::AsyncQueueWorker(new MinerWorker(new Nan::Callback(cbFunc), miner, this, generation,
+                                          minerThread->GetThreadIndex(), minerThread->GetNoncesPerRun(),
+                                          workId, headerHash, *blockHeader));
+  }
+}
+
+void Device::MineNonces(uint32_t generation, uint32_t threadIndex, uint32_t workId, work_header *blockHeader, const MinerProgress &progress)
+{
+  MinerThread *minerThread = AcquireThread(generation, threadIndex);
+  if (minerThread == nullptr)
+  {
+    return; // freed or reconfigured since the job was queued
+  }
+  try
+  {
+    minerThread->MineNonces(workId, blockHeader, progress);
+  }
+  catch (std::exception &e)
+  {
+    ReportError(generation, e.what());
+    ReleaseThread(minerThread);
+    throw;
+  }
+  ReleaseThread(minerThread);
+}
+
+void Device::FillStats(v8::Local<v8::Object> stats)
+{
+  Nan::Set(stats, Nan::New("device").ToLocalChecked(), Nan::New(deviceIndex));
+  Nan::Set(stats, Nan::New("ready").ToLocalChecked(), Nan::New((bool)ready));
+  Nan::Set(stats, Nan::New("recoveries").ToLocalChecked(), Nan::New(recoveries));
+
+  v8::Local<v8::Array> events = Nan::New<v8::Array>(recoveryHistory.size());
+  for (size_t i = 0; i < recoveryHistory.size(); i++)
+  {
+    const RecoveryEvent &event = recoveryHistory[i];
+    v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+    Nan::Set(obj, Nan::New("time").ToLocalChecked(), Nan::New(event.time));
+    Nan::Set(obj, Nan::New("duration").ToLocalChecked(), Nan::New(event.duration));
+    Nan::Set(obj, Nan::New("success").ToLocalChecked(), Nan::New(event.success));
+    Nan::Set(obj, Nan::New("reason").ToLocalChecked(), Nan::New(event.reason).ToLocalChecked());
+    Nan::Set(obj, Nan::New("error").ToLocalChecked(), Nan::New(event.error).ToLocalChecked());
+    Nan::Set(events, (uint32_t)i, obj);
+  }
+  Nan::Set(stats, Nan::New("recoveryHistory").ToLocalChecked(), events);
+  if (tmto > 0)
+  {
+    uint64_t skipped = 0;
     {
-      return Nan::ThrowError(Nan::New("Threads must be >= 1").ToLocalChecked());
+      std::lock_guard<std::mutex> lock(threadsMutex);
+      for (auto minerThread : minerThreads)
+      {
+        skipped += minerThread->GetSkippedNonces();
+      }
     }
-    uint32_t threads = Nan::To<uint32_t>(value).FromJust();
-    if (threads < 1)
+    Nan::Set(stats, Nan::New("skippedNonces").ToLocalChecked(), Nan::New((double)skipped));
+  }
+  if (verify > 0)
+  {
+    uint64_t verified = verifiedSamples;
+    uint64_t invalid = invalidSamples;
+    v8::Local<v8::Object> verification = Nan::New<v8::Object>();
+    Nan::Set(verification, Nan::New("samples").ToLocalChecked(), Nan::New((double)verified));
+    Nan::Set(verification, Nan::New("errors").ToLocalChecked(), Nan::New((double)invalid));
+    Nan::Set(verification, Nan::New("dropped").ToLocalChecked(), Nan::New((double)droppedSamples));
+    Nan::Set(verification, Nan::New("errorRate").ToLocalChecked(), Nan::New(verified > 0 ? (double)invalid / verified : 0));
+    Nan::Set(stats, Nan::New("verification").ToLocalChecked(), verification);
+  }
+  if (profile)
+  {
+    RefProfileTotals totals;
     {
-      return Nan::ThrowError(Nan::New("Threads must be >= 1.").ToLocalChecked());
+      std::lock_guard<std::mutex> lock(threadsMutex);
+      for (auto minerThread : minerThreads)
+      {
+        minerThread->AddRefProfile(totals);
+      }
     }
-    device->threads = threads;
+
+    uint64_t refs = totals.localHits + totals.globalMisses;
+    v8::Local<v8::Object> refStats = Nan::New<v8::Object>();
+    Nan::Set(refStats, Nan::New("nonces").ToLocalChecked(), Nan::New((double)totals.nonces));
+    Nan::Set(refStats, Nan::New("localHits").ToLocalChecked(), Nan::New((double)totals.localHits));
+    Nan::Set(refStats, Nan::New("globalMisses").ToLocalChecked(), Nan::New((double)totals.globalMisses));
+    Nan::Set(refStats, Nan::New("hitRate").ToLocalChecked(), Nan::New(refs > 0 ? (double)totals.localHits / refs : 0));
+
+    v8::Local<v8::Array> offsets = Nan::New<v8::Array>(REF_PROFILE_OFFSETS + 1);
+    for (uint32_t i = 0; i <= REF_PROFILE_OFFSETS; i++)
+    {
+      Nan::Set(offsets, i, Nan::New((double)totals.offsets[i]));
+    }
+    Nan::Set(refStats, Nan::New("offsets").ToLocalChecked(), offsets);
+
+    // What other cache sizes would have hit, against the local memory they take
+    cl_ulong localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    uint32_t jobsPerBlock = (isAMD ? jobs : 1);
+    v8::Local<v8::Array> caches = Nan::New<v8::Array>();
+    uint64_t hits = totals.offsets[0];
+    for (uint32_t c = 2; c <= REF_PROFILE_OFFSETS; c++)
+    {
+      hits += totals.offsets[c - 1];
+      size_t localMemory = (size_t)c * jobsPerBlock * ARGON2_BLOCK_SIZE;
+      v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+      Nan::Set(obj, Nan::New("cache").ToLocalChecked(), Nan::New(c));
+      Nan::Set(obj, Nan::New("hitRate").ToLocalChecked(), Nan::New(refs > 0 ? (double)hits / refs : 0));
+      Nan::Set(obj, Nan::New("localMemory").ToLocalChecked(), Nan::New((double)localMemory));
+      Nan::Set(obj, Nan::New("fits").ToLocalChecked(), Nan::New(localMemory <= localMemSize));
+      Nan::Set(caches, c - 2, obj);
+    }
+    Nan::Set(refStats, Nan::New("caches").ToLocalChecked(), caches);
+
+    // Global traffic of the argon2 kernel: first 2 blocks and misses read, evicted and last blocks written,
+    // passes after the first also read the blocks they overwrite
+    uint32_t blocks = miner->GetArgon2Params().GetTrafficBlocks(cache);
+    double globalBytes = ((double)totals.nonces * blocks + totals.globalMisses) * ARGON2_BLOCK_SIZE;
+    Nan::Set(refStats, Nan::New("argon2Time").ToLocalChecked(), Nan::New(totals.argon2Time));
+    Nan::Set(refStats, Nan::New("globalBytes").ToLocalChecked(), Nan::New(globalBytes));
+    Nan::Set(refStats, Nan::New("globalBandwidth").ToLocalChecked(), Nan::New(totals.argon2Time > 0 ? globalBytes / totals.argon2Time / 1e9 : 0)); // GB/s
+
+    Nan::Set(stats, Nan::New("refProfile").ToLocalChecked(), refStats);
   }
-  else if (propertyName == "cache")
+
+  std::shared_ptr<Tuner> tuner;
   {
-    if (!value->IsUint32())
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    tuner = this->tuner;
+  }
+  if (tuner != nullptr)
+  {
+    v8::Local<v8::Object> tunerStats = Nan::New<v8::Object>();
+    tuner->FillStats(tunerStats);
+    Nan::Set(stats, Nan::New("tuner").ToLocalChecked(), tunerStats);
+  }
+}
+
+std::string Device::GetBuildOptions(uint32_t cache, uint32_t jobsPerBlock)
+{
+  std::string buildOptions = "-Werror";
+  buildOptions += " -DCACHE_SIZE=" + std::to_string(cache);
+  buildOptions += " -DJOBS_PER_BLOCK=" + std::to_string(jobsPerBlock);
+  buildOptions += " -DTHREADS_PER_LANE=" + std::to_string(threadsPerLane);
+  buildOptions += miner->GetArgon2Params().GetBuildOptions();
+  if (!isGPU)
+  {
+    buildOptions += " -DUSE_BARRIERS";
+  }
+  if (profile)
+  {
+    buildOptions += " -DPROFILE_REFS";
+  }
+  if (vectorBlake2b)
+  {
+    buildOptions += " -DBLAKE2B_VECTOR";
+  }
+  if (tmto > 0)
+  {
+    buildOptions += " -DTMTO_K=" + std::to_string(tmto);
+    buildOptions += " -DTMTO_DEPTH=" + std::to_string(TMTO_DEPTH);
+  }
+  return buildOptions;
+}
+
+uint32_t Device::ComputeHashes(work_header *blockHeader, uint32_t startNonce, std::vector<uint8_t> &hashes, KernelTimes &times)
+{
+  uint32_t currentGeneration;
+  {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    currentGeneration = generation;
+  }
+  MinerThread *minerThread = AcquireThread(currentGeneration, 0);
+  if (minerThread == nullptr)
+  {
+    throw std::runtime_error("Device is not initialized.");
+  }
+  uint32_t noncesPerRun = minerThread->GetNoncesPerRun();
+  try
+  {
+    minerThread->ComputeHashes(blockHeader, startNonce, hashes, times);
+  }
+  catch (...)
+  {
+    ReleaseThread(minerThread);
+    throw;
+  }
+  ReleaseThread(minerThread);
+  return noncesPerRun;
+}
+
+void Device::MeasureBandwidth(BandwidthReport &report)
+{
+  if (tmto > 0)
+  {
+    throw std::runtime_error("The bandwidth report doesn't model the time-memory tradeoff.");
+  }
+
+  uint32_t currentGeneration;
+  {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    currentGeneration = generation;
+  }
+  MinerThread *minerThread = AcquireThread(currentGeneration, 0);
+  if (minerThread == nullptr)
+  {
+    throw std::runtime_error("Device is not initialized.");
+  }
+  const Argon2Params &argon2Params = miner->GetArgon2Params();
+  report.noncesPerRun = minerThread->GetNoncesPerRun();
+  try
+  {
+    minerThread->MeasureCopyBandwidth(program, &report.copyBytes, &report.copyTime);
+
+    work_header blockHeader;
+    memset(&blockHeader, 0, sizeof(blockHeader));
+    blockHeader.length = argon2Params.headerLength;
+    std::vector<uint8_t> hashes;
+    minerThread->ComputeHashes(&blockHeader, 0, hashes, report.times);
+  }
+  catch (...)
+  {
+    ReleaseThread(minerThread);
+    throw;
+  }
+  ReleaseThread(minerThread);
+
+  RefProfileTotals totals;
+  if (profile)
+  {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    for (auto minerThread : minerThreads)
     {
-      return Nan::ThrowError(Nan::New("Cache must be >= 2.").ToLocalChecked());
+      minerThread->AddRefProfile(totals);
     }
-    uint32_t cache = Nan::To<uint32_t>(value).FromJust();
-    if (cache < 2)
+  }
+  report.refMissesMeasured = (totals.nonces > 0);
+  report.refMisses = report.refMissesMeasured ? (double)totals.globalMisses / totals.nonces : argon2Params.GetExpectedRefMisses(cache);
+
+  double nonces = report.noncesPerRun;
+  report.initMemoryBytes = nonces * 2 * ARGON2_BLOCK_SIZE;
+  report.argon2Bytes = nonces * (argon2Params.GetTrafficBlocks(cache) + report.refMisses) * ARGON2_BLOCK_SIZE;
+  report.getHashesBytes = nonces * (ARGON2_BLOCK_SIZE + ARGON2_HASH_LENGTH);
+}
+
+/*
+* MinerThread
+*/
+MinerThread::MinerThread(Miner *miner, uint32_t threadIndex, uint32_t noncesPerRun,
+                         cl::CommandQueue queue, cl::Buffer memInitialSeed, cl::Buffer memArgon2, cl::Buffer memNonce, cl::Buffer memHashes,
+                         cl::Kernel kernelInitMemory, cl::Kernel kernelArgon2, cl::Kernel kernelGetNonce, cl::Kernel kernelGetHashes,
+                         cl::NDRange globalInitMemory, cl::NDRange localInitMemory,
+                         cl::NDRange globalArgon2, cl::NDRange localArgon2,
+                         cl::NDRange globalGetNonce, cl::NDRange localGetNonce)
+    : miner(miner), threadIndex(threadIndex), noncesPerRun(noncesPerRun), stopped(false), batchStart(0), averageBatchTime(0), skippedNonces(0),
+      queue(queue), memInitialSeed(memInitialSeed), memArgon2(memArgon2), memNonce(memNonce), memHashes(memHashes),
+      kernelInitMemory(kernelInitMemory), kernelArgon2(kernelArgon2), kernelGetNonce(kernelGetNonce), kernelGetHashes(kernelGetHashes),
+      globalInitMemory(globalInitMemory), localInitMemory(localInitMemory),
+      globalArgon2(globalArgon2), localArgon2(localArgon2),
+      globalGetNonce(globalGetNonce), localGetNonce(localGetNonce)
+{
+}
+
+MinerThread::~MinerThread()
+{
+  if (control != nullptr)
+  {
+    try
+    {
+      queue.enqueueUnmapMemObject(memControl, (void *)control);
+      queue.finish();
+    }
+    catch (cl::Error &)
+    {
+      // Device failed, nothing left to unmap
+    }
+  }
+}
+
+uint32_t MinerThread::GetThreadIndex()
+{
+  return threadIndex;
+}
+
+uint32_t MinerThread::GetNoncesPerRun()
+{
+  return noncesPerRun;
+}
+
+cl::Buffer MinerThread::GetArgon2Buffer()
+{
+  return memArgon2;
+}
+
+void MinerThread::Stop()
+{
+  stopped = true;
+}
+
+void MinerThread::BeginBatch()
+{
+  batchStart = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void MinerThread::EndBatch(bool measured)
+{
+  if (measured)
+  {
+    double batchTime = GetBatchRunningTime();
+    double average = averageBatchTime;
+    averageBatchTime = (average == 0) ? batchTime : 0.8 * average + 0.2 * batchTime;
+  }
+  batchStart = 0;
+}
+
+double MinerThread::GetBatchRunningTime()
+{
+  int64_t start = batchStart;
+  if (start == 0)
+  {
+    return 0;
+  }
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  return (now - start) / 1e9;
+}
+
+double MinerThread::GetAverageBatchTime()
+{
+  return averageBatchTime;
+}
+
+uint64_t MinerThread::GetSkippedNonces()
+{
+  return skippedNonces;
+}
+
+void MinerThread::EnablePersistentMode(cl::Kernel kernelPersistent, cl::Buffer memControl, cl::Buffer memNextJob)
+{
+  this->kernelPersistent = kernelPersistent;
+  this->memControl = memControl;
+  this->memNextJob = memNextJob;
+  // Stays mapped, the host polls it while the kernel runs
+  control = (persistent_control *)queue.enqueueMapBuffer(memControl, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(persistent_control));
+}
+
+void MinerThread::SetTuner(std::shared_ptr<Tuner> tuner)
+{
+  this->tuner = tuner;
+  variantKernels.push_back(kernelArgon2);
+  variantLocalArgon2.push_back(localArgon2);
+}
+
+void MinerThread::SelectArgon2Variant(size_t variant)
+{
+  // Kernels for variants built since the last batch
+  while (variantKernels.size() <= variant)
+  {
+    KernelVariant kernelVariant = tuner->GetVariant(variantKernels.size());
+    cl::Kernel kernel = cl::Kernel(kernelVariant.program, "argon2");
+    kernel.setArg(0, (size_t)kernelVariant.cache * kernelVariant.jobs * ARGON2_BLOCK_SIZE, NULL);
+    kernel.setArg(1, memArgon2);
+    variantKernels.push_back(kernel);
+    variantLocalArgon2.push_back(cl::NDRange(globalArgon2[0], kernelVariant.jobs));
+  }
+  kernelArgon2 = variantKernels[variant];
+  localArgon2 = variantLocalArgon2[variant];
+}
+
+void MinerThread::EnableRefProfile(cl::Buffer memRefProfile)
+{
+  ref_profile counts;
+  memset(&counts, 0, sizeof(counts));
+  queue.enqueueWriteBuffer(memRefProfile, CL_TRUE, 0, sizeof(ref_profile), &counts);
+
+  this->memRefProfile = memRefProfile;
+  kernelArgon2.setArg(2, memRefProfile);
+  refProfiling = true;
+}
+
+void MinerThread::EnableTracing(Tracer *tracer, uint32_t pid)
+{
+  this->tracer = tracer;
+  tracePid = pid;
+}
+
+void MinerThread::EnableVerification(Device *device, cl::Buffer memSamples, uint32_t samples, bool tmto)
+{
+  this->device = device;
+  this->memSamples = memSamples;
+  this->samples = samples;
+  sampleSkips = tmto;
+  sampleHashes.resize((size_t)samples * ARGON2_HASH_LENGTH);
+  sampleRandom.seed(std::random_device()() + threadIndex);
+  kernelGetNonce.setArg(5, samples);
+}
+
+bool MinerThread::IsTracing()
+{
+  return tracer != nullptr && tracer->IsActive();
+}
+
+// Profiling timestamps come from the device clock, they are aligned to the host
+// clock at the end of the last command, which the host has just waited for
+void MinerThread::TraceCommands(const std::vector<TracedCommand> &commands, int64_t hostEnd)
+{
+  int64_t offset = hostEnd - (int64_t)commands.back().event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+  for (auto const &command : commands)
+  {
+    int64_t start = (int64_t)command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>() + offset;
+    int64_t end = (int64_t)command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>() + offset;
+    tracer->Span(command.name, command.category, tracePid, TRACE_TID_QUEUE + threadIndex, start, end);
+  }
+}
+
+void MinerThread::CollectRefProfile(const cl::Event &argon2Event)
+{
+  ref_profile counts;
+  queue.enqueueReadBuffer(memRefProfile, CL_TRUE, 0, sizeof(ref_profile), &counts);
+  ref_profile zeroCounts;
+  memset(&zeroCounts, 0, sizeof(zeroCounts));
+  queue.enqueueWriteBuffer(memRefProfile, CL_TRUE, 0, sizeof(ref_profile), &zeroCounts);
+
+  cl_ulong start = argon2Event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+  cl_ulong end = argon2Event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+  std::lock_guard<std::mutex> lock(refProfileMutex);
+  refProfile.localHits += counts.local_hits;
+  refProfile.globalMisses += counts.global_misses;
+  for (uint32_t i = 0; i <= REF_PROFILE_OFFSETS; i++)
+  {
+    refProfile.offsets[i] += counts.offsets[i];
+  }
+  refProfile.nonces += noncesPerRun;
+  refProfile.argon2Time += (end - start) / 1e9;
+}
+
+void MinerThread::AddRefProfile(RefProfileTotals &totals)
+{
+  std::lock_guard<std::mutex> lock(refProfileMutex);
+  totals.localHits += refProfile.localHits;
+  totals.globalMisses += refProfile.globalMisses;
+  for (uint32_t i = 0; i <= REF_PROFILE_OFFSETS; i++)
+  {
+    totals.offsets[i] += refProfile.offsets[i];
+  }
+  totals.nonces += refProfile.nonces;
+  totals.argon2Time += refProfile.argon2Time;
+}
+
+void MinerThread::SetBlockHeader(work_header *blockHeader)
+{
+  int64_t traceStart = Tracer::Now();
+  // Must outlive the non-blocking write, which is flushed by the blocking one below
+  std::vector<uint8_t> inseed = miner->GetArgon2Params().GetInitialSeed(blockHeader);
+  header = *blockHeader;
+
+  queue.enqueueWriteBuffer(memInitialSeed, CL_FALSE, 0, inseed.size(), inseed.data());
+  queue.enqueueWriteBuffer(memNonce, CL_TRUE, 0, sizeof(zeroNonce), zeroNonce);
+
+  if (IsTracing())
+  {
+    tracer->Span("set header", "transfer", tracePid, threadIndex, traceStart, Tracer::Now());
+  }
+}
+
+void MinerThread::WarmUp()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  work_header blockHeader;
+  memset(&blockHeader, 0, sizeof(blockHeader));
+  blockHeader.length = miner->GetArgon2Params().headerLength;
+  SetBlockHeader(&blockHeader);
+
+  uint32_t skipped;
+  bool block;
+  uint32_t share;
+  int64_t found;
+  MineNonces(0, WARMUP_SHARE_COMPACT, 0, &skipped, &block, &share, &found);
+  queue.enqueueWriteBuffer(memNonce, CL_TRUE, 0, sizeof(zeroNonce), zeroNonce);
+}
+
+// Returns the nonce that met the highest target, share is set to another nonce of the batch that only met the share target
+uint32_t MinerThread::MineNonces(uint32_t startNonce, uint32_t shareCompact, uint32_t blockCompact, uint32_t *skipped, bool *block, uint32_t *share, int64_t *readTime)
+{
+  BeginBatch();
+  bool traced = IsTracing();
+  int64_t traceStart = traced ? Tracer::Now() : 0;
+  cl::Event initEvent, argon2Event, getNonceEvent, readEvent, resetEvent;
+
+  // Initialize memory
+  kernelInitMemory.setArg(2, startNonce);
+  queue.enqueueNDRangeKernel(kernelInitMemory, cl::NullRange, globalInitMemory, localInitMemory, NULL, traced ? &initEvent : NULL);
+
+  // Compute Argon2d hashes
+  queue.enqueueNDRangeKernel(kernelArgon2, cl::NullRange, globalArgon2, localArgon2, NULL, (refProfiling || traced) ? &argon2Event : NULL);
+
+  // Is there PoW?
+  kernelGetNonce.setArg(1, startNonce);
+  kernelGetNonce.setArg(2, shareCompact);
+  kernelGetNonce.setArg(3, blockCompact);
+  uint32_t sampleInterval = (samples > 0) ? noncesPerRun / samples : 0;
+  uint32_t sampleOffset = (samples > 0) ? sampleRandom() % sampleInterval : 0;
+  if (samples > 0)
+  {
+    kernelGetNonce.setArg(6, sampleOffset);
+  }
+  queue.enqueueNDRangeKernel(kernelGetNonce, cl::NullRange, globalGetNonce, localGetNonce, NULL, traced ? &getNonceEvent : NULL);
+
+  // TODO: Handle kernel error
+
+  // Completed by the blocking read below
+  if (samples > 0)
+  {
+    queue.enqueueReadBuffer(memSamples, CL_FALSE, 0, sampleHashes.size(), sampleHashes.data());
+  }
+
+  cl_uint found[3];
+  queue.enqueueReadBuffer(memNonce, CL_TRUE, 0, sizeof(found), found, NULL, traced ? &readEvent : NULL);
+  *readTime = Tracer::Now();
+
+  bool reset = (found[0] > 0 || found[1] > 0 || found[2] > 0);
+  if (reset)
+  {
+    queue.enqueueWriteBuffer(memNonce, CL_TRUE, 0, sizeof(zeroNonce), zeroNonce, NULL, traced ? &resetEvent : NULL);
+  }
+  *skipped = found[1];
+  *block = (found[2] > 0);
+  *share = (*block && found[0] != found[2]) ? found[0] : 0;
+
+  if (traced)
+  {
+    std::vector<TracedCommand> commands = {
+        {"init_memory", "kernel", initEvent},
+        {"argon2", "kernel", argon2Event},
+        {"get_nonce", "kernel", getNonceEvent},
+        {"read nonce", "transfer", readEvent}};
+    if (reset)
     {
-      return Nan::ThrowError(Nan::New("Cache must be >= 2.").ToLocalChecked());
+      commands.push_back({"reset nonce", "transfer", resetEvent});
     }
-    device->cache = cache;
+    int64_t traceEnd = Tracer::Now();
+    TraceCommands(commands, traceEnd);
+    tracer->Span("batch", "host", tracePid, threadIndex, traceStart, traceEnd, "\"startNonce\": " + std::to_string(startNonce));
   }
-  else if (propertyName == "jobs")
+
+  if (refProfiling)
   {
-    if (!value->IsUint32())
+    CollectRefProfile(argon2Event);
+  }
+
+  if (samples > 0 && shareCompact != WARMUP_SHARE_COMPACT)
+  {
+    std::vector<Verifier::Sample> batchSamples;
+    batchSamples.reserve(samples);
+    for (uint32_t i = 0; i < samples; i++)
     {
-      return Nan::ThrowError(Nan::New("Jobs must be >= 1.").ToLocalChecked());
+      Verifier::Sample sample;
+      sample.device = device;
+      sample.nonce = startNonce + i * sampleInterval + sampleOffset;
+      memcpy(sample.hash, &sampleHashes[(size_t)i * ARGON2_HASH_LENGTH], ARGON2_HASH_LENGTH);
+      // Skipped by the time-memory tradeoff, without it a zero hash is verified like any other and counts as wrong
+      if (sampleSkips && std::all_of(sample.hash, sample.hash + ARGON2_HASH_LENGTH, [](uint8_t byte) { return byte == 0; }))
+      {
+        continue;
+      }
+      batchSamples.push_back(sample);
     }
-    uint32_t jobs = Nan::To<uint32_t>(value).FromJust();
-    if (jobs < 1)
+    uint32_t dropped = miner->GetVerifier().Submit(header, batchSamples);
+    if (dropped > 0)
     {
-      return Nan::ThrowError(Nan::New("Jobs must be >= 1.").ToLocalChecked());
+      device->ReportDroppedSamples(dropped);
     }
-    device->jobs = jobs;
   }
+
+  EndBatch(true);
+  return *block ? found[2] : found[0]; // the highest target met
 }
 
-bool Device::IsEnabled()
+void MinerThread::ComputeHashes(work_header *blockHeader, uint32_t startNonce, std::vector<uint8_t> &hashes, KernelTimes &times)
 {
-  return enabled;
+  std::lock_guard<std::mutex> lock(mutex);
+
+  SetBlockHeader(blockHeader);
+
+  // Waits for each kernel, so that the BLAKE2b phases can be timed apart from the Argon2 loop
+  BeginBatch();
+  int64_t start = Tracer::Now();
+  kernelInitMemory.setArg(2, startNonce);
+  queue.enqueueNDRangeKernel(kernelInitMemory, cl::NullRange, globalInitMemory, localInitMemory);
+  queue.finish();
+  int64_t initEnd = Tracer::Now();
+  queue.enqueueNDRangeKernel(kernelArgon2, cl::NullRange, globalArgon2, localArgon2);
+  queue.finish();
+  int64_t argon2End = Tracer::Now();
+  queue.enqueueNDRangeKernel(kernelGetHashes, cl::NullRange, globalGetNonce, localGetNonce);
+  queue.finish();
+  int64_t end = Tracer::Now();
+  times.initMemory = (initEnd - start) / 1e6;
+  times.argon2 = (argon2End - initEnd) / 1e6;
+  times.getHashes = (end - argon2End) / 1e6;
+
+  hashes.resize((size_t)noncesPerRun * ARGON2_HASH_LENGTH);
+  queue.enqueueReadBuffer(memHashes, CL_TRUE, 0, hashes.size(), hashes.data());
+  EndBatch(false);
 }
 
-uint32_t Device::GetDeviceIndex()
+// Streams the first half of the Argon2 buffer into the second half
+void MinerThread::MeasureCopyBandwidth(const cl::Program &program, double *bytes, double *time)
 {
-  return deviceIndex;
+  std::lock_guard<std::mutex> lock(mutex);
+
+  cl_uint half = (cl_uint)(memArgon2.getInfo<CL_MEM_SIZE>() / 2 / COPY_VECTOR_SIZE);
+  cl::Kernel kernelCopy = cl::Kernel(program, "copy_stream");
+  kernelCopy.setArg(0, memArgon2);
+  kernelCopy.setArg(1, half);
+
+  queue.enqueueNDRangeKernel(kernelCopy, cl::NullRange, cl::NDRange(half), cl::NullRange); // warm-up
+  queue.finish();
+  int64_t start = Tracer::Now();
+  for (uint32_t i = 0; i < COPY_RUNS; i++)
+  {
+    queue.enqueueNDRangeKernel(kernelCopy, cl::NullRange, cl::NDRange(half), cl::NullRange);
+  }
+  queue.finish();
+  *time = (Tracer::Now() - start) / 1e6;
+  *bytes = 2.0 * half * COPY_VECTOR_SIZE * COPY_RUNS;
 }
 
-void Device::Initialize()
+void MinerThread::MineNonces(uint32_t workId, work_header *blockHeader, const MinerProgress &progress)
 {
-  size_t memSize = (size_t)memory * ONE_MB;
-  // Autoconfig memory size
-  if (memSize == 0)
+  int64_t waitStart = Tracer::Now();
+  std::lock_guard<std::mutex> lock(mutex);
+  if (IsTracing())
   {
-    cl_ulong globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    tracer->Span("wait mutex", "host", tracePid, threadIndex, waitStart, Tracer::Now(), "\"workId\": " + std::to_string(workId));
+  }
 
-    memSize = (globalMemSize / ONE_GB - 1) * ONE_GB / threads;
-    if (isAMD)
+  SetBlockHeader(blockHeader);
+  uint32_t blockCompact = Miner::GetBlockCompact(blockHeader);
+  uint64_t headerHash = Miner::HashBlockHeader(blockHeader);
+
+  if (control != nullptr)
+  {
+    MineNoncesPersistent(workId, headerHash, blockCompact, progress);
+    return;
+  }
+
+  while (miner->IsMiningEnabled() && !stopped)
+  {
+    if (workId != miner->GetWorkId())
     {
-      cl_ulong maxMemAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
-      if (memSize > maxMemAllocSize)
+      break;
+    }
+    uint32_t startNonce;
+    if (!miner->GetNextStartNonce(noncesPerRun, &startNonce))
+    {
+      if (miner->IsWaitingForLeases())
       {
-        memSize = (maxMemAllocSize / ONE_GB) * ONE_GB;
+        std::this_thread::sleep_for(std::chrono::milliseconds(LEASE_WAIT_INTERVAL));
+        continue;
       }
+      break;
     }
-  }
 
-  uint32_t noncesPerRun = memSize / (ARGON2_BLOCK_SIZE * NIMIQ_ARGON2_COST);
+    // Batches are independent, so the argon2 kernel can be swapped between them
+    size_t variant = 0;
+    if (tuner != nullptr)
+    {
+      variant = tuner->SelectVariant();
+      SelectArgon2Variant(variant);
+    }
+    auto batchStart = std::chrono::steady_clock::now();
 
-  cl_uint jobsPerBlock = (isAMD ? jobs : 1);
-  size_t shmemSize = cache * jobsPerBlock * ARGON2_BLOCK_SIZE;
+    MinerResult result;
+    result.shareCompact = miner->GetShareCompact();
+    uint32_t skipped;
+    uint32_t share;
+    result.nonce = MineNonces(startNonce, result.shareCompact, blockCompact, &skipped, &result.block, &share, &result.found);
+    result.hashes = noncesPerRun - skipped;
+    skippedNonces += skipped;
+    miner->ReportCoverage(workId, headerHash, startNonce, noncesPerRun);
+    result.sent = Tracer::Now();
 
-  // printf("Mem size: %lu, nonces per run: %u, jobs: %u, cache: %u, shared mem size: %lu\n", memSize, noncesPerRun, jobsPerBlock, cache, shmemSize);
+    if (tuner != nullptr)
+    {
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+      tuner->Report(variant, noncesPerRun / seconds);
+    }
+    progress.Send(&result, 1);
 
-  context = cl::Context(device);
+    // The block goes out first, a share of the same batch follows without hashes of its own
+    if (share > 0)
+    {
+      MinerResult shareResult = result;
+      shareResult.nonce = share;
+      shareResult.block = false;
+      shareResult.hashes = 0;
+      progress.Send(&shareResult, 1);
+    }
+  }
+}
 
-  cl::Program::Sources sources{
-      std::make_pair(srcArgon2d.c_str(), srcArgon2d.size()),
-      std::make_pair(srcBlake2b.c_str(), srcBlake2b.size())};
+void MinerThread::MineNoncesPersistent(uint32_t workId, uint64_t headerHash, uint32_t blockCompact, const MinerProgress &progress)
+{
+  uint32_t chunkSize = noncesPerRun * PERSISTENT_CHUNK_RUNS;
 
-  program = cl::Program(context, sources);
-  try
+  while (miner->IsMiningEnabled() && workId == miner->GetWorkId() && !stopped)
   {
-    std::string buildOptions = "-Werror";
-    buildOptions += " -DCACHE_SIZE=" + std::to_string(cache);
-    buildOptions += " -DJOBS_PER_BLOCK=" + std::to_string(jobsPerBlock);
+    uint32_t startNonce;
+    if (!miner->GetNextStartNonce(chunkSize, &startNonce))
+    {
+      if (miner->IsWaitingForLeases())
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(LEASE_WAIT_INTERVAL));
+        continue;
+      }
+      break;
+    }
+    uint32_t shareCompact = miner->GetShareCompact();
 
-    // printf("Build options: `%s`\n", buildOptions.c_str());
-    program.build(buildOptions.c_str());
-  }
-  catch (cl::Error &error)
-  {
-    std::string buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-    std::cerr << buildLog << std::endl;
-    throw;
-  }
+    // The mapped view is only a hint while the kernel runs, the device copy is reset by a real transfer.
+    // The host side is cleared as well, so that a driver with a separate copy doesn't show the last chunk.
+    control->stop = 0;
+    control->done = 0;
+    control->results = 0;
+    control->block = 0;
+    for (uint32_t i = 0; i < PERSISTENT_MAX_RESULTS; i++)
+    {
+      control->nonces[i] = 0;
+    }
+    queue.enqueueWriteBuffer(memControl, CL_FALSE, 0, sizeof(persistent_control), &zeroControl);
+    queue.enqueueWriteBuffer(memNextJob, CL_FALSE, 0, sizeof(cl_uint), &zero);
 
-  for (uint32_t threadIndex = 0; threadIndex < threads; threadIndex++)
-  {
-    cl::CommandQueue queue = cl::CommandQueue(context, device);
+    kernelPersistent.setArg(5, (cl_uint)startNonce);
+    kernelPersistent.setArg(6, chunkSize);
+    kernelPersistent.setArg(7, shareCompact);
+    kernelPersistent.setArg(8, blockCompact);
 
-    cl::Buffer memInitialSeed = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(initial_seed));
-    cl::Buffer memArgon2 = cl::Buffer(context, CL_MEM_READ_WRITE, memSize);
-    cl::Buffer memNonce = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+    BeginBatch();
+    int64_t traceStart = Tracer::Now();
+    cl::Event event;
+    queue.enqueueNDRangeKernel(kernelPersistent, cl::NullRange, globalArgon2, localArgon2, NULL, &event);
+    queue.flush();
 
-    cl::Kernel kernelInitMemory = cl::Kernel(program, "init_memory");
-    kernelInitMemory.setArg(0, memArgon2);
-    kernelInitMemory.setArg(1, memInitialSeed);
+    // The kernel always ends with its chunk, the stop flag may make block switches faster where the
+    // driver makes the mapped buffer visible to it. What the host reads from the mapping while the kernel
+    // runs is an early signal only, the final counts and results come from a read after it completed.
+    uint32_t reportedHashes = 0;
+    uint32_t reportedResults = 0;
+    bool blockReported = false;
+    bool complete = false;
+    persistent_control final;
+    const volatile persistent_control *view = control;
+    while (!complete)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(PERSISTENT_POLL_INTERVAL));
 
-    cl::Kernel kernelArgon2 = cl::Kernel(program, "argon2");
-    kernelArgon2.setArg(0, shmemSize, NULL);
-    kernelArgon2.setArg(1, memArgon2);
+      complete = (event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() <= CL_COMPLETE);
+      if (complete)
+      {
+        event.wait(); // throws if the kernel failed
+        queue.enqueueReadBuffer(memControl, CL_TRUE, 0, sizeof(persistent_control), &final);
+        view = &final;
+      }
+      else if (!miner->IsMiningEnabled() || workId != miner->GetWorkId() || stopped)
+      {
+        control->stop = 1;
+      }
 
-    cl::Kernel kernelGetNonce = cl::Kernel(program, "get_nonce");
-    kernelGetNonce.setArg(0, memArgon2);
-    kernelGetNonce.setArg(3, memNonce);
+      MinerResult result;
+      result.shareCompact = shareCompact;
+      result.nonce = 0;
+      result.block = false;
+      // Counts read through the mapping may be stale, they never take back what was reported
+      result.hashes = (view->done > reportedHashes) ? view->done - reportedHashes : 0;
+      result.found = Tracer::Now();
 
-    cl::NDRange globalInitMemory = cl::NDRange(noncesPerRun, 2);
-    cl::NDRange localInitMemory = cl::NDRange(128, 2);
+      // Ahead of the shares of the chunk
+      if (!blockReported && view->block != 0)
+      {
+        blockReported = true;
+        result.nonce = view->block;
+        result.block = true;
+        reportedHashes += result.hashes;
+        result.sent = Tracer::Now();
+        progress.Send(&result, 1);
+        result.block = false;
+        result.hashes = 0;
+      }
 
-    cl::NDRange globalArgon2 = cl::NDRange(THREADS_PER_LANE, noncesPerRun);
-    cl::NDRange localArgon2 = cl::NDRange(THREADS_PER_LANE, jobsPerBlock);
+      uint32_t results = std::min((uint32_t)view->results, (uint32_t)PERSISTENT_MAX_RESULTS);
+      while (reportedResults < results)
+      {
+        uint32_t nonce = view->nonces[reportedResults];
+        if (nonce == 0 && !complete)
+        {
+          break; // counted, but not written yet
+        }
+        reportedResults++;
+        result.nonce = nonce;
+        reportedHashes += result.hashes;
+        result.sent = Tracer::Now();
+        progress.Send(&result, 1);
+        result.hashes = 0;
+      }
 
-    cl::NDRange globalGetNonce = cl::NDRange(noncesPerRun);
-    cl::NDRange localGetNonce = cl::NDRange(256);
+      if (result.hashes >= noncesPerRun || (complete && result.hashes > 0))
+      {
+        result.nonce = 0;
+        reportedHashes += result.hashes;
+        result.sent = Tracer::Now();
+        progress.Send(&result, 1);
+      }
+    }
+    // Chunks cut short by a new block say nothing about the duration and aren't covered. The device copy
+    // tells whether the kernel could have seen the stop flag, without it the whole chunk was mined.
+    bool chunkDone = (final.stop == 0);
+    EndBatch(chunkDone);
+    if (chunkDone)
+    {
+      miner->ReportCoverage(workId, headerHash, startNonce, chunkSize);
+    }
 
-    minerThreads.push_back(new MinerThread(miner, threadIndex, noncesPerRun,
-                                           queue, memInitialSeed, memArgon2, memNonce,
-                                           kernelInitMemory, kernelArgon2, kernelGetNonce,
-                                           globalInitMemory, localInitMemory,
-                                           globalArgon2, localArgon2,
-                                           globalGetNonce, localGetNonce));
+    // Completion is polled, the kernel may have ended up to a poll interval before traceEnd
+    if (IsTracing())
+    {
+      int64_t traceEnd = Tracer::Now();
+      TraceCommands({{"mine_persistent", "kernel", event}}, traceEnd);
+      tracer->Span("chunk", "host", tracePid, threadIndex, traceStart, traceEnd, "\"startNonce\": " + std::to_string(startNonce));
+    }
   }
 }
 
-void Device::StartMiningOnBlock(const v8::Local<v8::Function> &cbFunc, uint32_t workId, nimiq_block_header *blockHeader)
+/*
+* HashWorker
+*/
+
+HashWorker::HashWorker(Nan::Callback *callback, Device *device, work_header blockHeader, uint32_t startNonce)
+    : AsyncWorker(callback), device(device), blockHeader(blockHeader), startNonce(startNonce)
 {
-  Nan::HandleScope scope;
+}
 
-  for (auto minerThread : minerThreads)
+void HashWorker::Execute()
+{
+  try
+  {
+    noncesPerRun = device->ComputeHashes(&blockHeader, startNonce, hashes, times);
+  }
+  catch (std::exception &e)
   {
-    Nan::AsyncQueueWorker(new MinerWorker(new Nan::Callback(cbFunc), this, minerThread, workId, *blockHeader));
+    SetErrorMessage(e.what());
   }
 }
 
+void HashWorker::HandleOKCallback()
+{
+  Nan::HandleScope scope;
+
+  v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+  Nan::Set(obj, Nan::New("device").ToLocalChecked(), Nan::New(device->GetDeviceIndex()));
+  Nan::Set(obj, Nan::New("startNonce").ToLocalChecked(), Nan::New(startNonce));
+  Nan::Set(obj, Nan::New("noncesPerRun").ToLocalChecked(), Nan::New(noncesPerRun));
+  Nan::Set(obj, Nan::New("hashes").ToLocalChecked(), Nan::CopyBuffer((const char *)hashes.data(), hashes.size()).ToLocalChecked());
+
+  v8::Local<v8::Object> kernelTimes = Nan::New<v8::Object>();
+  Nan::Set(kernelTimes, Nan::New("initMemory").ToLocalChecked(), Nan::New(times.initMemory));
+  Nan::Set(kernelTimes, Nan::New("argon2").ToLocalChecked(), Nan::New(times.argon2));
+  Nan::Set(kernelTimes, Nan::New("getHashes").ToLocalChecked(), Nan::New(times.getHashes));
+  Nan::Set(obj, Nan::New("kernelTimes").ToLocalChecked(), kernelTimes);
+
+  v8::Local<v8::Value> argv[] = {Nan::Null(), obj};
+  callback->Call(2, argv, async_resource);
+}
+
 /*
-* MinerThread
+* BandwidthWorker
 */
-MinerThread::MinerThread(Miner *miner, uint32_t threadIndex, uint32_t noncesPerRun,
-                         cl::CommandQueue queue, cl::Buffer memInitialSeed, cl::Buffer memArgon2, cl::Buffer memNonce,
-                         cl::Kernel kernelInitMemory, cl::Kernel kernelArgon2, cl::Kernel kernelGetNonce,
-                         cl::NDRange globalInitMemory, cl::NDRange localInitMemory,
-                         cl::NDRange globalArgon2, cl::NDRange localArgon2,
-                         cl::NDRange globalGetNonce, cl::NDRange localGetNonce)
-    : miner(miner), threadIndex(threadIndex), noncesPerRun(noncesPerRun),
-      queue(queue), memInitialSeed(memInitialSeed), memArgon2(memArgon2), memNonce(memNonce),
-      kernelInitMemory(kernelInitMemory), kernelArgon2(kernelArgon2), kernelGetNonce(kernelGetNonce),
-      globalInitMemory(globalInitMemory), localInitMemory(localInitMemory),
-      globalArgon2(globalArgon2), localArgon2(localArgon2),
-      globalGetNonce(globalGetNonce), localGetNonce(localGetNonce)
+
+BandwidthWorker::BandwidthWorker(Nan::Callback *callback, Device *device)
+    : AsyncWorker(callback), device(device)
 {
 }
 
-uint32_t MinerThread::GetThreadIndex()
+void BandwidthWorker::Execute()
 {
-  return threadIndex;
+  try
+  {
+    device->MeasureBandwidth(report);
+  }
+  catch (std::exception &e)
+  {
+    SetErrorMessage(e.what());
+  }
 }
 
-uint32_t MinerThread::GetNoncesPerRun()
+v8::Local<v8::Object> BandwidthWorker::Entry(double bytes, double time)
 {
-  return noncesPerRun;
+  v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+  Nan::Set(obj, Nan::New("bytes").ToLocalChecked(), Nan::New(bytes));
+  Nan::Set(obj, Nan::New("time").ToLocalChecked(), Nan::New(time));
+  Nan::Set(obj, Nan::New("bandwidth").ToLocalChecked(), Nan::New(time > 0 ? bytes / time / 1e6 : 0)); // GB/s
+  return obj;
 }
 
-void MinerThread::SetBlockHeader(nimiq_block_header *blockHeader)
+void BandwidthWorker::HandleOKCallback()
 {
-  initial_seed inseed;
-  inseed.lanes = 1;
-  inseed.hash_len = ARGON2_HASH_LENGTH;
-  inseed.memory_cost = NIMIQ_ARGON2_COST;
-  inseed.iterations = 1;
-  inseed.version = 0x13;
-  inseed.type = 0;
-  inseed.header_len = sizeof(nimiq_block_header);
-  memcpy(&inseed.header, blockHeader, sizeof(nimiq_block_header));
-  inseed.salt_len = NIMIQ_ARGON2_SALT_LEN;
-  memcpy(&inseed.salt, NIMIQ_ARGON2_SALT, NIMIQ_ARGON2_SALT_LEN);
-  inseed.secret_len = 0;
-  inseed.extra_len = 0;
-  memset(&inseed.padding, 0, sizeof(inseed.padding));
+  Nan::HandleScope scope;
+
+  v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+  Nan::Set(obj, Nan::New("device").ToLocalChecked(), Nan::New(device->GetDeviceIndex()));
+  Nan::Set(obj, Nan::New("noncesPerRun").ToLocalChecked(), Nan::New(report.noncesPerRun));
+  Nan::Set(obj, Nan::New("copy").ToLocalChecked(), Entry(report.copyBytes, report.copyTime));
+  Nan::Set(obj, Nan::New("initMemory").ToLocalChecked(), Entry(report.initMemoryBytes, report.times.initMemory));
+  v8::Local<v8::Object> argon2 = Entry(report.argon2Bytes, report.times.argon2);
+  Nan::Set(argon2, Nan::New("refMisses").ToLocalChecked(), Nan::New(report.refMisses));
+  Nan::Set(argon2, Nan::New("refMissesMeasured").ToLocalChecked(), Nan::New(report.refMissesMeasured));
+  Nan::Set(obj, Nan::New("argon2").ToLocalChecked(), argon2);
+  Nan::Set(obj, Nan::New("getHashes").ToLocalChecked(), Entry(report.getHashesBytes, report.times.getHashes));
 
-  queue.enqueueWriteBuffer(memInitialSeed, CL_FALSE, 0, sizeof(initial_seed), &inseed);
-  queue.enqueueWriteBuffer(memNonce, CL_TRUE, 0, sizeof(cl_uint), &zero);
+  v8::Local<v8::Value> argv[] = {Nan::Null(), obj};
+  callback->Call(2, argv, async_resource);
 }
 
-uint32_t MinerThread::MineNonces(uint32_t startNonce, uint32_t shareCompact)
+/*
+* DeviceWorker
+*/
+
+DeviceWorker::DeviceWorker(Nan::Callback *callback, Miner *miner, Device *device, Action action)
+    : AsyncWorker(callback), miner(miner), device(device), action(action)
 {
-  // Initialize memory
-  kernelInitMemory.setArg(2, startNonce);
-  queue.enqueueNDRangeKernel(kernelInitMemory, cl::NullRange, globalInitMemory, localInitMemory);
+}
 
-  // Compute Argon2d hashes
-  queue.enqueueNDRangeKernel(kernelArgon2, cl::NullRange, globalArgon2, localArgon2);
+void DeviceWorker::Execute()
+{
+  auto start = std::chrono::steady_clock::now();
+  try
+  {
+    if (action != INITIALIZE)
+    {
+      // Reconfiguration keeps the context, program and Argon2 buffers for reuse,
+      // recovery starts over with a new context and doesn't wait for hung threads
+      device->Free(action == RECONFIGURE, action == RECOVER);
+    }
+    if (action != FREE && device->IsEnabled())
+    {
+      device->Initialize();
+    }
+  }
+  catch (std::exception &e)
+  {
+    SetErrorMessage(e.what());
+  }
+  time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-  // Is there PoW?
-  kernelGetNonce.setArg(1, startNonce);
-  kernelGetNonce.setArg(2, shareCompact);
-  queue.enqueueNDRangeKernel(kernelGetNonce, cl::NullRange, globalGetNonce, localGetNonce);
+void DeviceWorker::HandleOKCallback()
+{
+  Nan::HandleScope scope;
 
-  // TODO: Handle kernel error
+  v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+  Nan::Set(obj, Nan::New("device").ToLocalChecked(), Nan::New(device->GetDeviceIndex()));
+  Nan::Set(obj, Nan::New("time").ToLocalChecked(), Nan::New(time));
 
-  cl_uint nonce;
-  queue.enqueueReadBuffer(memNonce, CL_TRUE, 0, sizeof(cl_uint), &nonce);
+  if (action == RECOVER)
+  {
+    device->EndRecovery(true, time, "");
+    Nan::Set(obj, Nan::New("recovered").ToLocalChecked(), Nan::True());
+  }
 
-  if (nonce > 0)
+  if (action == FREE || !device->IsEnabled())
   {
-    queue.enqueueWriteBuffer(memNonce, CL_TRUE, 0, sizeof(cl_uint), &zero);
+    device->SetReady(false);
+    Nan::Set(obj, Nan::New("ready").ToLocalChecked(), Nan::False());
+    v8::Local<v8::Value> argv[] = {Nan::Null(), obj};
+    callback->Call(2, argv, async_resource);
+    return;
   }
 
-  return nonce;
+  device->SetReady(true);
+  miner->JoinCurrentJob(device);
+
+  Nan::Set(obj, Nan::New("ready").ToLocalChecked(), Nan::True());
+  Nan::Set(obj, Nan::New("buildTime").ToLocalChecked(), Nan::New(device->GetBuildTime()));
+  Nan::Set(obj, Nan::New("buildCacheHit").ToLocalChecked(), Nan::New(device->IsBuildCacheHit()));
+
+  v8::Local<v8::Value> argv[] = {Nan::Null(), obj};
+  callback->Call(2, argv, async_resource);
 }
 
-void MinerThread::MineNonces(uint32_t workId, nimiq_block_header *blockHeader, const MinerProgress &progress)
+void DeviceWorker::HandleErrorCallback()
 {
-  std::lock_guard<std::mutex> lock(mutex);
+  Nan::HandleScope scope;
 
-  SetBlockHeader(blockHeader);
+  v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+  Nan::Set(obj, Nan::New("device").ToLocalChecked(), Nan::New(device->GetDeviceIndex()));
 
-  while (miner->IsMiningEnabled())
+  if (action == RECOVER)
   {
-    if (workId != miner->GetWorkId())
-    {
-      break;
-    }
-    uint64_t startNonce = miner->GetNextStartNonce(noncesPerRun);
-    if (startNonce + noncesPerRun > UINT32_MAX)
-    {
-      break;
-    }
-
-    uint32_t nonce = MineNonces(startNonce, miner->GetShareCompact());
-    progress.Send(&nonce, 1);
+    device->EndRecovery(false, time, ErrorMessage());
+    Nan::Set(obj, Nan::New("recovered").ToLocalChecked(), Nan::False());
   }
+
+  v8::Local<v8::Value> argv[] = {Nan::Error(ErrorMessage()), obj};
+  callback->Call(2, argv, async_resource);
 }
 
 /*
 * MinerWorker
 */
 
-MinerWorker::MinerWorker(Nan::Callback *callback, Device *device, MinerThread *minerThread, uint32_t workId, nimiq_block_header blockHeader)
-    : AsyncProgressQueueWorker(callback), device(device), minerThread(minerThread), workId(workId), blockHeader(blockHeader)
+MinerWorker::MinerWorker(Nan::Callback *callback, Miner *miner, Device *device, uint32_t generation, uint32_t threadIndex, uint32_t noncesPerRun,
+                         uint32_t workId, uint64_t headerHash, work_header blockHeader)
+    : AsyncProgressQueueWorker(callback), miner(miner), device(device),
+      generation(generation), threadIndex(threadIndex), noncesPerRun(noncesPerRun), workId(workId), headerHash(headerHash), blockHeader(blockHeader)
 {
 }
 
@@ -752,7 +4045,7 @@ void MinerWorker::Execute(const MinerProgress &progress)
 {
   try
   {
-    minerThread->MineNonces(workId, &blockHeader, progress);
+    device->MineNonces(generation, threadIndex, workId, &blockHeader, progress);
   }
   catch (std::exception &e)
   {
@@ -760,34 +4053,89 @@ void MinerWorker::Execute(const MinerProgress &progress)
   }
 }
 
-void MinerWorker::HandleProgressCallback(const uint32_t *nonce, size_t count)
+v8::Local<v8::Object> MinerWorker::NewResultObject(bool done)
 {
-  Nan::HandleScope scope;
+  char headerHashHex[17];
+  snprintf(headerHashHex, sizeof(headerHashHex), "%016llx", (unsigned long long)headerHash);
 
   v8::Local<v8::Object> obj = Nan::New<v8::Object>();
-  Nan::Set(obj, Nan::New("done").ToLocalChecked(), Nan::New(false));
+  Nan::Set(obj, Nan::New("done").ToLocalChecked(), Nan::New(done));
   Nan::Set(obj, Nan::New("device").ToLocalChecked(), Nan::New(device->GetDeviceIndex()));
-  Nan::Set(obj, Nan::New("thread").ToLocalChecked(), Nan::New(minerThread->GetThreadIndex()));
-  Nan::Set(obj, Nan::New("noncesPerRun").ToLocalChecked(), Nan::New(minerThread->GetNoncesPerRun()));
-  Nan::Set(obj, Nan::New("nonce").ToLocalChecked(), Nan::New(*nonce));
+  Nan::Set(obj, Nan::New("thread").ToLocalChecked(), Nan::New(threadIndex));
+  Nan::Set(obj, Nan::New("noncesPerRun").ToLocalChecked(), Nan::New(noncesPerRun));
+  Nan::Set(obj, Nan::New("workId").ToLocalChecked(), Nan::New(workId));
+  Nan::Set(obj, Nan::New("headerHash").ToLocalChecked(), Nan::New(headerHashHex).ToLocalChecked());
+  return obj;
+}
+
+void MinerWorker::HandleProgressCallback(const MinerResult *result, size_t count)
+{
+  Nan::HandleScope scope;
+
+  uint32_t nonce = result->nonce;
+  bool stale = (nonce > 0 && !miner->IsResultValid(workId, *result));
+  if (nonce > 0 && result->block)
+  {
+    miner->ReportBlock(stale);
+  }
+  if (stale)
+  {
+    // Found on superseded work, submitting it would only get it rejected
+    miner->ReportStaleResult();
+    nonce = 0;
+  }
+
+  v8::Local<v8::Object> obj = NewResultObject(false);
+  Nan::Set(obj, Nan::New("shareCompact").ToLocalChecked(), Nan::New(result->shareCompact));
+  Nan::Set(obj, Nan::New("hashes").ToLocalChecked(), Nan::New(result->hashes));
+  Nan::Set(obj, Nan::New("nonce").ToLocalChecked(), Nan::New(nonce));
+  Nan::Set(obj, Nan::New("block").ToLocalChecked(), Nan::New(nonce > 0 && result->block));
+
+  // Share latency stages up to here, process.hrtime() nanoseconds
+  int64_t callbackStart = Tracer::Now();
+  if (nonce > 0)
+  {
+    Nan::Set(obj, Nan::New("found").ToLocalChecked(), Nan::New((double)result->found));
+    Nan::Set(obj, Nan::New("sent").ToLocalChecked(), Nan::New((double)result->sent));
+    Nan::Set(obj, Nan::New("received").ToLocalChecked(), Nan::New((double)callbackStart));
+  }
 
   v8::Local<v8::Value> argv[] = {Nan::Null(), obj};
   callback->Call(2, argv, async_resource);
+
+  // Queueing in libuv until the main thread picks the result up, then the JS callback itself
+  Tracer *tracer = miner->GetTracer();
+  if (tracer != nullptr && tracer->IsActive())
+  {
+    uint32_t pid = device->GetDeviceIndex();
+    tracer->Span("deliver", "js", pid, TRACE_TID_JS + 1 + threadIndex, result->sent, callbackStart);
+    tracer->Span("callback", "js", pid, TRACE_TID_JS, callbackStart, Tracer::Now(), "\"thread\": " + std::to_string(threadIndex));
+    if (nonce > 0)
+    {
+      tracer->Instant(result->block ? "block" : "share", "js", pid, TRACE_TID_JS, callbackStart, "\"nonce\": " + std::to_string(nonce));
+    }
+  }
 }
 
 void MinerWorker::HandleOKCallback()
 {
   Nan::HandleScope scope;
 
-  v8::Local<v8::Object> obj = Nan::New<v8::Object>();
-  Nan::Set(obj, Nan::New("done").ToLocalChecked(), Nan::New(true));
-  Nan::Set(obj, Nan::New("device").ToLocalChecked(), Nan::New(device->GetDeviceIndex()));
-  Nan::Set(obj, Nan::New("thread").ToLocalChecked(), Nan::New(minerThread->GetThreadIndex()));
-  Nan::Set(obj, Nan::New("noncesPerRun").ToLocalChecked(), Nan::New(minerThread->GetNoncesPerRun()));
+  v8::Local<v8::Object> obj = NewResultObject(true);
   Nan::Set(obj, Nan::New("nonce").ToLocalChecked(), Nan::Undefined());
 
   v8::Local<v8::Value> argv[] = {Nan::Null(), obj};
   callback->Call(2, argv, async_resource);
 }
 
+void MinerWorker::HandleErrorCallback()
+{
+  Nan::HandleScope scope;
+
+  // The watchdog recovers the device, this only tells which one failed
+  v8::Local<v8::Object> obj = NewResultObject(true);
+  v8::Local<v8::Value> argv[] = {Nan::Error(ErrorMessage()), obj};
+  callback->Call(2, argv, async_resource);
+}
+
 NODE_MODULE(nimiq_miner_opencl, Miner::Init);
@@ -8,58 +8,54 @@
 
 #define ARGON2_BLOCK_SIZE 1024
 #define ARGON2_HASH_LENGTH 32
+#define ARGON2_VERSION 0x13
+#define ARGON2_SYNC_POINTS 4
 
-#define THREADS_PER_LANE 32
+#define BLAKE2B_BLOCK_SIZE 128
+
+#define THREADS_PER_LANE 32 // default work-items per hash, the kernels also build with 8 or 16
 
 #define NIMIQ_ARGON2_SALT "nimiqrocks!"
-#define NIMIQ_ARGON2_SALT_LEN 11
 #define NIMIQ_ARGON2_COST 512
 
-#ifdef _WIN32
-#pragma pack(push, 1)
-#endif
+#define NIMIQ_HEADER_LENGTH 146
+#define NIMIQ_NBITS_OFFSET 130 // big endian block target compact
+#define NONCE_LENGTH 4 // big endian, the last bytes of the header
+#define MAX_HEADER_LENGTH 256
+#define MAX_SALT_LENGTH 64
 
-struct
-#ifndef _WIN32
-    __attribute__((packed))
-#endif
-    nimiq_block_header
+// Header of the current job, e.g. a Nimiq block header
+struct work_header
 {
-    // Big endian
-    uint16_t version;
-    uint8_t prev_hash[32];
-    uint8_t interlink_hash[32];
-    uint8_t body_hash[32];
-    uint8_t accounts_hash[32];
-    uint32_t nbits;
-    uint32_t height;
-    uint32_t timestamp;
-    uint32_t nonce;
+    uint8_t data[MAX_HEADER_LENGTH];
+    uint32_t length;
 };
 
-struct
-#ifndef _WIN32
-    __attribute__((packed))
-#endif
-    initial_seed
+#define PERSISTENT_MAX_RESULTS 16
+
+// Control block of the persistent kernel, see persistent.hpp
+struct persistent_control
 {
-    uint32_t lanes;
-    uint32_t hash_len;
-    uint32_t memory_cost;
-    uint32_t iterations;
-    uint32_t version;
-    uint32_t type;
-    uint32_t header_len;
-    nimiq_block_header header;
-    uint32_t salt_len;
-    uint8_t salt[NIMIQ_ARGON2_SALT_LEN];
-    uint32_t secret_len;
-    uint32_t extra_len;
-    uint8_t padding[59];
+    uint32_t stop;
+    uint32_t done;
+    uint32_t results;
+    uint32_t block; // nonce that meets the block target
+    uint32_t nonces[PERSISTENT_MAX_RESULTS];
 };
 
-#ifdef _WIN32
-#pragma pack(pop)
-#endif
+#define REF_PROFILE_OFFSETS 64
+
+// Reference locality counters of the -DPROFILE_REFS build, see argon2d.hpp
+struct ref_profile
+{
+    uint32_t local_hits;
+    uint32_t global_misses;
+    uint32_t offsets[REF_PROFILE_OFFSETS + 1]; // offsets[i] counts ref_offset i + 1, the last one everything above
+};
+
+#define TMTO_DEPTH 4 // nesting levels of block recomputation, deeper nonces are skipped
+
+// Global blocks per nonce when only every k-th block is stored, see argon2d.hpp
+#define TMTO_BLOCKS(cost, k) (3 + ((cost) - 1) / (k) + TMTO_DEPTH * (k))
 
 #endif /* MINER_H_ */
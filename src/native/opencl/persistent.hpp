@@ -0,0 +1,95 @@
+/*
+* Persistent mining kernel
+* a single launch works through a whole chunk of nonces,
+* work-groups take nonces from a device-side counter until the chunk is exhausted or the host sets the stop flag
+*/
+
+#include <string>
+
+std::string srcPersistent{R"====(
+#define PERSISTENT_MAX_RESULTS 16
+
+// Control block, mapped on the host while the kernel runs
+#define CONTROL_STOP 0
+#define CONTROL_DONE 1
+#define CONTROL_RESULTS 2
+#define CONTROL_BLOCK 3
+#define CONTROL_NONCES 4
+
+__kernel
+__attribute__((reqd_work_group_size(THREADS_PER_LANE, JOBS_PER_BLOCK, 1)))
+void mine_persistent(__local struct block_g *shmem, global struct block_g *memory, global ulong *inseed,
+                     volatile global uint *control, volatile global uint *next_job,
+                     uint start_nonce, uint nonce_count, uint share_compact, uint block_compact)
+{
+  uint slot = get_global_id(1);
+  uint warp = get_local_id(1);
+  uint thread = get_local_id(0);
+  uint nonces_per_run = get_global_size(1);
+
+  __local struct block_g *cache = &shmem[warp * CACHE_STRIDE];
+  __local uint first_job;
+#ifdef PROFILE_REFS
+  __local uint ref_counts[REF_PROFILE_SIZE]; // not reported in persistent mode
+#endif
+
+  ulong target[4];
+  compact_to_target(share_compact, target);
+  ulong block_target[4];
+  if (block_compact != 0)
+  {
+    compact_to_target(block_compact, block_target);
+  }
+
+  memory += slot;
+
+  for (;;)
+  {
+    if (warp == 0 && thread == 0)
+    {
+      first_job = control[CONTROL_STOP] ? nonce_count : atomic_add(next_job, JOBS_PER_BLOCK);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint first = first_job;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (first >= nonce_count)
+    {
+      break;
+    }
+
+    // Warps past the end of the chunk keep hashing garbage so that barriers stay uniform
+    uint job = first + warp;
+    bool active = (job < nonce_count);
+    uint nonce = start_nonce + job;
+
+    if (active && thread < 2)
+    {
+      fill_first_block(memory + thread * nonces_per_run, inseed, nonce, thread);
+    }
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    fill_memory(cache, memory, thread, nonces_per_run REF_PROFILE_ARG);
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    if (active && thread == 0 && nonce_valid(memory, nonces_per_run))
+    {
+      ulong hash[8];
+      hash_last_block(memory + LAST_BLOCK_SLOT * nonces_per_run, hash);
+      if (block_compact != 0 && is_proof_of_work(hash, block_target))
+      {
+        atomic_cmpxchg(&control[CONTROL_BLOCK], 0, nonce);
+      }
+      else if (is_proof_of_work(hash, target))
+      {
+        uint idx = atomic_inc(&control[CONTROL_RESULTS]);
+        if (idx < PERSISTENT_MAX_RESULTS)
+        {
+          control[CONTROL_NONCES + idx] = nonce;
+        }
+      }
+      atomic_inc(&control[CONTROL_DONE]);
+    }
+  }
+}
+)===="};